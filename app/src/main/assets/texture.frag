@@ -16,10 +16,13 @@
 
 #version 450
 
-layout (binding = 0) uniform sampler2D tex;
+// Fixed size texture table for devices without descriptor indexing. The index has to be
+// dynamically uniform, so every draw samples a single texture.
+layout (binding = 0) uniform sampler2D textures[16];
 layout (location = 0) in vec2 inTexPos;
+layout (location = 1) flat in uint inTextureIndex;
 layout (location = 0) out vec4 outFragColor;
 
 void main() {
-    outFragColor = texture(tex, inTexPos);
+    outFragColor = texture(textures[inTextureIndex], inTexPos);
 }
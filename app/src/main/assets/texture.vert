@@ -16,16 +16,24 @@
 
 #version 450
 
-layout (push_constant) uniform PushConstants {
+// Pre-rotation is folded into the mvp. Written to the upload ring every frame and bound with a
+// dynamic offset.
+layout (set = 1, binding = 0) uniform SceneUniforms {
    mat4 mvp;
-   mat2 preRotate;
-} pushConstants;
+} sceneUniforms;
 layout (location = 0) in vec2 inVertPos;
 layout (location = 1) in vec2 inTexPos;
+// Per instance attributes, laid out as QuadBatch::Instance
+layout (location = 2) in vec4 inTransform;
+layout (location = 3) in vec2 inOffset;
+layout (location = 4) in vec4 inUvRect;
+layout (location = 5) in uint inTextureIndex;
 layout (location = 0) out vec2 outTexPos;
+layout (location = 1) flat out uint outTextureIndex;
 
 void main() {
-   outTexPos = inTexPos;
-   vec4 clip = pushConstants.mvp * vec4(inVertPos, 0.0, 1.0);
-   gl_Position = vec4(pushConstants.preRotate * vec2(clip.x, clip.y), clip.z, clip.w);
+   outTexPos = inUvRect.xy + inTexPos * inUvRect.zw;
+   outTextureIndex = inTextureIndex;
+   vec2 pos = mat2(inTransform.xy, inTransform.zw) * inVertPos + inOffset;
+   gl_Position = sceneUniforms.mvp * vec4(pos, 0.0, 1.0);
 }
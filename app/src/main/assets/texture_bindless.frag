@@ -0,0 +1,28 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+// Bindless texture table, the texture may change between the quads of one draw
+layout (binding = 0) uniform sampler2D textures[1024];
+layout (location = 0) in vec2 inTexPos;
+layout (location = 1) flat in uint inTextureIndex;
+layout (location = 0) out vec4 outFragColor;
+
+void main() {
+    outFragColor = texture(textures[nonuniformEXT(inTextureIndex)], inTexPos);
+}
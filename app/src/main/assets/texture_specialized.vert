@@ -0,0 +1,45 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#version 450
+
+// Variant of texture.vert specialized per surface transform. The quarter turns count is baked in
+// at pipeline creation, so the rotation compiles down to a swizzle and sign flips, and only the
+// 2D scale of the mvp is left in the uniforms.
+layout (constant_id = 0) const uint kPreRotation = 0;
+layout (set = 1, binding = 0) uniform SceneUniforms {
+   vec2 scale;
+} sceneUniforms;
+layout (location = 0) in vec2 inVertPos;
+layout (location = 1) in vec2 inTexPos;
+// Per instance attributes, laid out as QuadBatch::Instance
+layout (location = 2) in vec4 inTransform;
+layout (location = 3) in vec2 inOffset;
+layout (location = 4) in vec4 inUvRect;
+layout (location = 5) in uint inTextureIndex;
+layout (location = 0) out vec2 outTexPos;
+layout (location = 1) flat out uint outTextureIndex;
+
+void main() {
+   outTexPos = inUvRect.xy + inTexPos * inUvRect.zw;
+   outTextureIndex = inTextureIndex;
+   vec2 pos = mat2(inTransform.xy, inTransform.zw) * inVertPos + inOffset;
+   vec2 clip = pos * sceneUniforms.scale;
+   clip = kPreRotation == 1 ? vec2(-clip.y, clip.x) : clip;
+   clip = kPreRotation == 2 ? -clip : clip;
+   clip = kPreRotation == 3 ? vec2(clip.y, -clip.x) : clip;
+   gl_Position = vec4(clip, 0.0, 1.0);
+}
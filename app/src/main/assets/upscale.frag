@@ -0,0 +1,31 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#version 450
+
+// The scene only covers uvScale of the offscreen target. uvMax stops half a texel short of that,
+// so the bilinear footprint never reaches the stale texels outside of it.
+layout (push_constant) uniform PushConstants {
+    vec2 uvScale;
+    vec2 uvMax;
+} pushConstants;
+layout (binding = 0) uniform sampler2D offscreen;
+layout (location = 0) in vec2 inTexPos;
+layout (location = 0) out vec4 outFragColor;
+
+void main() {
+    outFragColor = texture(offscreen, min(inTexPos * pushConstants.uvScale, pushConstants.uvMax));
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "AssetView.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Utils.h"
+
+AssetView& AssetView::operator=(AssetView&& other) noexcept {
+    if (this != &other) {
+        close();
+        mData = other.mData;
+        mSize = other.mSize;
+        mMapping = other.mMapping;
+        mMappingSize = other.mMappingSize;
+        mAsset = other.mAsset;
+        mCopy = std::move(other.mCopy);
+        other.mData = nullptr;
+        other.mSize = 0;
+        other.mMapping = nullptr;
+        other.mMappingSize = 0;
+        other.mAsset = nullptr;
+    }
+    return *this;
+}
+
+bool AssetView::open(AAssetManager* assetManager, const char* filePath, size_t maxLength) {
+    ASSERT(assetManager);
+    ASSERT(filePath);
+    close();
+
+    const bool isWhole = maxLength == SIZE_MAX;
+    AAsset* asset = AAssetManager_open(assetManager, filePath,
+                                       isWhole ? AASSET_MODE_BUFFER : AASSET_MODE_STREAMING);
+    if (!asset) {
+        return false;
+    }
+    const size_t length = std::min((size_t)AAsset_getLength64(asset), maxLength);
+    if (length == 0) {
+        AAsset_close(asset);
+        return true;
+    }
+
+    // Only succeeds for assets stored uncompressed. The mapping must start on a page boundary,
+    // and the page cache backing it is shared with every other reader of the APK.
+    off64_t start = 0;
+    off64_t fileLength = 0;
+    const int fd = AAsset_openFileDescriptor64(asset, &start, &fileLength);
+    if (fd >= 0) {
+        const off64_t pageSize = sysconf(_SC_PAGESIZE);
+        const off64_t mappingStart = start - start % pageSize;
+        const size_t mappingSize = length + (size_t)(start - mappingStart);
+        void* mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, mappingStart);
+        ::close(fd);
+        if (mapping != MAP_FAILED) {
+            AAsset_close(asset);
+            mMapping = mapping;
+            mMappingSize = mappingSize;
+            mData = static_cast<const uint8_t*>(mapping) + (start - mappingStart);
+            mSize = length;
+            return true;
+        }
+        ALOGD("Failed to map %s, falling back to the asset buffer", filePath);
+    }
+
+    if (isWhole) {
+        const void* buffer = AAsset_getBuffer(asset);
+        if (buffer) {
+            mAsset = asset;
+            mData = static_cast<const uint8_t*>(buffer);
+            mSize = length;
+            return true;
+        }
+    }
+
+    // A short read only inflates the beginning of a compressed asset
+    mCopy.resize(length);
+    const int readLength = AAsset_read(asset, mCopy.data(), length);
+    AAsset_close(asset);
+    ASSERT(readLength == (int)length);
+    mData = mCopy.data();
+    mSize = length;
+    return true;
+}
+
+void AssetView::close() {
+    if (mMapping) {
+        munmap(mMapping, mMappingSize);
+        mMapping = nullptr;
+        mMappingSize = 0;
+    }
+    if (mAsset) {
+        AAsset_close(mAsset);
+        mAsset = nullptr;
+    }
+    mCopy.clear();
+    mCopy.shrink_to_fit();
+    mData = nullptr;
+    mSize = 0;
+}
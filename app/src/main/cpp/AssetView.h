@@ -0,0 +1,55 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/asset_manager.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Read only view of an asset without copying it into the heap. Assets stored uncompressed in the
+// APK are mapped straight from its file descriptor, compressed ones are inflated once into the
+// buffer of the opened AAsset. Only short reads of compressed assets, e.g. image headers, end up
+// copied. Move only, the view stays valid until closed or destroyed.
+class AssetView {
+public:
+    AssetView() = default;
+    ~AssetView() { close(); }
+    AssetView(AssetView&& other) noexcept { *this = std::move(other); }
+    AssetView& operator=(AssetView&& other) noexcept;
+    AssetView(const AssetView&) = delete;
+    AssetView& operator=(const AssetView&) = delete;
+
+    // Views at most maxLength bytes from the start of the asset. Returns false if the asset
+    // doesn't exist.
+    bool open(AAssetManager* assetManager, const char* filePath, size_t maxLength = SIZE_MAX);
+    void close();
+    const uint8_t* data() const { return mData; }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+
+private:
+    const uint8_t* mData = nullptr;
+    size_t mSize = 0;
+    // The view owns exactly one of these, the mapping, the asset buffer or the copy
+    void* mMapping = nullptr;
+    size_t mMappingSize = 0;
+    AAsset* mAsset = nullptr;
+    std::vector<uint8_t> mCopy;
+};
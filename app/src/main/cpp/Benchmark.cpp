@@ -0,0 +1,306 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Benchmark.h"
+
+#include <algorithm>
+
+#include "Utils.h"
+
+// The extra getters return defaultValue if the extra is missing
+static jint getIntExtra(JNIEnv* env, jobject intent, jmethodID getIntExtraMethod, const char* name,
+                        jint defaultValue) {
+    jstring key = env->NewStringUTF(name);
+    const jint value = env->CallIntMethod(intent, getIntExtraMethod, key, defaultValue);
+    env->DeleteLocalRef(key);
+    return value;
+}
+
+static bool getBooleanExtra(JNIEnv* env, jobject intent, jmethodID getBooleanExtraMethod,
+                            const char* name, bool defaultValue) {
+    jstring key = env->NewStringUTF(name);
+    const jboolean value = env->CallBooleanMethod(intent, getBooleanExtraMethod, key,
+                                                  defaultValue ? JNI_TRUE : JNI_FALSE);
+    env->DeleteLocalRef(key);
+    return value == JNI_TRUE;
+}
+
+bool Benchmark::readConfig(ANativeActivity* activity, Config* outConfig) {
+    ASSERT(activity);
+    ASSERT(outConfig);
+
+    JNIEnv* env = nullptr;
+    ASSERT(activity->vm->AttachCurrentThread(&env, nullptr) == JNI_OK);
+
+    jclass activityClass = env->GetObjectClass(activity->clazz);
+    jmethodID getIntent =
+            env->GetMethodID(activityClass, "getIntent", "()Landroid/content/Intent;");
+    jobject intent = env->CallObjectMethod(activity->clazz, getIntent);
+    bool isRequested = false;
+    if (intent) {
+        jclass intentClass = env->GetObjectClass(intent);
+        jmethodID getBooleanExtraMethod =
+                env->GetMethodID(intentClass, "getBooleanExtra", "(Ljava/lang/String;Z)Z");
+        jmethodID getIntExtraMethod =
+                env->GetMethodID(intentClass, "getIntExtra", "(Ljava/lang/String;I)I");
+
+        isRequested = getBooleanExtra(env, intent, getBooleanExtraMethod, "benchmark", false);
+        if (isRequested) {
+            const jint frameCount = getIntExtra(env, intent, getIntExtraMethod, "benchmarkFrames",
+                                                kDefaultFrameCount);
+            const jint quadCount =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkQuads", 0);
+            const jint textureSize =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkTextureSize", 0);
+            const jint rotationInterval =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkRotationInterval", 0);
+            outConfig->frameCount = frameCount > 0 ? (uint32_t)frameCount : kDefaultFrameCount;
+            outConfig->quadCount = quadCount > 0 ? (uint32_t)quadCount : 0;
+            outConfig->textureSize =
+                    textureSize > 0 ? std::min((uint32_t)textureSize, kMaxTextureSize) : 0;
+            outConfig->rotationInterval = rotationInterval > 0 ? (uint32_t)rotationInterval : 0;
+            outConfig->genericPreRotation = getBooleanExtra(env, intent, getBooleanExtraMethod,
+                                                            "benchmarkGenericPreRotation", false);
+            // Indexes Renderer::SamplerMode
+            const jint samplerMode = getIntExtra(
+                    env, intent, getIntExtraMethod, "benchmarkSamplerMode",
+                    static_cast<jint>(Renderer::SamplerMode::TRILINEAR));
+            outConfig->samplerMode = static_cast<Renderer::SamplerMode>(std::clamp(
+                    samplerMode, 0, static_cast<jint>(Renderer::kSamplerModeCount) - 1));
+            const jint offscreenScale =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkOffscreenScale", 0);
+            outConfig->offscreenScalePercent = (uint32_t)std::clamp(offscreenScale, 0, 100);
+            outConfig->depth =
+                    getBooleanExtra(env, intent, getBooleanExtraMethod, "benchmarkDepth", false);
+            outConfig->msaa =
+                    getBooleanExtra(env, intent, getBooleanExtraMethod, "benchmarkMsaa", false);
+            const jint resumeInterval =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkResumeInterval", 0);
+            outConfig->resumeInterval = resumeInterval > 0 ? (uint32_t)resumeInterval : 0;
+            outConfig->computePost = getBooleanExtra(env, intent, getBooleanExtraMethod,
+                                                     "benchmarkComputePost", false);
+            const jint textureCount =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkTextures", 0);
+            outConfig->textureCount = textureCount > 0 ? (uint32_t)textureCount : 0;
+            const jint sceneTextureCount =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkSceneTextures", 0);
+            outConfig->sceneTextureCount = sceneTextureCount > 0 ? (uint32_t)sceneTextureCount : 0;
+            const jint textureBudgetMB =
+                    getIntExtra(env, intent, getIntExtraMethod, "benchmarkTextureBudget", 0);
+            outConfig->textureBudgetMB = textureBudgetMB > 0 ? (uint32_t)textureBudgetMB : 0;
+        }
+        env->DeleteLocalRef(intentClass);
+        env->DeleteLocalRef(intent);
+    }
+    env->DeleteLocalRef(activityClass);
+
+    activity->vm->DetachCurrentThread();
+
+    if (isRequested) {
+        ALOGD("Benchmark requested: frames[%u] quads[%u] textureSize[%u] rotationInterval[%u] "
+              "genericPreRotation[%d] samplerMode[%s] offscreenScale[%u%%] depth[%d] msaa[%d] "
+              "resumeInterval[%u] computePost[%d] textures[%u] sceneTextures[%u] "
+              "textureBudget[%u MB]",
+              outConfig->frameCount, outConfig->quadCount, outConfig->textureSize,
+              outConfig->rotationInterval, outConfig->genericPreRotation,
+              Renderer::getSamplerModeName(outConfig->samplerMode),
+              outConfig->offscreenScalePercent, outConfig->depth, outConfig->msaa,
+              outConfig->resumeInterval, outConfig->computePost, outConfig->textureCount,
+              outConfig->sceneTextureCount, outConfig->textureBudgetMB);
+    }
+    return isRequested;
+}
+
+void Benchmark::configure(const Config& config) {
+    ASSERT(config.frameCount);
+    mConfig = config;
+    mIsConfigured = true;
+}
+
+void Benchmark::applyLoad(Renderer* renderer) const {
+    if (mConfig.quadCount) {
+        renderer->setSceneQuadCount(mConfig.quadCount);
+    }
+    renderer->setSyntheticTextureSize(mConfig.textureSize);
+    renderer->setSpecializedPreRotation(!mConfig.genericPreRotation);
+    renderer->setSamplerMode(mConfig.samplerMode);
+    renderer->setOffscreenRendering(mConfig.offscreenScalePercent != 0);
+    if (mConfig.offscreenScalePercent) {
+        renderer->setOffscreenScale(mConfig.offscreenScalePercent / 100.0F);
+    }
+    renderer->setDepthBuffer(mConfig.depth);
+    renderer->setMultisampling(mConfig.msaa);
+    renderer->setComputePost(mConfig.computePost);
+    renderer->setTextureCount(mConfig.textureCount);
+    renderer->setSceneTextureCount(mConfig.sceneTextureCount);
+    renderer->setTextureBudget((VkDeviceSize)mConfig.textureBudgetMB * 1024 * 1024);
+}
+
+bool Benchmark::onFrameDrawn(Renderer* renderer) {
+    ASSERT(mIsConfigured);
+    if (mFrameCount == mConfig.frameCount) {
+        return false;
+    }
+
+    const int64_t frameNanos = nowNanos();
+    if (mFrameCount == 0) {
+        mStartNanos = frameNanos;
+    } else {
+        mFrameIntervals.push_back(frameNanos - mLastFrameNanos);
+    }
+    mLastFrameNanos = frameNanos;
+
+    // Polled every frame, far more often than the ring of the metrics wraps
+    const FrameMetrics& metrics = renderer->getMetrics();
+    for (uint32_t stage = 0; stage < FrameMetrics::STAGE_COUNT; stage++) {
+        mSampleCounts[stage] = metrics.copySamples((FrameMetrics::Stage)stage,
+                                                   mSampleCounts[stage], &mSamples[stage]);
+    }
+
+    if (++mFrameCount == mConfig.frameCount) {
+        mEndNanos = frameNanos;
+        return true;
+    }
+    if (mConfig.rotationInterval && mFrameCount % mConfig.rotationInterval == 0) {
+        renderer->requestSwapchainRecreation();
+    }
+    if (mConfig.resumeInterval && mFrameCount % mConfig.resumeInterval == 0) {
+        // Sampled as ResumeLatency once the next frame is presented
+        renderer->cycleSurface();
+    }
+    return false;
+}
+
+Benchmark::Summary Benchmark::summarize(std::vector<int64_t> samples) {
+    Summary summary = {
+            .count = (uint32_t)samples.size(),
+            .mean = 0.0,
+            .p50 = 0,
+            .p90 = 0,
+            .p99 = 0,
+            .max = 0,
+    };
+    if (samples.empty()) {
+        return summary;
+    }
+
+    // Nearest-rank percentiles, the same as FrameMetrics but over the whole run
+    std::sort(samples.begin(), samples.end());
+    const size_t count = samples.size();
+    const auto percentile = [&](size_t p) { return samples[(count * p + 99) / 100 - 1]; };
+    double sum = 0.0;
+    for (const int64_t sample : samples) {
+        sum += sample;
+    }
+    summary.mean = sum / count;
+    summary.p50 = percentile(50);
+    summary.p90 = percentile(90);
+    summary.p99 = percentile(99);
+    summary.max = samples[count - 1];
+    return summary;
+}
+
+void Benchmark::writeSummary(FILE* file, const char* name, const Summary& summary, bool isLast) {
+    fprintf(file,
+            "    \"%s\": {\"count\": %u, \"meanUs\": %.1f, \"p50Us\": %.1f, \"p90Us\": %.1f, "
+            "\"p99Us\": %.1f, \"maxUs\": %.1f}%s\n",
+            name, summary.count, summary.mean / 1000.0, summary.p50 / 1000.0,
+            summary.p90 / 1000.0, summary.p99 / 1000.0, summary.max / 1000.0, isLast ? "" : ",");
+}
+
+bool Benchmark::writeReport(const std::string& path, const Renderer& renderer) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        ALOGD("%s: failed to open %s", __FUNCTION__, path.c_str());
+        return false;
+    }
+
+    // The driver reported device name is the only free form string, keep it JSON safe
+    const VkPhysicalDeviceProperties& gpuProperties = renderer.getGpuProperties();
+    std::string deviceName;
+    for (const char* c = gpuProperties.deviceName; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            deviceName += '\\';
+        }
+        deviceName += (*c >= 0x20) ? *c : ' ';
+    }
+
+    const double durationSec = (mEndNanos - mStartNanos) / 1e9;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"device\": {\"name\": \"%s\", \"vendorId\": %u, \"deviceId\": %u, ",
+            deviceName.c_str(), gpuProperties.vendorID, gpuProperties.deviceID);
+    fprintf(file, "\"driverVersion\": %u, \"apiVersion\": \"%u.%u.%u\"},\n",
+            gpuProperties.driverVersion, VK_VERSION_MAJOR(gpuProperties.apiVersion),
+            VK_VERSION_MINOR(gpuProperties.apiVersion), VK_VERSION_PATCH(gpuProperties.apiVersion));
+    fprintf(file, "  \"config\": {\"frames\": %u, \"quads\": %u, \"textureSize\": %u, ",
+            mConfig.frameCount, mConfig.quadCount, mConfig.textureSize);
+    fprintf(file, "\"rotationInterval\": %u, \"genericPreRotation\": %s, ",
+            mConfig.rotationInterval, mConfig.genericPreRotation ? "true" : "false");
+    fprintf(file, "\"samplerMode\": \"%s\", \"offscreenScalePercent\": %u, ",
+            Renderer::getSamplerModeName(mConfig.samplerMode), mConfig.offscreenScalePercent);
+    fprintf(file, "\"depth\": %s, \"msaa\": %s, \"resumeInterval\": %u, ",
+            mConfig.depth ? "true" : "false", mConfig.msaa ? "true" : "false",
+            mConfig.resumeInterval);
+    fprintf(file, "\"computePost\": %s, ", mConfig.computePost ? "true" : "false");
+    fprintf(file, "\"textures\": %u, \"sceneTextures\": %u, \"textureBudgetMB\": %u},\n",
+            mConfig.textureCount, mConfig.sceneTextureCount, mConfig.textureBudgetMB);
+    // Whether the post stage actually ran, and on which queue
+    fprintf(file, "  \"computePostEnabled\": %s,\n",
+            renderer.isComputePostEnabled() ? "true" : "false");
+    fprintf(file, "  \"asyncComputePost\": %s,\n",
+            renderer.isPostOnComputeQueue() ? "true" : "false");
+    // A cold start, to compare with the ResumeLatency samples
+    fprintf(file, "  \"timeToFirstFrameMs\": %.2f,\n", renderer.getTimeToFirstFrameNanos() / 1e6);
+    const double averageFps = durationSec > 0.0 ? mFrameIntervals.size() / durationSec : 0.0;
+    fprintf(file, "  \"durationSec\": %.3f,\n", durationSec);
+    fprintf(file, "  \"averageFps\": %.2f,\n", averageFps);
+    // Compare runs of different sampler modes to see what mipmapping saves
+    const double textureReadMB = renderer.estimateTextureReadBytes() / (1024.0 * 1024.0);
+    fprintf(file, "  \"estimatedTextureReadMBPerFrame\": %.2f,\n", textureReadMB);
+    fprintf(file, "  \"estimatedTextureReadMBps\": %.1f,\n", textureReadMB * averageFps);
+    // What keeping the transient attachments on tile saves, compare runs with and without depth
+    // and MSAA for the measured cost
+    const Renderer::AttachmentTraffic traffic = renderer.estimateAttachmentTraffic();
+    fprintf(file, "  \"attachmentsLazilyAllocated\": %s,\n",
+            renderer.areAttachmentsLazilyAllocated() ? "true" : "false");
+    fprintf(file, "  \"estimatedAttachmentMBPerFrame\": %.2f,\n",
+            traffic.bytes / (1024.0 * 1024.0));
+    fprintf(file, "  \"estimatedOffTileAttachmentMBPerFrame\": %.2f,\n",
+            traffic.offTileBytes / (1024.0 * 1024.0));
+    // Hits sampled the full texture, misses the mip tail or the placeholder while it streamed in
+    const Renderer::TextureCacheStatistics textureCache = renderer.getTextureCacheStatistics();
+    fprintf(file, "  \"textureCache\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, ",
+            (unsigned long long)textureCache.hitCount, (unsigned long long)textureCache.missCount,
+            (unsigned long long)textureCache.evictionCount);
+    fprintf(file, "\"residentMB\": %.2f, ", textureCache.residentBytes / (1024.0 * 1024.0));
+    if (textureCache.budgetBytes == UINT64_MAX) {
+        fprintf(file, "\"budgetMB\": null},\n");
+    } else {
+        fprintf(file, "\"budgetMB\": %.2f},\n", textureCache.budgetBytes / (1024.0 * 1024.0));
+    }
+    fprintf(file, "  \"metrics\": {\n");
+    writeSummary(file, "FrameInterval", summarize(mFrameIntervals), false);
+    for (uint32_t stage = 0; stage < FrameMetrics::STAGE_COUNT; stage++) {
+        writeSummary(file, FrameMetrics::getStageName((FrameMetrics::Stage)stage),
+                     summarize(mSamples[stage]), stage + 1 == FrameMetrics::STAGE_COUNT);
+    }
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+
+    const bool isWritten = fclose(file) == 0;
+    ALOGD("%s: %s %s", __FUNCTION__, isWritten ? "wrote" : "failed to write", path.c_str());
+    return isWritten;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/native_activity.h>
+
+#include <array>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "FrameMetrics.h"
+#include "Renderer.h"
+
+// Drives the renderer for a fixed number of frames at a given load, and writes a JSON report of
+// the frame interval and of every FrameMetrics stage, e.g. GPU time, fence wait and swapchain
+// recreation cost, along with an estimate of the texture bandwidth. Requested through extras of
+// the launch intent, for example
+//
+//   adb shell am start -n com.google.vkdemo/android.app.NativeActivity --ez benchmark true
+//       --ei benchmarkFrames 1000 --ei benchmarkQuads 4096 --ei benchmarkTextureSize 2048
+//       --ei benchmarkRotationInterval 120 --ez benchmarkGenericPreRotation false
+//       --ei benchmarkSamplerMode 2 --ei benchmarkOffscreenScale 75 --ez benchmarkDepth true
+//       --ez benchmarkMsaa true --ei benchmarkResumeInterval 200 --ez benchmarkComputePost true
+//       --ei benchmarkTextures 8 --ei benchmarkSceneTextures 2 --ei benchmarkTextureBudget 2
+//
+// benchmarkSamplerMode indexes Renderer::SamplerMode, 0 to 3 for nearest, bilinear, trilinear and
+// anisotropic. benchmarkOffscreenScale renders the scene offscreen at the given percentage of the
+// swapchain size and upscales it, 0 or none renders to the swapchain directly. benchmarkDepth and
+// benchmarkMsaa add a transient depth attachment and 4x MSAA resolved on tile.
+// benchmarkResumeInterval releases and resumes the surface every so many frames, the way losing
+// and getting back the window does. benchmarkComputePost replaces the upscale pass with the
+// compute post stage, so it needs benchmarkOffscreenScale. benchmarkTextures streams that many
+// textures, of which the scene samples a moving window of benchmarkSceneTextures, and
+// benchmarkTextureBudget caps their memory in MB, so that the ones out of the window get evicted.
+// The report goes to benchmark.json in the app's internal data directory, and the activity
+// finishes once it has been written.
+class Benchmark {
+public:
+    struct Config {
+        uint32_t frameCount;
+        // Quads the scene is split into, 0 keeps the default scene
+        uint32_t quadCount;
+        // Size of a generated square texture replacing the sample texture, 0 keeps the sample
+        uint32_t textureSize;
+        // Frames between two forced swapchain recreations, 0 for none
+        uint32_t rotationInterval;
+        // Folds the pre-rotation into the mvp uniform instead of specializing the pipeline
+        bool genericPreRotation;
+        Renderer::SamplerMode samplerMode;
+        // Percentage of the swapchain size the scene renders at offscreen, 0 to render directly
+        uint32_t offscreenScalePercent;
+        bool depth;
+        bool msaa;
+        // Frames between two surface release and resume cycles, 0 for none
+        uint32_t resumeInterval;
+        bool computePost;
+        // Streamed textures, 0 keeps the single sample texture
+        uint32_t textureCount;
+        // Textures the scene samples at once, 0 for all of them
+        uint32_t sceneTextureCount;
+        // Texture memory budget, 0 keeps the one derived from VK_EXT_memory_budget
+        uint32_t textureBudgetMB;
+    };
+
+    // Returns false if the launch intent did not ask for a benchmark. Attaches the calling thread
+    // to the VM for the duration of the call.
+    static bool readConfig(ANativeActivity* activity, Config* outConfig);
+
+    explicit Benchmark() {}
+    void configure(const Config& config);
+    bool isConfigured() const { return mIsConfigured; }
+    // Applies the load, call before Renderer::initialize
+    void applyLoad(Renderer* renderer) const;
+    // Call after each drawn frame, returns true once, right after the last frame
+    bool onFrameDrawn(Renderer* renderer);
+    bool writeReport(const std::string& path, const Renderer& renderer) const;
+
+private:
+    struct Summary {
+        uint32_t count;
+        double mean;
+        int64_t p50;
+        int64_t p90;
+        int64_t p99;
+        int64_t max;
+    };
+
+    static Summary summarize(std::vector<int64_t> samples);
+    static void writeSummary(FILE* file, const char* name, const Summary& summary, bool isLast);
+
+    Config mConfig = {};
+    bool mIsConfigured = false;
+    uint32_t mFrameCount = 0;
+    int64_t mStartNanos = 0;
+    int64_t mLastFrameNanos = 0;
+    int64_t mEndNanos = 0;
+    std::vector<int64_t> mFrameIntervals;
+    // Every sample of each stage, drained from the renderer metrics after each frame
+    std::array<std::vector<int64_t>, FrameMetrics::STAGE_COUNT> mSamples;
+    std::array<uint64_t, FrameMetrics::STAGE_COUNT> mSampleCounts = {};
+
+    static constexpr const uint32_t kDefaultFrameCount = 1000;
+    // Keeps a generated texture within the staging ring of TextureStreamer
+    static constexpr const uint32_t kMaxTextureSize = 2048;
+};
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Bounded lock free queue for trivially copyable commands. Each slot carries a sequence number
+// that tells producers and consumers whether it is free for the current lap, so neither side ever
+// takes a lock or waits on the other. Any thread may push or pop.
+template <typename T, uint32_t kCapacity>
+class CommandQueue {
+    static_assert(kCapacity && (kCapacity & (kCapacity - 1)) == 0, "capacity must be a power of 2");
+
+public:
+    explicit CommandQueue() {
+        for (uint32_t i = 0; i < kCapacity; i++) {
+            mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the queue is full
+    bool push(const T& value) {
+        uint32_t pos = mTail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = mSlots[pos & (kCapacity - 1)];
+            const uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const int32_t diff = (int32_t)(sequence - pos);
+            if (diff == 0) {
+                if (mTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = mTail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns false if the queue is empty
+    bool pop(T* outValue) {
+        uint32_t pos = mHead.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = mSlots[pos & (kCapacity - 1)];
+            const uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const int32_t diff = (int32_t)(sequence - (pos + 1));
+            if (diff == 0) {
+                if (mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *outValue = slot.value;
+                    slot.sequence.store(pos + kCapacity, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = mHead.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        T value;
+    };
+
+    std::array<Slot, kCapacity> mSlots;
+    // Keep the producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<uint32_t> mTail{0};
+    alignas(64) std::atomic<uint32_t> mHead{0};
+};
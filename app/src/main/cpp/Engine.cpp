@@ -16,45 +16,294 @@
 
 #include "Engine.h"
 
+#include <android/choreographer.h>
+
 #include "Utils.h"
 
-bool Engine::isReady() {
-    std::lock_guard<std::mutex> lock(mLock);
-    return mIsRendererReady;
+Engine::Engine(ANativeActivity* activity, const Benchmark::Config* benchmarkConfig)
+      : mActivity(activity),
+        mInternalDataPath(activity->internalDataPath ? activity->internalDataPath : "") {
+    // Set before the render thread starts, which owns it from then on
+    if (benchmarkConfig) {
+        mBenchmark.configure(*benchmarkConfig);
+    }
+    std::promise<ALooper*> looperPromise;
+    std::future<ALooper*> looperFuture = looperPromise.get_future();
+    mRenderThread = std::thread(&Engine::renderThreadMain, this, &looperPromise);
+    // Wait for the looper so that commands can wake the render thread from now on
+    mRenderLooper = looperFuture.get();
 }
 
-void Engine::drawFrame() {
-    std::lock_guard<std::mutex> lock(mLock);
-    if (mIsRendererReady) {
-        mRenderer.drawFrame();
-    }
+Engine::~Engine() {
+    postCommand({
+            .type = CommandType::EXIT,
+            .window = nullptr,
+            .assetManager = nullptr,
+            .width = 0,
+            .height = 0,
+            .latencyMode = Renderer::LatencyMode::BALANCED,
+            .enable = false,
+            .done = nullptr,
+    });
+    mRenderThread.join();
+    ALooper_release(mRenderLooper);
+}
+
+bool Engine::isReady() {
+    return mIsRendererReady.load(std::memory_order_acquire);
 }
 
 void Engine::onInitWindow(ANativeWindow* window, AAssetManager* assetManager) {
     ALOGD("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> lock(mLock);
-    mRenderer.initialize(window, assetManager);
-    mIsRendererReady = true;
+    postCommand({
+            .type = CommandType::INIT_WINDOW,
+            .window = window,
+            .assetManager = assetManager,
+            .width = 0,
+            .height = 0,
+            .latencyMode = Renderer::LatencyMode::BALANCED,
+            .enable = false,
+            .done = nullptr,
+    });
 }
 
 void Engine::onWindowResized(uint32_t width, uint32_t height) {
     ALOGD("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> lock(mLock);
-    if (mIsRendererReady) {
-        mRenderer.updateSurface(width, height);
-    }
+    postCommand({
+            .type = CommandType::RESIZE,
+            .window = nullptr,
+            .assetManager = nullptr,
+            .width = width,
+            .height = height,
+            .latencyMode = Renderer::LatencyMode::BALANCED,
+            .enable = false,
+            .done = nullptr,
+    });
 }
 
 void Engine::onTermWindow() {
     ALOGD("%s", __FUNCTION__);
-    std::lock_guard<std::mutex> lock(mLock);
+    // The window is released as soon as the app command returns, so this is the one place that
+    // has to wait for the render thread, at most for the frame in flight.
+    std::promise<void> done;
+    std::future<void> doneFuture = done.get_future();
+    postCommand({
+            .type = CommandType::TERM_WINDOW,
+            .window = nullptr,
+            .assetManager = nullptr,
+            .width = 0,
+            .height = 0,
+            .latencyMode = Renderer::LatencyMode::BALANCED,
+            .enable = false,
+            .done = &done,
+    });
+    doneFuture.wait();
+}
+
+void Engine::onLowMemory() {
+    ALOGD("%s", __FUNCTION__);
+    postCommand({
+            .type = CommandType::LOW_MEMORY,
+            .window = nullptr,
+            .assetManager = nullptr,
+            .width = 0,
+            .height = 0,
+            .latencyMode = Renderer::LatencyMode::BALANCED,
+            .enable = false,
+            .done = nullptr,
+    });
+}
+
+void Engine::setLatencyMode(Renderer::LatencyMode mode) {
+    ALOGD("%s: %u", __FUNCTION__, static_cast<uint32_t>(mode));
+    postCommand({
+            .type = CommandType::SET_LATENCY_MODE,
+            .window = nullptr,
+            .assetManager = nullptr,
+            .width = 0,
+            .height = 0,
+            .latencyMode = mode,
+            .enable = false,
+            .done = nullptr,
+    });
+}
+
+void Engine::setCommandBufferReuse(bool enable) {
+    ALOGD("%s: %d", __FUNCTION__, enable);
+    postCommand({
+            .type = CommandType::SET_COMMAND_BUFFER_REUSE,
+            .window = nullptr,
+            .assetManager = nullptr,
+            .width = 0,
+            .height = 0,
+            .latencyMode = Renderer::LatencyMode::BALANCED,
+            .enable = enable,
+            .done = nullptr,
+    });
+}
+
+FrameMetrics::Summary Engine::getFrameMetrics(FrameMetrics::Stage stage) {
+    // FrameMetrics is a lock free ring buffer, so this never waits for the render thread
+    return mRenderer.getMetrics().getSummary(stage);
+}
+
+void Engine::postCommand(const Command& command) {
+    // Commands are rare lifecycle events, the queue should never fill up
+    ASSERT(mCommands.push(command));
+    ALooper_wake(mRenderLooper);
+}
+
+void Engine::renderThreadMain(std::promise<ALooper*>* looperPromise) {
+    ALooper* looper = ALooper_prepare(0);
+    ALooper_acquire(looper);
+    mChoreographer = AChoreographer_getInstance();
+    ASSERT(mChoreographer);
+    looperPromise->set_value(looper);
+
+    while (!mExitRequested) {
+        // Wakes up for frame callbacks and for ALooper_wake from postCommand
+        ALooper_pollOnce(-1, nullptr, nullptr, nullptr);
+        processCommands();
+    }
+
     if (mIsRendererReady) {
-        mRenderer.destroy();
+        mGovernor.stop();
+        mPacer.stop();
         mIsRendererReady = false;
     }
+    // Also destroys a renderer kept alive without a window
+    mRenderer.destroy();
+}
+
+void Engine::processCommands() {
+    Command command;
+    while (mCommands.pop(&command)) {
+        handleCommand(command);
+        if (command.done) {
+            command.done->set_value();
+        }
+    }
+}
+
+void Engine::handleCommand(const Command& command) {
+    switch (command.type) {
+        case CommandType::INIT_WINDOW:
+            if (mIsRendererReady) {
+                break;
+            }
+            if (mRenderer.hasDevice()) {
+                // Everything but the surface survived the last window
+                if (!mBenchmark.isConfigured()) {
+                    applyGovernorRenderScale();
+                }
+                mRenderer.resumeSurface(command.window);
+            } else {
+                if (mBenchmark.isConfigured()) {
+                    mBenchmark.applyLoad(&mRenderer);
+                } else {
+                    // The device is likely still as hot as when the last window went away
+                    applyGovernorRenderScale();
+                }
+                mRenderer.initialize(
+                        command.window, command.assetManager,
+                        mInternalDataPath.empty() ? nullptr : mInternalDataPath.c_str());
+            }
+            mPacer.start(mChoreographer);
+            mPacer.setSwapchainRefreshPeriod(mRenderer.getRefreshDurationNanos());
+            if (!mBenchmark.isConfigured()) {
+                mGovernor.start();
+                mPacer.setMinSwapInterval(mGovernor.getMinSwapInterval());
+            }
+            mIsRendererReady = true;
+            postFrameCallback(0);
+            break;
+        case CommandType::RESIZE:
+            if (mIsRendererReady) {
+                mRenderer.updateSurface(command.width, command.height);
+            }
+            break;
+        case CommandType::TERM_WINDOW:
+            if (mIsRendererReady) {
+                mGovernor.stop();
+                mPacer.stop();
+                mRenderer.releaseSurface();
+                mIsRendererReady = false;
+            }
+            break;
+        case CommandType::LOW_MEMORY:
+            // A renderer drawing to a window is needed, one kept for a fast resume is not
+            if (!mIsRendererReady) {
+                mRenderer.destroy();
+            }
+            break;
+        case CommandType::SET_LATENCY_MODE:
+            // Safe to set before the renderer is ready, it is then picked up by the next initialize
+            mRenderer.setLatencyMode(command.latencyMode);
+            break;
+        case CommandType::SET_COMMAND_BUFFER_REUSE:
+            mRenderer.setCommandBufferReuse(command.enable);
+            break;
+        case CommandType::EXIT:
+            mExitRequested = true;
+            break;
+        default:
+            break;
+    }
+}
+
+void Engine::postFrameCallback(uint32_t delayMillis) {
+    // A callback left over from a previous window keeps the chain going, never start a second one
+    if (mFrameCallbackPending) {
+        return;
+    }
+    mFrameCallbackPending = true;
+    AChoreographer_postFrameCallbackDelayed64(mChoreographer, onChoreographer, this, delayMillis);
+}
+
+void Engine::onChoreographer(int64_t frameTimeNanos, void* data) {
+    auto engine = static_cast<Engine*>(data);
+    engine->mFrameCallbackPending = false;
+    engine->onVsync(frameTimeNanos);
+}
+
+void Engine::onVsync(int64_t frameTimeNanos) {
+    // Pick up a resize or rotation before drawing this frame
+    processCommands();
+    if (!mIsRendererReady) {
+        return;
+    }
+
+    // Benchmarks run at a fixed load, so the governor is left out of them
+    if (!mBenchmark.isConfigured() &&
+        mGovernor.update(frameTimeNanos, mRenderer.getMetrics(), mPacer.getRefreshPeriodNanos())) {
+        mPacer.setMinSwapInterval(mGovernor.getMinSwapInterval());
+        applyGovernorRenderScale();
+    }
+
+    postFrameCallback(mPacer.onVsync(frameTimeNanos, mRenderer.getMetrics()));
+    mRenderer.drawFrame();
+
+    if (mBenchmark.isConfigured() && mBenchmark.onFrameDrawn(&mRenderer)) {
+        finishBenchmark();
+    }
+}
+
+void Engine::finishBenchmark() {
+    if (mInternalDataPath.empty()) {
+        ALOGD("%s: no data path to write the report to", __FUNCTION__);
+    } else {
+        mBenchmark.writeReport(mInternalDataPath + "/" + kBenchmarkReportFile, mRenderer);
+    }
+    // Only posts a request to the main thread, so safe to call from here
+    ANativeActivity_finish(mActivity);
 }
 
-uint32_t Engine::getDelayMillis(int64_t /*frameTimeNanos*/) {
-    // we can play around with frameTimeNanos to add more dynamic callback delay control
-    return kDelayMillis;
+void Engine::applyGovernorRenderScale() {
+    // The offscreen target follows the scale from the next frame on, while the swapchain has to
+    // be recreated for it
+    if (mRenderer.isOffscreenRenderingEnabled()) {
+        mRenderer.setOffscreenScale(mGovernor.getRenderScale());
+    } else {
+        mRenderer.setRenderScale(mGovernor.getRenderScale());
+    }
 }
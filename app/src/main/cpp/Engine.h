@@ -16,28 +16,94 @@
 
 #pragma once
 
+#include <android/looper.h>
 #include <android_native_app_glue.h>
 
-#include <mutex>
+#include <atomic>
+#include <future>
+#include <string>
+#include <thread>
 
+#include "Benchmark.h"
+#include "CommandQueue.h"
+#include "FramePacer.h"
 #include "Renderer.h"
+#include "ThermalGovernor.h"
 
+// Owns a dedicated render thread with its own looper and Choreographer. Lifecycle and resize
+// events are posted to it through a lock free queue, so the caller never blocks on the GPU.
+//
+// Only the surface follows the window. The device and everything else the renderer created stay
+// alive while the app has no window, so that coming back only costs a swapchain, until the
+// system runs low on memory or the engine goes away.
 class Engine {
 public:
-    explicit Engine() : mIsRendererReady(false) {}
+    // The renderer persists data across launches in the internal data path of the activity. Runs
+    // the benchmark if benchmarkConfig is not nullptr, and finishes the activity once it is done.
+    explicit Engine(ANativeActivity* activity, const Benchmark::Config* benchmarkConfig);
+    ~Engine();
     bool isReady();
-    void drawFrame();
     void onInitWindow(ANativeWindow* window, AAssetManager* assetManager);
     void onWindowResized(uint32_t width, uint32_t height);
+    // Blocks until the render thread has stopped using the window
     void onTermWindow();
-    uint32_t getDelayMillis(int64_t frameTimeNanos);
+    // Destroys the renderer if it is kept alive without a window, the next window initializes
+    // from scratch
+    void onLowMemory();
+    void setLatencyMode(Renderer::LatencyMode mode);
+    void setCommandBufferReuse(bool enable);
+    // Lock free, so it is safe to poll from any thread while frames are being drawn
+    FrameMetrics::Summary getFrameMetrics(FrameMetrics::Stage stage);
 
 private:
-    // mLock protects all members below
-    std::mutex mLock;
+    enum class CommandType : uint32_t {
+        INIT_WINDOW = 0,
+        RESIZE,
+        TERM_WINDOW,
+        LOW_MEMORY,
+        SET_LATENCY_MODE,
+        SET_COMMAND_BUFFER_REUSE,
+        EXIT,
+    };
+
+    struct Command {
+        CommandType type;
+        ANativeWindow* window;
+        AAssetManager* assetManager;
+        uint32_t width;
+        uint32_t height;
+        Renderer::LatencyMode latencyMode;
+        bool enable;
+        // Fulfilled by the render thread once the command is handled, may be nullptr
+        std::promise<void>* done;
+    };
+
+    void postCommand(const Command& command);
+    void renderThreadMain(std::promise<ALooper*>* looperPromise);
+    void processCommands();
+    void handleCommand(const Command& command);
+    void postFrameCallback(uint32_t delayMillis);
+    static void onChoreographer(int64_t frameTimeNanos, void* data);
+    void onVsync(int64_t frameTimeNanos);
+    void finishBenchmark();
+    // Applies the governor's resolution, through the offscreen scale when the renderer has one
+    void applyGovernorRenderScale();
+
+    ANativeActivity* const mActivity;
+    std::thread mRenderThread;
+    ALooper* mRenderLooper = nullptr;
+    const std::string mInternalDataPath;
+    CommandQueue<Command, 64> mCommands;
+    std::atomic<bool> mIsRendererReady{false};
+
+    // Render thread only members
     Renderer mRenderer;
-    bool mIsRendererReady;
+    FramePacer mPacer;
+    ThermalGovernor mGovernor;
+    AChoreographer* mChoreographer = nullptr;
+    bool mFrameCallbackPending = false;
+    bool mExitRequested = false;
+    Benchmark mBenchmark;
 
-    // defer 13ms to target 60Hz on a 60Hz display or 45Hz on a 90Hz display
-    static constexpr const uint32_t kDelayMillis = 13;
+    static constexpr const char* kBenchmarkReportFile = "benchmark.json";
 };
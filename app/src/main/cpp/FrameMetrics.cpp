@@ -0,0 +1,127 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrameMetrics.h"
+
+#include <algorithm>
+
+#include "Utils.h"
+
+void FrameMetrics::SampleRing::push(int64_t value) {
+    const uint64_t count = mCount.load(std::memory_order_relaxed);
+    mSamples[count & (kSampleCount - 1)].store(value, std::memory_order_relaxed);
+    mCount.store(count + 1, std::memory_order_release);
+}
+
+uint32_t FrameMetrics::SampleRing::snapshot(int64_t* outSamples) const {
+    const uint64_t count = mCount.load(std::memory_order_acquire);
+    const uint32_t valid = (uint32_t)std::min<uint64_t>(count, kSampleCount);
+    for (uint32_t i = 0; i < valid; i++) {
+        outSamples[i] =
+                mSamples[(count - valid + i) & (kSampleCount - 1)].load(std::memory_order_relaxed);
+    }
+    return valid;
+}
+
+uint64_t FrameMetrics::SampleRing::copySince(uint64_t fromCount,
+                                             std::vector<int64_t>* outSamples) const {
+    const uint64_t count = mCount.load(std::memory_order_acquire);
+    if (fromCount > count) {
+        fromCount = 0;
+    }
+    // Only the last kSampleCount samples are still in the ring
+    const uint64_t oldest = count - std::min<uint64_t>(count, kSampleCount);
+    const uint64_t first = std::max(fromCount, oldest);
+    for (uint64_t i = first; i < count; i++) {
+        outSamples->push_back(mSamples[i & (kSampleCount - 1)].load(std::memory_order_relaxed));
+    }
+    return count;
+}
+
+void FrameMetrics::record(Stage stage, int64_t nanos) {
+    ASSERT(stage < STAGE_COUNT);
+    mRings[stage].push(nanos);
+}
+
+FrameMetrics::Summary FrameMetrics::getSummary(Stage stage) const {
+    ASSERT(stage < STAGE_COUNT);
+
+    int64_t samples[kSampleCount];
+    const uint32_t count = mRings[stage].snapshot(samples);
+
+    Summary summary = {
+            .count = count,
+            .p50 = 0,
+            .p95 = 0,
+            .p99 = 0,
+            .max = 0,
+    };
+    if (count == 0) {
+        return summary;
+    }
+
+    // Nearest-rank percentiles over the current window
+    std::sort(samples, samples + count);
+    const auto percentile = [&](uint32_t p) { return samples[(count * p + 99) / 100 - 1]; };
+    summary.p50 = percentile(50);
+    summary.p95 = percentile(95);
+    summary.p99 = percentile(99);
+    summary.max = samples[count - 1];
+    return summary;
+}
+
+uint64_t FrameMetrics::copySamples(Stage stage, uint64_t fromCount,
+                                   std::vector<int64_t>* outSamples) const {
+    ASSERT(stage < STAGE_COUNT);
+    ASSERT(outSamples);
+    return mRings[stage].copySince(fromCount, outSamples);
+}
+
+void FrameMetrics::reset() {
+    for (auto& ring : mRings) {
+        ring.reset();
+    }
+}
+
+const char* FrameMetrics::getStageName(Stage stage) {
+    switch (stage) {
+        case FENCE_WAIT:
+            return "FenceWait";
+        case ACQUIRE:
+            return "Acquire";
+        case RECORD:
+            return "Record";
+        case SUBMIT:
+            return "Submit";
+        case PRESENT:
+            return "Present";
+        case CPU_FRAME:
+            return "CpuFrame";
+        case GPU_RENDER_PASS:
+            return "GpuRenderPass";
+        case PRESENT_LATENCY:
+            return "PresentLatency";
+        case ROTATION_LATENCY:
+            return "RotationLatency";
+        case RECREATE_SWAPCHAIN:
+            return "RecreateSwapchain";
+        case RESUME_LATENCY:
+            return "ResumeLatency";
+        default:
+            break;
+    }
+    return "Unknown";
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Monotonic timestamp in nanoseconds. steady_clock is CLOCK_MONOTONIC on Android, which is the
+// same time base VK_GOOGLE_display_timing reports actualPresentTime in.
+static inline int64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+class FrameMetrics {
+public:
+    enum Stage : uint32_t {
+        FENCE_WAIT = 0,
+        ACQUIRE,
+        RECORD,
+        SUBMIT,
+        PRESENT,
+        CPU_FRAME,
+        GPU_RENDER_PASS,
+        PRESENT_LATENCY,
+        // From the first frame presented against a stale surface transform or size until the
+        // first frame presented on the recreated swapchain, only sampled on rotation
+        ROTATION_LATENCY,
+        // CPU cost of replacing the swapchain, only sampled on recreation
+        RECREATE_SWAPCHAIN,
+        // From resuming on a new window until the first frame presented to it, without the
+        // device level initialization a cold start pays. Only sampled on resume.
+        RESUME_LATENCY,
+        STAGE_COUNT,
+    };
+
+    struct Summary {
+        uint32_t count;
+        int64_t p50;
+        int64_t p95;
+        int64_t p99;
+        int64_t max;
+    };
+
+    explicit FrameMetrics() {}
+
+    // Each stage is only recorded by one thread, any thread may query.
+    void record(Stage stage, int64_t nanos);
+    Summary getSummary(Stage stage) const;
+    // Appends the samples recorded after the first fromCount ones and returns the new count, for
+    // callers that need every sample. Samples already overwritten in the ring are skipped, and
+    // the copy starts over from 0 if the metrics have been reset since.
+    uint64_t copySamples(Stage stage, uint64_t fromCount, std::vector<int64_t>* outSamples) const;
+    void reset();
+    static const char* getStageName(Stage stage);
+
+private:
+    // Power of two so that the ring index wraps with a mask
+    static constexpr const uint32_t kSampleCount = 256;
+
+    // Single producer ring of the most recent samples. Slots are atomic so a reader racing the
+    // writer can never observe a torn value, at worst a sample from the next lap.
+    class SampleRing {
+    public:
+        void push(int64_t value);
+        uint32_t snapshot(int64_t* outSamples) const;
+        uint64_t copySince(uint64_t fromCount, std::vector<int64_t>* outSamples) const;
+        void reset() { mCount.store(0, std::memory_order_release); }
+
+    private:
+        std::array<std::atomic<int64_t>, kSampleCount> mSamples{};
+        std::atomic<uint64_t> mCount{0};
+    };
+
+    std::array<SampleRing, STAGE_COUNT> mRings;
+};
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FramePacer.h"
+
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "Utils.h"
+
+// AChoreographer refresh rate callbacks are only available from API 30, while this app targets
+// API 29, so they are resolved at runtime.
+typedef void (*PFN_refreshRateCallback)(int64_t vsyncPeriodNanos, void* data);
+typedef void (*PFN_AChoreographer_registerRefreshRateCallback)(AChoreographer*,
+                                                               PFN_refreshRateCallback, void*);
+typedef void (*PFN_AChoreographer_unregisterRefreshRateCallback)(AChoreographer*,
+                                                                 PFN_refreshRateCallback, void*);
+
+struct ChoreographerApi {
+    PFN_AChoreographer_registerRefreshRateCallback registerRefreshRateCallback = nullptr;
+    PFN_AChoreographer_unregisterRefreshRateCallback unregisterRefreshRateCallback = nullptr;
+
+    ChoreographerApi() {
+        void* lib = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+        if (!lib) {
+            return;
+        }
+        registerRefreshRateCallback =
+                reinterpret_cast<PFN_AChoreographer_registerRefreshRateCallback>(
+                        dlsym(lib, "AChoreographer_registerRefreshRateCallback"));
+        unregisterRefreshRateCallback =
+                reinterpret_cast<PFN_AChoreographer_unregisterRefreshRateCallback>(
+                        dlsym(lib, "AChoreographer_unregisterRefreshRateCallback"));
+    }
+};
+
+static const ChoreographerApi& getChoreographerApi() {
+    static const ChoreographerApi api;
+    return api;
+}
+
+void FramePacer::start(AChoreographer* choreographer) {
+    ASSERT(choreographer);
+    mChoreographer = choreographer;
+    mLastFrameTimeNanos = 0;
+    mSwapInterval = 1;
+    mHeadroomFrames = 0;
+    mMissedFrames = 0;
+
+    const ChoreographerApi& api = getChoreographerApi();
+    if (api.registerRefreshRateCallback && api.unregisterRefreshRateCallback) {
+        // The callback fires once right after registration with the current refresh period
+        api.registerRefreshRateCallback(mChoreographer, onRefreshRateChanged, this);
+        mRefreshRateCallbackRegistered = true;
+    }
+    ALOGD("%s: refresh rate callback registered = %d", __FUNCTION__,
+          mRefreshRateCallbackRegistered);
+}
+
+void FramePacer::stop() {
+    if (mRefreshRateCallbackRegistered) {
+        getChoreographerApi().unregisterRefreshRateCallback(mChoreographer, onRefreshRateChanged,
+                                                            this);
+        mRefreshRateCallbackRegistered = false;
+    }
+    mChoreographer = nullptr;
+    mRefreshPeriodNanos = 0;
+}
+
+void FramePacer::setSwapchainRefreshPeriod(int64_t refreshPeriodNanos) {
+    mSwapchainRefreshPeriodNanos = refreshPeriodNanos;
+}
+
+void FramePacer::setMinSwapInterval(uint32_t minSwapInterval) {
+    mMinSwapInterval = std::clamp(minSwapInterval, 1U, kMaxSwapInterval);
+}
+
+int64_t FramePacer::getRefreshPeriodNanos() const {
+    // Prefer the Choreographer callback since it follows dynamic refresh rate switches
+    const int64_t refreshPeriodNanos = mRefreshPeriodNanos.load(std::memory_order_relaxed);
+    if (refreshPeriodNanos > 0) {
+        return refreshPeriodNanos;
+    }
+    if (mSwapchainRefreshPeriodNanos > 0) {
+        return mSwapchainRefreshPeriodNanos;
+    }
+    return kDefaultRefreshPeriodNanos;
+}
+
+uint32_t FramePacer::onVsync(int64_t frameTimeNanos, const FrameMetrics& metrics) {
+    const int64_t refreshPeriodNanos = getRefreshPeriodNanos();
+    updateSwapInterval(frameTimeNanos, refreshPeriodNanos, metrics);
+
+    // A delayed callback fires on the first vsync after the delay expires, so aim half a period
+    // before the vsync this frame is meant to start at. That keeps the wake up on the vsync edge,
+    // where the full interval is available for the work, instead of rendering ahead.
+    const int64_t deadlineNanos =
+            frameTimeNanos + refreshPeriodNanos * mSwapInterval - refreshPeriodNanos / 2;
+    const int64_t delayNanos = deadlineNanos - nowNanos();
+    if (delayNanos <= 0) {
+        return 0;
+    }
+    return (uint32_t)((delayNanos + 999999) / 1000000);
+}
+
+void FramePacer::updateSwapInterval(int64_t frameTimeNanos, int64_t refreshPeriodNanos,
+                                    const FrameMetrics& metrics) {
+    // Detect a missed vsync from the callback cadence, which catches stalls no stage time can see
+    bool missed = false;
+    if (mLastFrameTimeNanos) {
+        const int64_t intervalNanos = frameTimeNanos - mLastFrameTimeNanos;
+        missed = intervalNanos > refreshPeriodNanos * mSwapInterval + refreshPeriodNanos / 2;
+    }
+    mLastFrameTimeNanos = frameTimeNanos;
+    mMissedFrames = missed ? mMissedFrames + 1 : 0;
+
+    // The CPU and the GPU work in parallel, so the slower one bounds the frame rate. The fence,
+    // acquire and present stages are left out of the CPU cost since they mostly block on the GPU
+    // and the display, and would otherwise make the pacer chase its own backpressure.
+    const int64_t cpuNanos = metrics.getSummary(FrameMetrics::RECORD).p95 +
+                             metrics.getSummary(FrameMetrics::SUBMIT).p95;
+    const int64_t gpuNanos = metrics.getSummary(FrameMetrics::GPU_RENDER_PASS).p95;
+    const float workNanos = (float)std::max(cpuNanos, gpuNanos) * kWorkMargin;
+    const uint32_t requiredInterval =
+            std::clamp((uint32_t)std::ceil(workNanos / (float)refreshPeriodNanos),
+                       mMinSwapInterval, kMaxSwapInterval);
+
+    const uint32_t oldSwapInterval = mSwapInterval;
+    if (requiredInterval > mSwapInterval) {
+        // Step down right away so the following vsyncs are not missed
+        mSwapInterval = requiredInterval;
+        mHeadroomFrames = 0;
+    } else if (mMissedFrames >= kMissedFrames && mSwapInterval < kMaxSwapInterval) {
+        mSwapInterval++;
+        mMissedFrames = 0;
+        mHeadroomFrames = 0;
+    } else if (requiredInterval < mSwapInterval) {
+        // Step up one interval at a time after the headroom has been stable for a while
+        if (++mHeadroomFrames >= kHeadroomFrames) {
+            mSwapInterval--;
+            mHeadroomFrames = 0;
+        }
+    } else {
+        mHeadroomFrames = 0;
+    }
+
+    if (oldSwapInterval != mSwapInterval) {
+        ALOGD("%s: swap interval %u -> %u, refresh period %lld ns, work %lld ns", __FUNCTION__,
+              oldSwapInterval, mSwapInterval, (long long)refreshPeriodNanos,
+              (long long)workNanos);
+    }
+}
+
+void FramePacer::onRefreshRateChanged(int64_t vsyncPeriodNanos, void* data) {
+    ALOGD("%s: vsync period %lld ns", __FUNCTION__, (long long)vsyncPeriodNanos);
+    auto pacer = static_cast<FramePacer*>(data);
+    pacer->mRefreshPeriodNanos = vsyncPeriodNanos;
+}
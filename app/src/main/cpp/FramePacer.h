@@ -0,0 +1,68 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/choreographer.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "FrameMetrics.h"
+
+// Picks the number of vsyncs each frame spans (the swap interval) from the display refresh period
+// and the measured CPU and GPU frame cost, then schedules the next Choreographer callback so that
+// the frame starts right at the vsync it is meant for.
+class FramePacer {
+public:
+    explicit FramePacer() {}
+    // Must be called on the thread owning the AChoreographer instance
+    void start(AChoreographer* choreographer);
+    void stop();
+    // Refresh period reported by the swapchain, used when refresh rate callbacks are unavailable
+    void setSwapchainRefreshPeriod(int64_t refreshPeriodNanos);
+    // Caps the frame rate at the refresh rate divided by minSwapInterval, from the next vsync on
+    void setMinSwapInterval(uint32_t minSwapInterval);
+    // Returns the delay in milliseconds to post the next frame callback with
+    uint32_t onVsync(int64_t frameTimeNanos, const FrameMetrics& metrics);
+    int64_t getRefreshPeriodNanos() const;
+    uint32_t getSwapInterval() const { return mSwapInterval; }
+
+private:
+    static void onRefreshRateChanged(int64_t vsyncPeriodNanos, void* data);
+    void updateSwapInterval(int64_t frameTimeNanos, int64_t refreshPeriodNanos,
+                            const FrameMetrics& metrics);
+
+    AChoreographer* mChoreographer = nullptr;
+    bool mRefreshRateCallbackRegistered = false;
+    std::atomic<int64_t> mRefreshPeriodNanos{0};
+    int64_t mSwapchainRefreshPeriodNanos = 0;
+
+    int64_t mLastFrameTimeNanos = 0;
+    uint32_t mSwapInterval = 1;
+    uint32_t mMinSwapInterval = 1;
+    uint32_t mHeadroomFrames = 0;
+    uint32_t mMissedFrames = 0;
+
+    static constexpr const int64_t kDefaultRefreshPeriodNanos = 16666667;
+    static constexpr const uint32_t kMaxSwapInterval = 4;
+    // Scales the p95 frame cost by a 15% margin for scheduling jitter
+    static constexpr const float kWorkMargin = 1.15F;
+    // Frames of sustained headroom before stepping to a higher frame rate
+    static constexpr const uint32_t kHeadroomFrames = 120;
+    // Consecutive late callbacks before stepping to a lower frame rate
+    static constexpr const uint32_t kMissedFrames = 2;
+};
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "JobSystem.h"
+
+#include <algorithm>
+
+#include "Utils.h"
+
+void JobSystem::initialize(uint32_t threadCount) {
+    ASSERT(mWorkers.empty());
+    if (threadCount == 0) {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    threadCount = std::clamp(threadCount, 1U, kMaxThreads);
+
+    mStop = false;
+    for (uint32_t i = 1; i < threadCount; i++) {
+        mWorkers.emplace_back(&JobSystem::workerMain, this, i);
+    }
+
+    ALOGD("Successfully created job system: %u threads", threadCount);
+}
+
+void JobSystem::destroy() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStop = true;
+    }
+    mWorkCondition.notify_all();
+    for (auto& worker : mWorkers) {
+        worker.join();
+    }
+    mWorkers.clear();
+}
+
+void JobSystem::run(uint32_t jobCount, const Job& job) {
+    if (jobCount == 0) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        ASSERT(mJob == nullptr);
+        mJob = &job;
+        mJobCount = jobCount;
+        mNextJob = 0;
+        mRemainingJobs = jobCount;
+    }
+    // The calling thread runs the first job, so one worker fewer is needed
+    if (jobCount > 2) {
+        mWorkCondition.notify_all();
+    } else if (jobCount == 2) {
+        mWorkCondition.notify_one();
+    }
+
+    runJobs(0);
+
+    std::unique_lock<std::mutex> lock(mLock);
+    mDoneCondition.wait(lock, [this] { return mRemainingJobs == 0; });
+    mJob = nullptr;
+}
+
+void JobSystem::workerMain(uint32_t threadIndex) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            mWorkCondition.wait(lock, [this] { return mStop || mNextJob < mJobCount; });
+            if (mStop) {
+                return;
+            }
+        }
+        runJobs(threadIndex);
+    }
+}
+
+void JobSystem::runJobs(uint32_t threadIndex) {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (mNextJob < mJobCount) {
+        const uint32_t jobIndex = mNextJob++;
+        const Job* job = mJob;
+        lock.unlock();
+        (*job)(jobIndex, threadIndex);
+        lock.lock();
+        if (--mRemainingJobs == 0) {
+            mDoneCondition.notify_one();
+        }
+    }
+}
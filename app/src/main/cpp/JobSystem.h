@@ -0,0 +1,60 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join job scheduler over a fixed pool of worker threads. The calling thread takes part in
+// running the jobs, so a job system of N threads starts N - 1 workers. Every thread has a stable
+// index, 0 being the calling thread, for jobs to pick per thread resources without locking.
+class JobSystem {
+public:
+    // Receives the job index and the index of the thread running it
+    using Job = std::function<void(uint32_t jobIndex, uint32_t threadIndex)>;
+
+    explicit JobSystem() {}
+    // threadCount includes the calling thread, 0 picks one thread per core up to kMaxThreads
+    void initialize(uint32_t threadCount);
+    void destroy();
+    uint32_t getThreadCount() const { return (uint32_t)mWorkers.size() + 1; }
+    // Runs job for every index below jobCount and returns once all of them have completed. Only
+    // one thread may call run at a time.
+    void run(uint32_t jobCount, const Job& job);
+
+    static constexpr const uint32_t kMaxThreads = 8;
+
+private:
+    void workerMain(uint32_t threadIndex);
+    // Runs jobs of the current batch until none is left to claim
+    void runJobs(uint32_t threadIndex);
+
+    std::vector<std::thread> mWorkers;
+    // Protects all the members below
+    std::mutex mLock;
+    std::condition_variable mWorkCondition;
+    std::condition_variable mDoneCondition;
+    const Job* mJob = nullptr;
+    uint32_t mJobCount = 0;
+    uint32_t mNextJob = 0;
+    uint32_t mRemainingJobs = 0;
+    bool mStop = false;
+};
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Ktx2.h"
+
+#include <cstring>
+
+static constexpr const uint8_t kKtx2Identifier[12] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32,
+                                                      0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+
+// The level index follows the identifier, the header and the data format, key/value and
+// supercompression global data indices
+static constexpr const size_t kKtx2LevelIndexOffset = kKtx2HeaderSize + 32;
+static constexpr const size_t kKtx2LevelIndexEntrySize = 24;
+
+// KTX2 is little endian, as is every Android ABI
+static uint32_t readUint32(const uint8_t* data, size_t offset) {
+    uint32_t value;
+    memcpy(&value, data + offset, sizeof(value));
+    return value;
+}
+
+static uint64_t readUint64(const uint8_t* data, size_t offset) {
+    uint64_t value;
+    memcpy(&value, data + offset, sizeof(value));
+    return value;
+}
+
+bool isKtx2(const void* data, size_t size) {
+    return size >= sizeof(kKtx2Identifier) &&
+           memcmp(data, kKtx2Identifier, sizeof(kKtx2Identifier)) == 0;
+}
+
+bool readKtx2Header(const void* data, size_t size, Ktx2Header* outHeader) {
+    if (size < kKtx2HeaderSize || !isKtx2(data, size)) {
+        return false;
+    }
+
+    const auto bytes = static_cast<const uint8_t*>(data);
+    const uint32_t format = readUint32(bytes, 12);
+    const uint32_t width = readUint32(bytes, 20);
+    const uint32_t height = readUint32(bytes, 24);
+    const uint32_t depth = readUint32(bytes, 28);
+    const uint32_t layerCount = readUint32(bytes, 32);
+    const uint32_t faceCount = readUint32(bytes, 36);
+    const uint32_t levelCount = readUint32(bytes, 40);
+    const uint32_t supercompressionScheme = readUint32(bytes, 44);
+
+    // VK_FORMAT_UNDEFINED means Basis Universal or another format needing transcoding
+    if (format == VK_FORMAT_UNDEFINED || supercompressionScheme != 0) {
+        return false;
+    }
+    if (width == 0 || height == 0 || depth != 0 || layerCount > 1 || faceCount != 1) {
+        return false;
+    }
+    // A level count of 0 asks the loader to generate mipmaps, only the base level is stored
+    const uint32_t maxLevelCount = 32 - __builtin_clz(width > height ? width : height);
+    if (levelCount > maxLevelCount) {
+        return false;
+    }
+
+    outHeader->format = static_cast<VkFormat>(format);
+    outHeader->width = width;
+    outHeader->height = height;
+    outHeader->levelCount = levelCount ? levelCount : 1;
+    return true;
+}
+
+bool readKtx2Levels(const void* data, size_t size, const Ktx2Header& header,
+                    std::vector<Ktx2Level>* outLevels) {
+    if (size < kKtx2LevelIndexOffset + header.levelCount * kKtx2LevelIndexEntrySize) {
+        return false;
+    }
+
+    const auto bytes = static_cast<const uint8_t*>(data);
+    outLevels->resize(header.levelCount);
+    for (uint32_t i = 0; i < header.levelCount; i++) {
+        const size_t entryOffset = kKtx2LevelIndexOffset + i * kKtx2LevelIndexEntrySize;
+        const uint64_t offset = readUint64(bytes, entryOffset);
+        const uint64_t length = readUint64(bytes, entryOffset + 8);
+        if (length == 0 || offset > size || length > size - offset) {
+            return false;
+        }
+        (*outLevels)[i] = {
+                .offset = (size_t)offset,
+                .size = (size_t)length,
+        };
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Minimal reader for KTX2 containers holding GPU compressed textures such as ASTC or ETC2. Only
+// plain 2D textures are accepted, supercompressed, array, cube and 3D textures are rejected.
+
+struct Ktx2Header {
+    VkFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levelCount;
+};
+
+struct Ktx2Level {
+    // Relative to the start of the file
+    size_t offset;
+    size_t size;
+};
+
+// Bytes needed by readKtx2Header
+static constexpr const size_t kKtx2HeaderSize = 48;
+
+bool isKtx2(const void* data, size_t size);
+// Returns false if the container is not a KTX2 file this reader can upload as is
+bool readKtx2Header(const void* data, size_t size, Ktx2Header* outHeader);
+// Needs the whole file. Levels are ordered from the largest to the smallest.
+bool readKtx2Levels(const void* data, size_t size, const Ktx2Header& header,
+                    std::vector<Ktx2Level>* outLevels);
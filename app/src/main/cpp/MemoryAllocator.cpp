@@ -0,0 +1,473 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MemoryAllocator.h"
+
+#include <algorithm>
+
+#include "Utils.h"
+
+static VkDeviceSize roundUpToPowerOfTwo(VkDeviceSize value) {
+    return value <= 1 ? 1 : 1ULL << (64 - __builtin_clzll(value - 1));
+}
+
+static uint32_t log2OfPowerOfTwo(VkDeviceSize value) {
+    return (uint32_t)__builtin_ctzll(value);
+}
+
+void MemoryAllocator::initialize(VkHelper* vk, VkPhysicalDevice gpu, VkDevice device) {
+    ASSERT(vk);
+    mVk = vk;
+    mGpu = gpu;
+    mDevice = device;
+    mVk->GetPhysicalDeviceMemoryProperties(gpu, &mMemoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    mVk->GetPhysicalDeviceProperties(gpu, &properties);
+    mMaxMemoryAllocationCount = properties.limits.maxMemoryAllocationCount;
+    mNonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+    // With a granularity of 1 there is no constraint between neighbouring buffers and images
+    mSeparateImagePools = properties.limits.bufferImageGranularity > 1;
+
+    mPools.resize(VK_MAX_MEMORY_TYPES * 4);
+    for (uint32_t i = 0; i < mPools.size(); i++) {
+        MemoryPool& pool = mPools[i];
+        pool.memoryTypeIndex = i / 4;
+        pool.isLinear = (i & 1U) != 0;
+        if (pool.memoryTypeIndex >= mMemoryProperties.memoryTypeCount) {
+            continue;
+        }
+        // Small heaps, e.g. a dedicated host visible device local one, get smaller blocks
+        const uint32_t heapIndex = mMemoryProperties.memoryTypes[pool.memoryTypeIndex].heapIndex;
+        const VkDeviceSize heapSize = mMemoryProperties.memoryHeaps[heapIndex].size;
+        pool.blockSize = std::clamp(roundUpToPowerOfTwo(heapSize / 8 + 1) / 2, kMinBlockSize,
+                                    kMaxBlockSize);
+    }
+    mDeviceMemoryCount = 0;
+    mDedicatedAllocationCount = 0;
+    mDedicatedBytes = 0;
+
+    ALOGD("Successfully created memory allocator: maxMemoryAllocationCount = %u, "
+          "bufferImageGranularity = %llu",
+          mMaxMemoryAllocationCount, (unsigned long long)properties.limits.bufferImageGranularity);
+}
+
+void MemoryAllocator::destroy() {
+    logStatistics();
+    ASSERT(mDedicatedAllocationCount == 0);
+    for (auto& pool : mPools) {
+        for (auto& block : pool.blocks) {
+            ASSERT(block.allocationCount == 0);
+            // Freeing mapped memory implicitly unmaps it
+            mVk->FreeMemory(mDevice, block.memory, nullptr);
+        }
+    }
+    mPools.clear();
+    mDeviceMemoryCount = 0;
+
+    ALOGD("Successfully destroyed memory allocator");
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocateBuffer(VkBuffer buffer,
+                                                            VkMemoryPropertyFlags properties,
+                                                            Pool pool) {
+    VkMemoryRequirements requirements;
+    mVk->GetBufferMemoryRequirements(mDevice, buffer, &requirements);
+
+    const uint32_t memoryTypeIndex = getMemoryTypeIndex(requirements.memoryTypeBits, properties);
+    const uint32_t poolIndex = getPoolIndex(memoryTypeIndex, false, pool);
+    const Allocation allocation = requirements.size > mPools[poolIndex].blockSize / 2
+            ? allocateDedicated(requirements, nullptr, memoryTypeIndex)
+            : allocate(requirements, poolIndex);
+    ASSERT(mVk->BindBufferMemory(mDevice, buffer, allocation.memory, allocation.offset) ==
+           VK_SUCCESS);
+    return allocation;
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocateImage(VkImage image,
+                                                           VkMemoryPropertyFlags properties,
+                                                           Pool pool) {
+    const VkImageMemoryRequirementsInfo2 requirementsInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+            .pNext = nullptr,
+            .image = image,
+    };
+    VkMemoryDedicatedRequirements dedicatedRequirements = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS,
+            .pNext = nullptr,
+            .prefersDedicatedAllocation = VK_FALSE,
+            .requiresDedicatedAllocation = VK_FALSE,
+    };
+    VkMemoryRequirements2 requirements = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+            .pNext = &dedicatedRequirements,
+            .memoryRequirements = {},
+    };
+    mVk->GetImageMemoryRequirements2(mDevice, &requirementsInfo, &requirements);
+
+    const uint32_t memoryTypeIndex =
+            getMemoryTypeIndex(requirements.memoryRequirements.memoryTypeBits, properties);
+    const uint32_t poolIndex = getPoolIndex(memoryTypeIndex, true, pool);
+    const bool isDedicated = dedicatedRequirements.prefersDedicatedAllocation ||
+            dedicatedRequirements.requiresDedicatedAllocation ||
+            requirements.memoryRequirements.size > mPools[poolIndex].blockSize / 2;
+
+    Allocation allocation;
+    if (isDedicated) {
+        const VkMemoryDedicatedAllocateInfo dedicatedInfo = {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .image = image,
+                .buffer = VK_NULL_HANDLE,
+        };
+        allocation = allocateDedicated(requirements.memoryRequirements, &dedicatedInfo,
+                                       memoryTypeIndex);
+    } else {
+        allocation = allocate(requirements.memoryRequirements, poolIndex);
+    }
+    ASSERT(mVk->BindImageMemory(mDevice, image, allocation.memory, allocation.offset) ==
+           VK_SUCCESS);
+    return allocation;
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocateTransientImage(VkImage image,
+                                                                    bool* outIsLazy) {
+    VkMemoryRequirements requirements;
+    mVk->GetImageMemoryRequirements(mDevice, image, &requirements);
+
+    uint32_t memoryTypeIndex = mMemoryProperties.memoryTypeCount;
+    for (uint32_t typeIndex = 0; typeIndex < mMemoryProperties.memoryTypeCount; typeIndex++) {
+        if ((requirements.memoryTypeBits & (1U << typeIndex)) &&
+            (mMemoryProperties.memoryTypes[typeIndex].propertyFlags &
+             VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)) {
+            memoryTypeIndex = typeIndex;
+            break;
+        }
+    }
+    *outIsLazy = memoryTypeIndex != mMemoryProperties.memoryTypeCount;
+    if (!*outIsLazy) {
+        memoryTypeIndex = getMemoryTypeIndex(requirements.memoryTypeBits,
+                                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+
+    // Never sub-allocated, a block shared with other resources would be backed as a whole
+    const VkMemoryDedicatedAllocateInfo dedicatedInfo = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .image = image,
+            .buffer = VK_NULL_HANDLE,
+    };
+    const Allocation allocation = allocateDedicated(requirements, &dedicatedInfo, memoryTypeIndex);
+    ASSERT(mVk->BindImageMemory(mDevice, image, allocation.memory, allocation.offset) ==
+           VK_SUCCESS);
+    return allocation;
+}
+
+void MemoryAllocator::free(Allocation* allocation) {
+    if (allocation->memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    if (allocation->blockIndex == kDedicatedBlock) {
+        mVk->FreeMemory(mDevice, allocation->memory, nullptr);
+        mDeviceMemoryCount--;
+        mDedicatedAllocationCount--;
+        mDedicatedBytes -= allocation->size;
+    } else {
+        freeToBlock(&mPools[allocation->poolIndex], allocation->blockIndex, allocation->offset,
+                    allocation->size);
+    }
+    *allocation = Allocation();
+}
+
+bool MemoryAllocator::isHostCoherent(const Allocation& allocation) const {
+    const uint32_t memoryTypeIndex = mPools[allocation.poolIndex].memoryTypeIndex;
+    return (mMemoryProperties.memoryTypes[memoryTypeIndex].propertyFlags &
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+}
+
+void MemoryAllocator::flush(const Allocation& allocation, VkDeviceSize offset,
+                            VkDeviceSize size) const {
+    ASSERT(allocation.mapped);
+    ASSERT(offset + size <= allocation.size);
+    if (size == 0 || isHostCoherent(allocation)) {
+        return;
+    }
+
+    // Both ends are aligned to the atom size, except for an end clamped to the whole memory
+    const VkDeviceSize memorySize = allocation.blockIndex == kDedicatedBlock
+            ? allocation.size
+            : mPools[allocation.poolIndex].blocks[allocation.blockIndex].size;
+    const VkDeviceSize begin =
+            (allocation.offset + offset) / mNonCoherentAtomSize * mNonCoherentAtomSize;
+    const VkDeviceSize end = std::min(
+            alignUp(allocation.offset + offset + size, mNonCoherentAtomSize), memorySize);
+    const VkMappedMemoryRange range = {
+            .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+            .pNext = nullptr,
+            .memory = allocation.memory,
+            .offset = begin,
+            .size = end - begin,
+    };
+    ASSERT(mVk->FlushMappedMemoryRanges(mDevice, 1, &range) == VK_SUCCESS);
+}
+
+MemoryAllocator::Statistics MemoryAllocator::getStatistics() const {
+    Statistics statistics = {
+            .deviceMemoryCount = mDeviceMemoryCount,
+            .blockCount = 0,
+            .allocationCount = mDedicatedAllocationCount,
+            .dedicatedAllocationCount = mDedicatedAllocationCount,
+            .reservedBytes = mDedicatedBytes,
+            .usedBytes = mDedicatedBytes,
+    };
+    for (const auto& pool : mPools) {
+        for (const auto& block : pool.blocks) {
+            if (block.memory == VK_NULL_HANDLE) {
+                continue;
+            }
+            statistics.blockCount++;
+            statistics.allocationCount += block.allocationCount;
+            statistics.reservedBytes += block.size;
+            statistics.usedBytes += block.usedBytes;
+        }
+    }
+    return statistics;
+}
+
+void MemoryAllocator::logStatistics() const {
+    const Statistics statistics = getStatistics();
+    ALOGD("Device memory: %u allocations in %u vkAllocateMemory (%u blocks, %u dedicated), "
+          "%.2f MB used of %.2f MB reserved",
+          statistics.allocationCount, statistics.deviceMemoryCount, statistics.blockCount,
+          statistics.dedicatedAllocationCount, statistics.usedBytes / (1024.0 * 1024.0),
+          statistics.reservedBytes / (1024.0 * 1024.0));
+}
+
+MemoryAllocator::HeapBudget MemoryAllocator::getDeviceLocalBudget() const {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+            .pNext = nullptr,
+            .heapBudget = {},
+            .heapUsage = {},
+    };
+    VkPhysicalDeviceMemoryProperties2 memoryProperties = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+            .pNext = &budgetProperties,
+            .memoryProperties = {},
+    };
+    mVk->GetPhysicalDeviceMemoryProperties2(mGpu, &memoryProperties);
+
+    HeapBudget budget = {
+            .budgetBytes = 0,
+            .usageBytes = 0,
+    };
+    for (uint32_t i = 0; i < mMemoryProperties.memoryHeapCount; i++) {
+        if (mMemoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            budget.budgetBytes += budgetProperties.heapBudget[i];
+            budget.usageBytes += budgetProperties.heapUsage[i];
+        }
+    }
+    return budget;
+}
+
+uint32_t MemoryAllocator::getMemoryTypeIndex(uint32_t typeBits,
+                                             VkMemoryPropertyFlags properties) const {
+    for (uint32_t typeIndex = 0; typeIndex < mMemoryProperties.memoryTypeCount; typeIndex++) {
+        if ((typeBits & (1U << typeIndex)) &&
+            (mMemoryProperties.memoryTypes[typeIndex].propertyFlags & properties) == properties) {
+            return typeIndex;
+        }
+    }
+    ASSERT(false);
+}
+
+uint32_t MemoryAllocator::getPoolIndex(uint32_t memoryTypeIndex, bool isImage, Pool pool) {
+    const uint32_t kind = mSeparateImagePools && isImage ? 1 : 0;
+    return memoryTypeIndex * 4 + kind * 2 + static_cast<uint32_t>(pool);
+}
+
+VkDeviceMemory MemoryAllocator::allocateDeviceMemory(uint32_t memoryTypeIndex, VkDeviceSize size,
+                                                     const void* pNext, uint8_t** outMapped) {
+    ASSERT(mDeviceMemoryCount < mMaxMemoryAllocationCount);
+    const VkMemoryAllocateInfo memoryAllocateInfo = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            .pNext = pNext,
+            .allocationSize = size,
+            .memoryTypeIndex = memoryTypeIndex,
+    };
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    ASSERT(mVk->AllocateMemory(mDevice, &memoryAllocateInfo, nullptr, &memory) == VK_SUCCESS);
+    mDeviceMemoryCount++;
+
+    *outMapped = nullptr;
+    if (mMemoryProperties.memoryTypes[memoryTypeIndex].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void* data = nullptr;
+        ASSERT(mVk->MapMemory(mDevice, memory, 0, VK_WHOLE_SIZE, 0, &data) == VK_SUCCESS);
+        *outMapped = static_cast<uint8_t*>(data);
+    }
+    return memory;
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocateDedicated(
+        const VkMemoryRequirements& requirements,
+        const VkMemoryDedicatedAllocateInfo* dedicatedInfo, uint32_t memoryTypeIndex) {
+    Allocation allocation;
+    allocation.memory = allocateDeviceMemory(memoryTypeIndex, requirements.size, dedicatedInfo,
+                                             &allocation.mapped);
+    allocation.offset = 0;
+    allocation.size = requirements.size;
+    allocation.poolIndex = memoryTypeIndex * 4;
+    allocation.blockIndex = kDedicatedBlock;
+    mDedicatedAllocationCount++;
+    mDedicatedBytes += requirements.size;
+    return allocation;
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+                                                      uint32_t poolIndex) {
+    MemoryPool& pool = mPools[poolIndex];
+    // Buddies are naturally aligned to their size
+    const VkDeviceSize size = pool.isLinear
+            ? requirements.size
+            : roundUpToPowerOfTwo(std::max({requirements.size, requirements.alignment,
+                                            (VkDeviceSize)1 << kMinOrder}));
+
+    VkDeviceSize offset = 0;
+    uint32_t blockIndex = 0;
+    for (; blockIndex < pool.blocks.size(); blockIndex++) {
+        if (pool.blocks[blockIndex].memory != VK_NULL_HANDLE &&
+            allocateFromBlock(&pool, blockIndex, size, requirements.alignment, &offset)) {
+            break;
+        }
+    }
+    if (blockIndex == pool.blocks.size()) {
+        blockIndex = createBlock(&pool);
+        ASSERT(allocateFromBlock(&pool, blockIndex, size, requirements.alignment, &offset));
+    }
+
+    Block& block = pool.blocks[blockIndex];
+    block.allocationCount++;
+    block.usedBytes += size;
+
+    Allocation allocation;
+    allocation.memory = block.memory;
+    allocation.offset = offset;
+    allocation.size = size;
+    allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+    allocation.poolIndex = poolIndex;
+    allocation.blockIndex = blockIndex;
+    return allocation;
+}
+
+bool MemoryAllocator::allocateFromBlock(MemoryPool* pool, uint32_t blockIndex, VkDeviceSize size,
+                                        VkDeviceSize alignment, VkDeviceSize* outOffset) {
+    Block& block = pool->blocks[blockIndex];
+    if (pool->isLinear) {
+        const VkDeviceSize offset = alignUp(block.linearHead, alignment);
+        if (offset + size > block.size) {
+            return false;
+        }
+        block.linearHead = offset + size;
+        *outOffset = offset;
+        return true;
+    }
+
+    // Take the smallest free buddy that fits and split it down to the requested order
+    const uint32_t order = log2OfPowerOfTwo(size) - kMinOrder;
+    uint32_t freeOrder = order;
+    while (freeOrder < block.freeLists.size() && block.freeLists[freeOrder].empty()) {
+        freeOrder++;
+    }
+    if (freeOrder == block.freeLists.size()) {
+        return false;
+    }
+    const VkDeviceSize offset = *block.freeLists[freeOrder].begin();
+    block.freeLists[freeOrder].erase(block.freeLists[freeOrder].begin());
+    while (freeOrder > order) {
+        freeOrder--;
+        block.freeLists[freeOrder].insert(offset + ((VkDeviceSize)1 << (freeOrder + kMinOrder)));
+    }
+    *outOffset = offset;
+    return true;
+}
+
+void MemoryAllocator::freeToBlock(MemoryPool* pool, uint32_t blockIndex, VkDeviceSize offset,
+                                  VkDeviceSize size) {
+    Block& block = pool->blocks[blockIndex];
+    ASSERT(block.allocationCount > 0);
+    block.allocationCount--;
+    block.usedBytes -= size;
+
+    if (pool->isLinear) {
+        // Linear blocks are only ever reused as a whole
+        if (block.allocationCount == 0) {
+            block.linearHead = 0;
+        }
+    } else {
+        // Merge with the buddy for as long as it is free too
+        uint32_t order = log2OfPowerOfTwo(size) - kMinOrder;
+        while (order + 1 < block.freeLists.size()) {
+            const VkDeviceSize buddy = offset ^ ((VkDeviceSize)1 << (order + kMinOrder));
+            auto buddyIt = block.freeLists[order].find(buddy);
+            if (buddyIt == block.freeLists[order].end()) {
+                break;
+            }
+            block.freeLists[order].erase(buddyIt);
+            offset = std::min(offset, buddy);
+            order++;
+        }
+        block.freeLists[order].insert(offset);
+    }
+
+    // Keep one empty block around per pool so that streaming doesn't thrash the driver
+    if (block.allocationCount == 0) {
+        const bool hasOtherBlock = std::any_of(
+                pool->blocks.begin(), pool->blocks.end(), [&block](const Block& other) {
+                    return &other != &block && other.memory != VK_NULL_HANDLE;
+                });
+        if (hasOtherBlock) {
+            mVk->FreeMemory(mDevice, block.memory, nullptr);
+            mDeviceMemoryCount--;
+            block = Block();
+        }
+    }
+}
+
+uint32_t MemoryAllocator::createBlock(MemoryPool* pool) {
+    // Reuse the slot of a released block, allocations refer to blocks by index
+    uint32_t blockIndex = 0;
+    while (blockIndex < pool->blocks.size() && pool->blocks[blockIndex].memory != VK_NULL_HANDLE) {
+        blockIndex++;
+    }
+    if (blockIndex == pool->blocks.size()) {
+        pool->blocks.emplace_back();
+    }
+
+    Block& block = pool->blocks[blockIndex];
+    block.size = pool->blockSize;
+    block.memory =
+            allocateDeviceMemory(pool->memoryTypeIndex, block.size, nullptr, &block.mapped);
+    block.allocationCount = 0;
+    block.usedBytes = 0;
+    block.linearHead = 0;
+    if (!pool->isLinear) {
+        block.freeLists.assign(log2OfPowerOfTwo(block.size) - kMinOrder + 1, {});
+        block.freeLists.back().insert(0);
+    }
+    return blockIndex;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <set>
+#include <vector>
+
+#include "VkHelper.h"
+
+// Sub-allocates buffer and image memory out of large VkDeviceMemory blocks, so that the number
+// of live allocations stays far below maxMemoryAllocationCount.
+//
+// Each memory type has a general pool, managed by a buddy allocator per block, and a linear pool
+// for resources living until the allocator is destroyed, whose blocks are only recycled once
+// empty. Buffers and images get pools of their own when bufferImageGranularity requires it, so
+// neighbouring sub-allocations never alias a granularity page. Images the driver prefers to be
+// dedicated and anything larger than half a block get a VkDeviceMemory of their own. Host
+// visible memory is persistently mapped, and writes to it only need a flush if it is not host
+// coherent.
+//
+// Not thread safe, all the allocations happen on the render thread.
+class MemoryAllocator {
+public:
+    enum class Pool : uint32_t {
+        GENERAL = 0,
+        LINEAR,
+    };
+
+    struct Allocation {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        // Only set for host visible memory
+        uint8_t* mapped = nullptr;
+        uint32_t poolIndex = 0;
+        // kDedicatedBlock if memory isn't shared with other allocations
+        uint32_t blockIndex = 0;
+    };
+
+    struct Statistics {
+        // Live vkAllocateMemory calls, blocks and dedicated allocations together
+        uint32_t deviceMemoryCount;
+        uint32_t blockCount;
+        uint32_t allocationCount;
+        uint32_t dedicatedAllocationCount;
+        // Memory obtained from the driver, and the part of it handed out to resources
+        VkDeviceSize reservedBytes;
+        VkDeviceSize usedBytes;
+    };
+
+    // As reported by VK_EXT_memory_budget, usage includes the other processes of the system
+    struct HeapBudget {
+        VkDeviceSize budgetBytes;
+        VkDeviceSize usageBytes;
+    };
+
+    explicit MemoryAllocator() {}
+    void initialize(VkHelper* vk, VkPhysicalDevice gpu, VkDevice device);
+    // Every allocation must have been freed before
+    void destroy();
+    // Allocate and bind memory with at least the requested properties
+    Allocation allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, Pool pool);
+    Allocation allocateImage(VkImage image, VkMemoryPropertyFlags properties, Pool pool);
+    // Dedicated memory for an image created with VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT. Prefers
+    // lazily allocated memory, which tile based GPUs only back with pages if the attachment ever
+    // leaves the tile, and falls back to device local memory.
+    Allocation allocateTransientImage(VkImage image, bool* outIsLazy);
+    // Safe to call with an allocation that was never made
+    void free(Allocation* allocation);
+    bool isHostCoherent(const Allocation& allocation) const;
+    // Makes host writes to [offset, offset + size) of a mapped allocation visible to the device,
+    // nothing to do for host coherent memory. The range is widened to nonCoherentAtomSize, which
+    // may flush some of the neighbouring allocations as well.
+    void flush(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) const;
+    Statistics getStatistics() const;
+    void logStatistics() const;
+    // Rounds value up to a multiple of alignment, which needs not be a power of two
+    static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+    // The device local heaps together, only valid if VK_EXT_memory_budget is enabled. A query to
+    // the driver, so not meant for every frame.
+    HeapBudget getDeviceLocalBudget() const;
+
+private:
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        uint8_t* mapped = nullptr;
+        VkDeviceSize size = 0;
+        uint32_t allocationCount = 0;
+        VkDeviceSize usedBytes = 0;
+        // Buddy allocator state for general pools, free offsets per order above kMinOrder
+        std::vector<std::set<VkDeviceSize>> freeLists;
+        // Bump pointer for linear pools
+        VkDeviceSize linearHead = 0;
+    };
+
+    struct MemoryPool {
+        uint32_t memoryTypeIndex = 0;
+        bool isLinear = false;
+        VkDeviceSize blockSize = 0;
+        std::vector<Block> blocks;
+    };
+
+    uint32_t getMemoryTypeIndex(uint32_t typeBits, VkMemoryPropertyFlags properties) const;
+    uint32_t getPoolIndex(uint32_t memoryTypeIndex, bool isImage, Pool pool);
+    VkDeviceMemory allocateDeviceMemory(uint32_t memoryTypeIndex, VkDeviceSize size,
+                                        const void* pNext, uint8_t** outMapped);
+    Allocation allocateDedicated(const VkMemoryRequirements& requirements,
+                                 const VkMemoryDedicatedAllocateInfo* dedicatedInfo,
+                                 uint32_t memoryTypeIndex);
+    Allocation allocate(const VkMemoryRequirements& requirements, uint32_t poolIndex);
+    bool allocateFromBlock(MemoryPool* pool, uint32_t blockIndex, VkDeviceSize size,
+                           VkDeviceSize alignment, VkDeviceSize* outOffset);
+    void freeToBlock(MemoryPool* pool, uint32_t blockIndex, VkDeviceSize offset,
+                     VkDeviceSize size);
+    uint32_t createBlock(MemoryPool* pool);
+
+    VkHelper* mVk = nullptr;
+    VkPhysicalDevice mGpu = VK_NULL_HANDLE;
+    VkDevice mDevice = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties mMemoryProperties = {};
+    uint32_t mMaxMemoryAllocationCount = 0;
+    VkDeviceSize mNonCoherentAtomSize = 1;
+    bool mSeparateImagePools = false;
+
+    // Indexed by getPoolIndex, created lazily
+    std::vector<MemoryPool> mPools;
+    uint32_t mDeviceMemoryCount = 0;
+    uint32_t mDedicatedAllocationCount = 0;
+    VkDeviceSize mDedicatedBytes = 0;
+
+    static constexpr const uint32_t kDedicatedBlock = UINT32_MAX;
+    static constexpr const VkDeviceSize kMaxBlockSize = 64 * 1024 * 1024;
+    static constexpr const VkDeviceSize kMinBlockSize = 1024 * 1024;
+    // Smallest buddy, 256 bytes
+    static constexpr const uint32_t kMinOrder = 8;
+};
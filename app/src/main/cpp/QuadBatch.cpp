@@ -0,0 +1,124 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "QuadBatch.h"
+
+#include <algorithm>
+
+#include "Utils.h"
+
+void QuadBatch::initialize(VkHelper* vk, UploadRing* uploadRing, uint32_t frameCount,
+                           uint32_t maxQuads, bool splitByTexture) {
+    ASSERT(vk);
+    ASSERT(uploadRing);
+    ASSERT(frameCount);
+    ASSERT(maxQuads);
+    mVk = vk;
+    mUploadRing = uploadRing;
+    mMaxQuads = maxQuads;
+    mSplitByTexture = splitByTexture;
+
+    mDraws.assign(frameCount, {});
+    mFrameInstances.assign(frameCount, {});
+
+    ALOGD("Successfully created quad batch: %u quads x %u frames, splitByTexture = %d", maxQuads,
+          frameCount, splitByTexture);
+}
+
+void QuadBatch::destroy() {
+    mUploadRing = nullptr;
+    mDraws.clear();
+    mFrameInstances.clear();
+    mPendingDraws.clear();
+    mInstances = nullptr;
+}
+
+void QuadBatch::begin(uint32_t frameIndex) {
+    ASSERT(frameIndex < mDraws.size());
+    mFrameIndex = frameIndex;
+    mPendingInstances = mUploadRing->allocate((VkDeviceSize)sizeof(Instance) * mMaxQuads);
+    mInstances = reinterpret_cast<Instance*>(mPendingInstances.mapped);
+    mQuadCount = 0;
+    mDroppedQuadCount = 0;
+    mPendingDraws.clear();
+}
+
+void QuadBatch::addQuad(const Instance& instance) {
+    ASSERT(mInstances);
+    if (mQuadCount == mMaxQuads) {
+        mDroppedQuadCount++;
+        return;
+    }
+
+    mInstances[mQuadCount] = instance;
+    if (mPendingDraws.empty() ||
+        (mSplitByTexture && mPendingDraws.back().textureIndex != instance.textureIndex)) {
+        mPendingDraws.push_back({
+                .firstInstance = mQuadCount,
+                .instanceCount = 0,
+                .textureIndex = instance.textureIndex,
+        });
+    }
+    mPendingDraws.back().instanceCount++;
+    mQuadCount++;
+}
+
+bool QuadBatch::end() {
+    ASSERT(mInstances);
+    mInstances = nullptr;
+    mUploadRing->trimLast((VkDeviceSize)sizeof(Instance) * mQuadCount);
+    if (mDroppedQuadCount) {
+        ALOGD("%s: dropped %u quads over the limit of %u", __FUNCTION__, mDroppedQuadCount,
+              mMaxQuads);
+    }
+
+    std::vector<Draw>& draws = mDraws[mFrameIndex];
+    UploadRing::Allocation& instances = mFrameInstances[mFrameIndex];
+    if (draws == mPendingDraws && instances.buffer == mPendingInstances.buffer &&
+        instances.offset == mPendingInstances.offset) {
+        return false;
+    }
+    draws.swap(mPendingDraws);
+    instances = mPendingInstances;
+    return true;
+}
+
+void QuadBatch::recordDraws(VkCommandBuffer commandBuffer, uint32_t frameIndex,
+                            uint32_t firstInstance, uint32_t instanceCount,
+                            VkPipelineLayout layout, const VkDescriptorSet* textureSets) const {
+    const uint32_t endInstance = std::min(firstInstance + instanceCount,
+                                          getInstanceCount(frameIndex));
+    if (firstInstance >= endInstance) {
+        return;
+    }
+
+    // Instance indices are relative to the frame's allocation, bound at its offset
+    const UploadRing::Allocation& instances = mFrameInstances[frameIndex];
+    mVk->CmdBindVertexBuffers(commandBuffer, 1, 1, &instances.buffer, &instances.offset);
+    // Draws are sorted by their first instance, clip the ones overlapping the range
+    for (const Draw& draw : mDraws[frameIndex]) {
+        const uint32_t drawFirst = std::max(draw.firstInstance, firstInstance);
+        const uint32_t drawEnd = std::min(draw.firstInstance + draw.instanceCount, endInstance);
+        if (drawFirst >= drawEnd) {
+            continue;
+        }
+        if (textureSets) {
+            mVk->CmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1,
+                                       &textureSets[draw.textureIndex], 0, nullptr);
+        }
+        mVk->CmdDraw(commandBuffer, 4, drawEnd - drawFirst, 0, drawFirst);
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "UploadRing.h"
+#include "VkHelper.h"
+
+// Gathers textured quads into a per frame instance buffer, drawn with a handful of instanced
+// draws. The instances of a frame are written straight into its slice of the upload ring, which
+// is only rewritten once the frame's previous submission has completed, so adding a quad is a
+// plain store with no Vulkan call involved.
+class QuadBatch {
+public:
+    // Matches the per instance attributes of texture.vert
+    struct Instance {
+        // Columns of the 2x2 matrix applied to the unit quad, followed by the translation
+        float transform[4];
+        float offset[2];
+        // xy offset and zw scale of the quad's [0, 1] texture coordinates
+        float uvRect[4];
+        uint32_t textureIndex;
+        uint32_t padding;
+    };
+    static_assert(sizeof(Instance) == 48, "Instance must match the vertex input stride");
+
+    explicit QuadBatch() {}
+    // splitByTexture starts a new draw whenever the texture index changes, for shaders that can
+    // only index the texture table with a dynamically uniform value. Otherwise all the quads of a
+    // frame go into a single draw.
+    void initialize(VkHelper* vk, UploadRing* uploadRing, uint32_t frameCount, uint32_t maxQuads,
+                    bool splitByTexture);
+    void destroy();
+    // Reserves room for maxQuads in the ring, which must be between its begin and end for the
+    // same frame index
+    void begin(uint32_t frameIndex);
+    // Quads beyond maxQuads are dropped
+    void addQuad(const Instance& instance);
+    // Gives back the unused room. Returns true if the draws or their instance offset differ from
+    // the last ones built for this frame index, in which case command buffers recorded earlier
+    // must not be reused.
+    bool end();
+    // Number of instances last built for frameIndex, across all its draws
+    uint32_t getInstanceCount(uint32_t frameIndex) const {
+        const std::vector<Draw>& draws = mDraws[frameIndex];
+        return draws.empty() ? 0 : draws.back().firstInstance + draws.back().instanceCount;
+    }
+    // Binds the frame's instances to binding 1 and issues the parts of its draws covering
+    // instanceCount instances from firstInstance on, the unit quad vertex buffer needs to be
+    // bound to binding 0 already. If textureSets is not null, each draw first binds
+    // textureSets[textureIndex] to set 0 of layout. Disjoint ranges, even within a single draw,
+    // can be recorded into different command buffers concurrently.
+    void recordDraws(VkCommandBuffer commandBuffer, uint32_t frameIndex, uint32_t firstInstance,
+                     uint32_t instanceCount, VkPipelineLayout layout,
+                     const VkDescriptorSet* textureSets) const;
+
+private:
+    struct Draw {
+        uint32_t firstInstance;
+        uint32_t instanceCount;
+        // Of the first quad in the draw
+        uint32_t textureIndex;
+
+        bool operator==(const Draw& other) const {
+            return firstInstance == other.firstInstance && instanceCount == other.instanceCount &&
+                   textureIndex == other.textureIndex;
+        }
+    };
+
+    VkHelper* mVk = nullptr;
+    UploadRing* mUploadRing = nullptr;
+    uint32_t mMaxQuads = 0;
+    bool mSplitByTexture = true;
+
+    // State of the frame being built between begin and end
+    uint32_t mFrameIndex = 0;
+    UploadRing::Allocation mPendingInstances = {};
+    Instance* mInstances = nullptr;
+    uint32_t mQuadCount = 0;
+    uint32_t mDroppedQuadCount = 0;
+    std::vector<Draw> mPendingDraws;
+
+    // Draws last built for each frame index, and where their instances are in the ring
+    std::vector<std::vector<Draw>> mDraws;
+    std::vector<UploadRing::Allocation> mFrameInstances;
+};
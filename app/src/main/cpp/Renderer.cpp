@@ -16,120 +16,502 @@
 
 #include "Renderer.h"
 
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
-
 #include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
 
+#include "AssetView.h"
 #include "Utils.h"
 
-struct PushConstantBlock {
-    glm::mat4 mvp;
-    glm::mat2 preRotate;
+// Uniforms of texture.vert, std140
+struct SceneUniformBlock {
+    float mvp[16];
+};
+
+// Uniforms of texture_specialized.vert, which is given the same range
+struct SpecializedSceneUniformBlock {
+    float scale[2];
+};
+static_assert(sizeof(SpecializedSceneUniformBlock) <= sizeof(SceneUniformBlock),
+              "The scene uniform range must fit either variant");
+
+// Push constants of upscale.frag
+struct UpscalePushConstantBlock {
+    float uvScale[2];
+    float uvMax[2];
+};
+
+// Push constants of post.comp
+struct PostPushConstantBlock {
+    float uvScale[2];
+    float uvMax[2];
+    float texelSize[2];
+    float sharpness;
+    float saturation;
+    float contrast;
+};
+
+// Column major 2x2 rotations applied in clip space to undo the surface transform, indexed by its
+// number of quarter turns
+static constexpr const float kPreRotations[4][4] = {
+        {1.0F, 0.0F, 0.0F, 1.0F},
+        {0.0F, 1.0F, -1.0F, 0.0F},
+        {-1.0F, 0.0F, 0.0F, -1.0F},
+        {0.0F, -1.0F, 1.0F, 0.0F},
+};
+
+// Mirrored transforms are not handled and treated as identity
+static constexpr uint32_t getQuarterTurns(VkSurfaceTransformFlagBitsKHR transform) {
+    switch (transform) {
+        case VK_SURFACE_TRANSFORM_ROTATE_90_BIT_KHR:
+            return 1;
+        case VK_SURFACE_TRANSFORM_ROTATE_180_BIT_KHR:
+            return 2;
+        case VK_SURFACE_TRANSFORM_ROTATE_270_BIT_KHR:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+struct LatencyConfig {
+    // Present modes in the order of preference, FIFO is always supported as the last resort
+    VkPresentModeKHR presentModes[3];
+    uint32_t presentModeCount;
+    uint32_t imageCount;
+    uint32_t inflight;
+};
+
+// Prepended to the blob from vkGetPipelineCacheData. The driver's own header has no driver
+// version, and some drivers misbehave when fed a blob from an older build, so the identity of the
+// device and the driver is checked before the data ever reaches the driver.
+struct PipelineCacheFileHeader {
+    uint32_t magic;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t dataSize;
+};
+
+// "VKPC" in little endian
+static constexpr const uint32_t kPipelineCacheMagic = 0x43504b56;
+// Sanity bound on the size field before allocating for a corrupted file
+static constexpr const uint64_t kMaxPipelineCacheSize = 64 * 1024 * 1024;
+
+// Indexed by Renderer::LatencyMode. BALANCED keeps the classic triple buffered FIFO setup.
+static constexpr const LatencyConfig kLatencyConfigs[3] = {
+        {
+                .presentModes = {VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+                                 VK_PRESENT_MODE_FIFO_KHR},
+                .presentModeCount = 3,
+                .imageCount = 2,
+                .inflight = 1,
+        },
+        {
+                .presentModes = {VK_PRESENT_MODE_FIFO_KHR},
+                .presentModeCount = 1,
+                .imageCount = 3,
+                .inflight = 2,
+        },
+        {
+                .presentModes = {VK_PRESENT_MODE_FIFO_KHR},
+                .presentModeCount = 1,
+                .imageCount = 4,
+                .inflight = 3,
+        },
 };
 
+static const LatencyConfig& getLatencyConfig(Renderer::LatencyMode mode) {
+    return kLatencyConfigs[static_cast<uint32_t>(mode)];
+}
+
 /* Public APIs start here */
-void Renderer::initialize(ANativeWindow* window, AAssetManager* assetManager) {
+void Renderer::initialize(ANativeWindow* window, AAssetManager* assetManager,
+                          const char* dataPath) {
     ASSERT(assetManager);
+    mInitializeStartNanos = nowNanos();
+    mTimeToFirstFrameNanos = 0;
     mAssetManager = assetManager;
+    mPipelineCachePath = dataPath ? std::string(dataPath) + "/" + kPipelineCacheFile : "";
+    mLatencyMode = mPendingLatencyMode;
+    mInflight = getLatencyConfig(mLatencyMode).inflight;
+    ASSERT(mInflight <= kMaxInflight);
+    // The new swapchain already picks up anything requested before
+    mFireRecreateSwapchain = false;
+    mSampleCount = mMultisampling ? kMsaaSampleCount : VK_SAMPLE_COUNT_1_BIT;
 
     createInstance();
     createDevice();
+    mAllocator.initialize(&mVk, mGpu, mDevice);
     createSurface(window);
+    if (mOffscreenRendering) {
+        // The offscreen target shares the swapchain format, so that the scene pipelines are
+        // compatible with both render passes
+        VkFormatProperties formatProperties;
+        mVk.GetPhysicalDeviceFormatProperties(mGpu, mFormat, &formatProperties);
+        const VkFormatFeatureFlags requiredFeatures =
+                VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+                VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        if ((formatProperties.optimalTilingFeatures & requiredFeatures) != requiredFeatures) {
+            ALOGD("Format %d can't be sampled linearly, offscreen rendering disabled", mFormat);
+            mOffscreenRendering = false;
+        }
+    }
+    if (mComputePost) {
+        // Not every surface allows storage usage of its swapchain images
+        VkSurfaceCapabilitiesKHR surfaceCapabilities;
+        ASSERT(mVk.GetPhysicalDeviceSurfaceCapabilitiesKHR(mGpu, mSurface, &surfaceCapabilities) ==
+               VK_SUCCESS);
+        VkFormatProperties formatProperties;
+        mVk.GetPhysicalDeviceFormatProperties(mGpu, mFormat, &formatProperties);
+        if (!mComputeQueueEnabled) {
+            ALOGD("No queue supports compute, compute post stage disabled");
+            mComputePost = false;
+        } else if (!mOffscreenRendering) {
+            ALOGD("Compute post stage disabled without offscreen rendering");
+            mComputePost = false;
+        } else if (!(surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT) ||
+                   !(formatProperties.optimalTilingFeatures &
+                     VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+            ALOGD("Swapchain images can't be storage images, compute post stage disabled");
+            mComputePost = false;
+        }
+    }
+    // The queues hand over through the frame timeline, so there is no async post without it
+    mAsyncPost = mComputePost && mComputeQueueFamilyIndex != mQueueFamilyIndex &&
+            mTimelineSemaphoreEnabled;
+    ALOGD("Compute post stage = %d, async = %d", mComputePost, mAsyncPost);
     createSwapchain(VK_NULL_HANDLE);
+    mUploadRing.initialize(&mVk, mDevice, &mAllocator, mQueueFamilyIndex, kMaxInflight,
+                           kUploadRingFrameSize,
+                           VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                                   VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                           std::max<VkDeviceSize>(
+                                   mGpuProperties.limits.minUniformBufferOffsetAlignment, 16));
     createTextures();
     createDescriptorSet();
     createRenderPass();
+    // Overlaps with the pipeline creation below
+    createFramebuffersAsync();
+    createPipelineCache();
+    const int64_t pipelineStartNanos = nowNanos();
     createGraphicsPipeline();
+    if (mOffscreenRendering) {
+        createUpscaleSampler();
+        if (mComputePost) {
+            createPostPipeline();
+        } else {
+            createUpscalePipeline();
+        }
+        createOffscreenTarget();
+    }
+    ALOGD("Graphics pipeline created in %lld us",
+          (long long)(nowNanos() - pipelineStartNanos) / 1000);
     createVertexBuffer();
-    createCommandBuffers();
-    createSemaphores();
-    createFences();
+    mQuadBatch.initialize(&mVk, &mUploadRing, kMaxInflight, kMaxQuads,
+                          !mDescriptorIndexingEnabled);
+    mJobSystem.initialize(0);
+    createFrameTimeline();
+    createFrameResources();
+    mAllocator.logStatistics();
+
+    mMetrics.reset();
 }
 
 void Renderer::drawFrame() {
-    // mInflightFences are created in the signaled state, so we can wait here from the beginning.
-    const uint32_t frameIndex = mFrameCount % kInflight;
-    ASSERT(mVk.WaitForFences(mDevice, 1, &mInflightFences[frameIndex], VK_TRUE, kTimeout30Sec) ==
-           VK_SUCCESS);
+    if (mPendingLatencyMode != mLatencyMode) {
+        applyLatencyMode();
+    }
+
+    const int64_t frameStartNanos = nowNanos();
+
+    // Wait for the last submit of this frame, serial 0 if there was none yet
+    const uint32_t frameIndex = mFrameCount % mInflight;
+    waitFrameSerial(mFrameSerials[frameIndex]);
+    int64_t stageEndNanos = nowNanos();
+    mMetrics.record(FrameMetrics::FENCE_WAIT, stageEndNanos - frameStartNanos);
+
+    // The wait guarantees the timestamps written by the last use of this frame are available
+    collectGpuTimestamps(frameIndex);
+
+    // The wait also guarantees this frame's slice of the upload ring is idle. The scene has
+    // usually been built by the update thread while the previous frame was recorded.
+    uint32_t sceneIndex = 0;
+    ASSERT(mBuiltScenes.pop(&sceneIndex));
+    mUploadRing.begin(frameIndex);
+    writeSceneUniforms(frameIndex);
+    buildQuadBatch(frameIndex, mSceneFrames[sceneIndex]);
+    mUploadRing.end();
+
+    // Swap in streamed textures and evict the ones over budget the scene doesn't sample. The wait
+    // also guarantees this frame's descriptor set is idle.
+    updateStreamedTextures();
+    updateTextureResidency(mSceneFrames[sceneIndex]);
+    mBuiltScenes.finish();
+    ASSERT(mFreeScenes.push(sceneIndex));
+    if (mDescriptorSetsDirty[frameIndex]) {
+        updateDescriptorSet(frameIndex);
+    }
 
     // Need to reset fences to unsignaled state for vkQueueSubmit
-    ASSERT(mVk.ResetFences(mDevice, 1, &mInflightFences[frameIndex]) == VK_SUCCESS);
+    const bool signalTimeline = mFrameTimeline != VK_NULL_HANDLE;
+    if (!signalTimeline) {
+        ASSERT(mVk.ResetFences(mDevice, 1, &mInflightFences[frameIndex]) == VK_SUCCESS);
+    }
 
+    // Acquiring with an infinite timeout only guarantees progress while no more images than the
+    // spare ones are acquired, one per frame not yet presented by the submit thread
+    int64_t stageStartNanos = nowNanos();
+    mSubmissions.waitPending(mSpareImageCount);
     uint32_t imageIndex;
-    ASSERT(mVk.AcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX, mAcquireSemaphores[frameIndex],
-                                   VK_NULL_HANDLE, &imageIndex) == VK_SUCCESS);
+    {
+        std::lock_guard<std::mutex> lock(mSwapchainLock);
+        const VkResult ret = mVk.AcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX,
+                                                     mAcquireSemaphores[frameIndex],
+                                                     VK_NULL_HANDLE, &imageIndex);
+        ASSERT(ret == VK_SUCCESS || ret == VK_SUBOPTIMAL_KHR);
+        mSwapchainOutdated |= ret == VK_SUBOPTIMAL_KHR;
+    }
+    stageEndNanos = nowNanos();
+    mMetrics.record(FrameMetrics::ACQUIRE, stageEndNanos - stageStartNanos);
+
+    // Usually done long ago, while the previous frame was presented
+    waitFramebuffers();
+
+    stageStartNanos = nowNanos();
+    const VkCommandBuffer commandBuffer = getCommandBuffer(frameIndex, imageIndex);
+    VkCommandBuffer postCommandBuffer = VK_NULL_HANDLE;
+    if (mAsyncPost) {
+        // A handful of commands, cheaper to record every frame than to track for reuse
+        postCommandBuffer = mPostCommandBuffers[frameIndex];
+        const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                .pNext = nullptr,
+                .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                .pInheritanceInfo = nullptr,
+        };
+        ASSERT(mVk.BeginCommandBuffer(postCommandBuffer, &commandBufferBeginInfo) == VK_SUCCESS);
+        recordPostDispatch(postCommandBuffer, imageIndex);
+        ASSERT(mVk.EndCommandBuffer(postCommandBuffer) == VK_SUCCESS);
+    }
+    stageEndNanos = nowNanos();
+    mMetrics.record(FrameMetrics::RECORD, stageEndNanos - stageStartNanos);
+
+    // The serials are taken as soon as the frame is handed over. Waiting on the timeline for one
+    // the submit thread hasn't submitted yet simply lasts until it is submitted and completed, the
+    // fences are only touched once mSubmitThreadSerial covers their frame.
+    const uint64_t serial = mSubmittedSerial + 1;
+    mSubmittedSerial += mAsyncPost ? 2 : 1;
+    mFrameSerials[frameIndex] = mSubmittedSerial;
+    mTimestampsPending[frameIndex] = mTimestampQueryPool != VK_NULL_HANDLE;
+
+    // Tag the present with an id so the actual present time can be matched up later
+    const uint32_t presentId = mFrameCount + 1;
+    mPresentRecords[presentId % kPresentRecordCount] = {
+            .presentId = presentId,
+            .startNanos = frameStartNanos,
+    };
+    ASSERT(mSubmissions.push({
+            .frameIndex = frameIndex,
+            .imageIndex = imageIndex,
+            .commandBuffer = commandBuffer,
+            .postCommandBuffer = postCommandBuffer,
+            .serial = serial,
+            .presentId = presentId,
+            .swapchainSerial = mSwapchainSerial,
+            .frameStartNanos = frameStartNanos,
+    }));
+
+    if (mDisplayTimingEnabled) {
+        collectPresentationTimings();
+    }
+    // Picks up whichever previous frames the submit thread has presented by now
+    processPresentResults();
+
+    // Retired swapchains whose last frame has completed can go away now
+    destroyRetiredSwapchains(false);
+
+    // Recreate right away, no matter how many swapchains are still retiring. Not every driver
+    // reports VK_SUBOPTIMAL_KHR for a 180 degree rotation, so the transform is polled as well.
+    if (mSwapchainOutdated || mFireRecreateSwapchain || hasSurfaceTransformChanged()) {
+        // Nothing may present to the swapchain while it is replaced
+        waitFrameSubmissions();
+        if (mRotationStartNanos == 0) {
+            mRotationStartNanos = frameStartNanos;
+            mRotationSwapchainSerial = mSwapchainSerial + 1;
+        }
+        ALOGD("%s[%u][%d] - recreate swapchain", __FUNCTION__, mFrameCount, mSwapchainOutdated);
+        mFireRecreateSwapchain = false;
+        stageStartNanos = nowNanos();
+        recreateSwapchain();
+        mMetrics.record(FrameMetrics::RECREATE_SWAPCHAIN, nowNanos() - stageStartNanos);
+    }
 
-    // Lazy allocate VkImageView and VkFramebuffer only when needed, and reuse later
-    if (mFramebuffers[imageIndex] == VK_NULL_HANDLE) {
-        createFramebuffer(imageIndex);
+    // Increase the frame count here and log at a frame interval
+    if (++mFrameCount % kLogInterval == 0) {
+        ALOGD("%s[%u]", __FUNCTION__, mFrameCount);
+        logFrameMetrics();
     }
+}
 
-    recordCommandBuffer(frameIndex, imageIndex);
+void Renderer::setLatencyMode(LatencyMode mode) {
+    mPendingLatencyMode = mode;
+}
 
-    const VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    const VkSubmitInfo submitInfo = {
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .pNext = nullptr,
-            .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &mAcquireSemaphores[frameIndex],
-            .pWaitDstStageMask = &waitStageMask,
-            .commandBufferCount = 1,
-            .pCommandBuffers = &mCommandBuffers[frameIndex],
-            .signalSemaphoreCount = 1,
-            .pSignalSemaphores = &mRenderSemaphores[frameIndex],
+void Renderer::setCommandBufferReuse(bool enable) {
+    if (enable && !mReuseCommandBuffers) {
+        // Nothing tracked the changes while reuse was off
+        markCommandBuffersDirty();
+    }
+    mReuseCommandBuffers = enable;
+}
+
+void Renderer::setSceneQuadCount(uint32_t count) {
+    // Scenes the update thread has built already keep the previous count
+    mSceneQuadCount.store(std::min(count, kMaxQuads), std::memory_order_relaxed);
+}
+
+void Renderer::setTextureCount(uint32_t count) {
+    mTextureCount = std::clamp(count, 1U, kMaxTextureCount);
+}
+
+void Renderer::setSceneTextureCount(uint32_t count) {
+    // Scenes the update thread has built already keep the previous count
+    mSceneTextureCount.store(count, std::memory_order_relaxed);
+}
+
+void Renderer::setSpecializedPreRotation(bool enable) {
+    mSpecializedPreRotation = enable;
+}
+
+void Renderer::setSyntheticTextureSize(uint32_t size) {
+    mSyntheticTextureSize = size;
+}
+
+void Renderer::setSamplerMode(SamplerMode mode) {
+    mDefaultSamplerMode = mode;
+}
+
+void Renderer::setTextureSamplerMode(uint32_t textureIndex, SamplerMode mode) {
+    ASSERT(textureIndex < mTextures.size());
+    if (mTextures[textureIndex].samplerMode != mode) {
+        mTextures[textureIndex].samplerMode = mode;
+        std::fill(mDescriptorSetsDirty.begin(), mDescriptorSetsDirty.end(), true);
+    }
+}
+
+const char* Renderer::getSamplerModeName(SamplerMode mode) {
+    return kSamplerModeNames[static_cast<uint32_t>(mode)];
+}
+
+uint64_t Renderer::estimateTextureReadBytes() const {
+    // All the quads of the scene sample the first texture, fit into the surface and rendered at
+    // mRenderScale, and at mOffscreenScale of that when rendering offscreen. A minified texture
+    // reads all the texels of level 0 without mipmapping, and those of the two levels around its
+    // level of detail with it.
+    const Texture& texture = mTextures[0];
+    const float scaleW = mSurfaceWidth / (float)texture.width;
+    const float scaleH = mSurfaceHeight / (float)texture.height;
+    const float renderScale = mRenderScale * (mOffscreenRendering ? mOffscreenScale : 1.0F);
+    const float texelsPerPixel = 1.0F / (std::min(scaleW, scaleH) * renderScale);
+    const bool isMipmapped = texture.samplerMode == SamplerMode::TRILINEAR ||
+                             texture.samplerMode == SamplerMode::ANISOTROPIC;
+    const uint32_t lastLevel = std::max(texture.levelCount, 1U) - 1;
+    uint32_t firstLevel = 0;
+    if (isMipmapped && texelsPerPixel > 1.0F) {
+        firstLevel = std::min((uint32_t)std::log2(texelsPerPixel), lastLevel);
+    }
+    uint64_t bytes = 0;
+    const uint32_t endLevel = isMipmapped ? std::min(firstLevel + 1, lastLevel) : firstLevel;
+    for (uint32_t i = firstLevel; i <= endLevel; i++) {
+        bytes += (uint64_t)std::max(texture.width >> i, 1U) * std::max(texture.height >> i, 1U) *
+                 kTexelSizeEstimate;
+    }
+    return bytes;
+}
+
+void Renderer::setTextureBudget(VkDeviceSize bytes) {
+    mTextureBudget = bytes;
+}
+
+Renderer::TextureCacheStatistics Renderer::getTextureCacheStatistics() const {
+    return {
+            .hitCount = mTextureCacheHits,
+            .missCount = mTextureCacheMisses,
+            .evictionCount = mTextureEvictions,
+            .residentBytes = mResidentTextureBytes,
+            .budgetBytes = mTextureBudget ? mTextureBudget : mQueriedTextureBudget,
     };
-    ASSERT(mVk.QueueSubmit(mQueue, 1, &submitInfo, mInflightFences[frameIndex]) == VK_SUCCESS);
+}
 
-    const VkPresentInfoKHR presentInfo = {
-            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-            .pNext = nullptr,
-            .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &mRenderSemaphores[frameIndex],
-            .swapchainCount = 1,
-            .pSwapchains = &mSwapchain,
-            .pImageIndices = &imageIndex,
-            .pResults = nullptr,
+void Renderer::setRenderScale(float scale) {
+    scale = std::clamp(scale, kMinRenderScale, 1.0F);
+    if (scale != mRenderScale) {
+        ALOGD("%s: %.2f -> %.2f", __FUNCTION__, mRenderScale, scale);
+        mRenderScale = scale;
+        mFireRecreateSwapchain = true;
+    }
+}
+
+void Renderer::setOffscreenRendering(bool enable) {
+    mOffscreenRendering = enable;
+}
+
+void Renderer::setOffscreenScale(float scale) {
+    scale = std::clamp(scale, kMinRenderScale, 1.0F);
+    if (scale != mOffscreenScale) {
+        ALOGD("%s: %.2f -> %.2f", __FUNCTION__, mOffscreenScale, scale);
+        mOffscreenScale = scale;
+        // Reused command buffers have the render area and the upscale coordinates baked in
+        markCommandBuffersDirty();
+    }
+}
+
+void Renderer::setComputePost(bool enable) {
+    mComputePost = enable;
+}
+
+void Renderer::setDepthBuffer(bool enable) {
+    mDepthBuffer = enable;
+}
+
+void Renderer::setMultisampling(bool enable) {
+    mMultisampling = enable;
+}
+
+Renderer::AttachmentTraffic Renderer::estimateAttachmentTraffic() const {
+    // The scene stores its color once per pixel of its render area, and when rendering offscreen
+    // the upscale pass or the post stage reads it back and stores the full swapchain image
+    const VkExtent2D sceneExtent = mOffscreenRendering
+            ? getOffscreenExtent()
+            : VkExtent2D{.width = mImageWidth, .height = mImageHeight};
+    const uint64_t scenePixels = (uint64_t)sceneExtent.width * sceneExtent.height;
+    AttachmentTraffic traffic = {
+            .bytes = scenePixels * kTexelSizeEstimate,
+            .offTileBytes = 0,
     };
-    VkResult ret = mVk.QueuePresentKHR(mQueue, &presentInfo);
-
-    // If there's old swapchain to be destroyed, check if we have reached the retire frame count
-    if (mOldSwapchain != VK_NULL_HANDLE && mRetireFrame == mFrameCount) {
-        destroyOldSwapchain();
-    }
-
-    // VK_SUBOPTIMAL_KHR shouldn't occur again within kInflight frames in the real world. If that
-    // happens, will switch to an array later to save the old swapchain stuff
-    if (ret == VK_SUBOPTIMAL_KHR || mFireRecreateSwapchain) {
-        // mFireRecreateSwapchain usually comes 3 to 4 frames later after 90 degree rotation, but we
-        // set the countdown latency to 30 to play safe
-        if (is180Rotation() || mFireRecreateSwapchain || !(--mPreRotationLatency)) {
-            mPreRotationLatency = kPreRotationLatency;
-            mFireRecreateSwapchain = false;
-            ALOGD("%s[%u][%d] - recreate swapchain", __FUNCTION__, mFrameCount, ret);
-            std::swap(mSwapchain, mOldSwapchain);
-            std::swap(mImages, mOldImages);
-            std::swap(mImageViews, mOldImageViews);
-            std::swap(mFramebuffers, mOldFramebuffers);
-
-            mRetireFrame = mFrameCount + kInflight;
-
-            // Recreate the new swapchain with the latest preTransform. Numbers of swapchain images,
-            // image views and framebuffers are also allowed to change. Even the aspect ratio of the
-            // swapchain can change, which requires us to use dynamic viewport and scissor
-            createSwapchain(mOldSwapchain);
-        }
-    } else {
-        ASSERT(ret == VK_SUCCESS);
+    if (mOffscreenRendering) {
+        traffic.bytes += scenePixels * kTexelSizeEstimate +
+                (uint64_t)mImageWidth * mImageHeight * kTexelSizeEstimate;
     }
 
-    // Increase the frame count here and log at a frame interval
-    if (++mFrameCount % kLogInterval == 0) {
-        ALOGD("%s[%u][%d]", __FUNCTION__, mFrameCount, ret);
+    // Off tile, every sample gets stored, and a multisampled color is read back to be resolved
+    traffic.offTileBytes = traffic.bytes;
+    const uint64_t samples = scenePixels * mSampleCount;
+    if (mSampleCount != VK_SAMPLE_COUNT_1_BIT) {
+        traffic.offTileBytes += 2 * samples * kTexelSizeEstimate;
     }
+    if (mDepthBuffer) {
+        traffic.offTileBytes += samples * kDepthSampleSize;
+    }
+    return traffic;
+}
+
+void Renderer::requestSwapchainRecreation() {
+    mFireRecreateSwapchain = true;
 }
 
 void Renderer::updateSurface(uint32_t width, uint32_t height) {
@@ -138,86 +520,171 @@ void Renderer::updateSurface(uint32_t width, uint32_t height) {
     }
 }
 
+void Renderer::releaseSurface() {
+    ASSERT(mDevice != VK_NULL_HANDLE);
+    ASSERT(mSurface != VK_NULL_HANDLE);
+    const int64_t startNanos = nowNanos();
+
+    // Every frame in flight presents to the swapchain going away. The frame semaphores are
+    // replaced along with it, nothing tells when the presentation engine is done with them.
+    waitFrameSubmissions();
+    mVk.DeviceWaitIdle(mDevice);
+    mCompletedSerial = mSubmittedSerial;
+    waitFramebuffers();
+    for (uint32_t i = 0; i < mInflight; i++) {
+        collectGpuTimestamps(i);
+    }
+    destroyFrameResources();
+    destroySwapchains();
+    mVk.DestroySurfaceKHR(mInstance, mSurface, nullptr);
+    mSurface = VK_NULL_HANDLE;
+    mWindow = nullptr;
+    mResumeStartNanos = 0;
+
+    // The process may well be killed in the background
+    savePipelineCache();
+
+    ALOGD("Successfully released surface in %lld us", (long long)(nowNanos() - startNanos) / 1000);
+}
+
+void Renderer::resumeSurface(ANativeWindow* window) {
+    ASSERT(mDevice != VK_NULL_HANDLE);
+    ASSERT(mSurface == VK_NULL_HANDLE);
+    mResumeStartNanos = nowNanos();
+    // The new swapchain already picks up anything requested before
+    mFireRecreateSwapchain = false;
+
+    // The render passes and the pipelines stay compatible as long as the format is the same
+    const VkFormat format = mFormat;
+    createSurface(window);
+    ASSERT(mFormat == format);
+    createSwapchain(VK_NULL_HANDLE);
+    createFramebuffersAsync();
+    if (mOffscreenRendering) {
+        createOffscreenTarget();
+    }
+    updateTransform();
+    createFrameResources();
+
+    ALOGD("Successfully resumed surface in %lld us",
+          (long long)(nowNanos() - mResumeStartNanos) / 1000);
+}
+
+void Renderer::cycleSurface() {
+    ANativeWindow* window = mWindow;
+    releaseSurface();
+    resumeSurface(window);
+}
+
 void Renderer::destroy() {
     if (mDevice != VK_NULL_HANDLE) {
+        waitFrameSubmissions();
         mVk.DeviceWaitIdle(mDevice);
+        waitFramebuffers();
 
-        // Destroy sync objects
-        for (auto& fence : mInflightFences) {
-            mVk.DestroyFence(mDevice, fence, nullptr);
-        }
-        mInflightFences.clear();
-        for (auto& semaphore : mAcquireSemaphores) {
-            mVk.DestroySemaphore(mDevice, semaphore, nullptr);
-        }
-        mAcquireSemaphores.clear();
-        for (auto& semaphore : mRenderSemaphores) {
-            mVk.DestroySemaphore(mDevice, semaphore, nullptr);
-        }
-        mRenderSemaphores.clear();
+        // Stop streaming, textures not handed over yet are destroyed with the streamer
+        mStreamer.destroy();
 
-        // Destroy command buffers
-        if (!mCommandBuffers.empty()) {
-            mVk.FreeCommandBuffers(mDevice, mCommandPool, mCommandBuffers.size(),
-                                   mCommandBuffers.data());
-        }
-        mCommandBuffers.clear();
-        mVk.DestroyCommandPool(mDevice, mCommandPool, nullptr);
-        mCommandPool = VK_NULL_HANDLE;
+        // Destroy query pool, sync objects and command buffers
+        destroyFrameResources();
+        mVk.DestroySemaphore(mDevice, mFrameTimeline, nullptr);
+        mFrameTimeline = VK_NULL_HANDLE;
+        mPresentRecords.clear();
+        mJobSystem.destroy();
 
         // Destroy vertex buffer
         mVk.DestroyBuffer(mDevice, mVertexBuffer, nullptr);
         mVertexBuffer = VK_NULL_HANDLE;
-        mVk.FreeMemory(mDevice, mVertexMemory, nullptr);
-        mVertexMemory = VK_NULL_HANDLE;
+        mAllocator.free(&mVertexMemory);
+        mQuadBatch.destroy();
+        mUploadRing.destroy();
 
         // Destroy graphics pipeline
-        mVk.DestroyPipeline(mDevice, mPipeline, nullptr);
-        mPipeline = VK_NULL_HANDLE;
+        for (auto& pipeline : mPipelines) {
+            mVk.DestroyPipeline(mDevice, pipeline, nullptr);
+        }
+        mPipelines.clear();
         mVk.DestroyPipelineLayout(mDevice, mPipelineLayout, nullptr);
         mPipelineLayout = VK_NULL_HANDLE;
 
+        // Destroy upscale pipeline
+        mVk.DestroyPipeline(mDevice, mUpscalePipeline, nullptr);
+        mUpscalePipeline = VK_NULL_HANDLE;
+        mVk.DestroyPipelineLayout(mDevice, mUpscalePipelineLayout, nullptr);
+        mUpscalePipelineLayout = VK_NULL_HANDLE;
+        mVk.DestroyDescriptorSetLayout(mDevice, mUpscaleDescriptorSetLayout, nullptr);
+        mUpscaleDescriptorSetLayout = VK_NULL_HANDLE;
+        mVk.DestroySampler(mDevice, mUpscaleSampler, nullptr);
+        mUpscaleSampler = VK_NULL_HANDLE;
+
+        // Destroy post pipeline
+        mVk.DestroyPipeline(mDevice, mPostPipeline, nullptr);
+        mPostPipeline = VK_NULL_HANDLE;
+        mVk.DestroyPipelineLayout(mDevice, mPostPipelineLayout, nullptr);
+        mPostPipelineLayout = VK_NULL_HANDLE;
+        mVk.DestroyDescriptorSetLayout(mDevice, mPostDescriptorSetLayout, nullptr);
+        mPostDescriptorSetLayout = VK_NULL_HANDLE;
+
+        // Persist and destroy pipeline cache
+        savePipelineCache();
+        mVk.DestroyPipelineCache(mDevice, mPipelineCache, nullptr);
+        mPipelineCache = VK_NULL_HANDLE;
+
         // Destroy render pass
         mVk.DestroyRenderPass(mDevice, mRenderPass, nullptr);
         mRenderPass = VK_NULL_HANDLE;
+        mVk.DestroyRenderPass(mDevice, mUpscaleRenderPass, nullptr);
+        mUpscaleRenderPass = VK_NULL_HANDLE;
 
         // Destroy descriptor sets
         mVk.DestroyDescriptorPool(mDevice, mDescriptorPool, nullptr);
         mVk.DestroyDescriptorSetLayout(mDevice, mDescriptorSetLayout, nullptr);
+        mVk.DestroyDescriptorSetLayout(mDevice, mSceneUniformSetLayout, nullptr);
+        mSceneUniformSetLayout = VK_NULL_HANDLE;
+        mSceneUniformSet = VK_NULL_HANDLE;
+        mSceneUniformOffsets.clear();
+        mDescriptorSets.clear();
+        mDescriptorSetsDirty.clear();
 
         // Destroy textures
+        destroyRetiredTextures(true);
         for (auto& texture : mTextures) {
             mVk.DestroyImageView(mDevice, texture.view, nullptr);
-            mVk.DestroySampler(mDevice, texture.sampler, nullptr);
             mVk.DestroyImage(mDevice, texture.image, nullptr);
-            mVk.FreeMemory(mDevice, texture.memory, nullptr);
+            mAllocator.free(&texture.memory);
+            mVk.DestroyImageView(mDevice, texture.lowResView, nullptr);
+            mVk.DestroyImage(mDevice, texture.lowResImage, nullptr);
+            mAllocator.free(&texture.lowResMemory);
         }
         mTextures.clear();
+        mResidentTextureBytes = 0;
+        mVk.DestroyImageView(mDevice, mPlaceholderTexture.view, nullptr);
+        mVk.DestroyImage(mDevice, mPlaceholderTexture.image, nullptr);
+        mAllocator.free(&mPlaceholderTexture.memory);
+        mPlaceholderTexture = Texture();
+        for (auto& sampler : mSamplers) {
+            mVk.DestroySampler(mDevice, sampler, nullptr);
+            sampler = VK_NULL_HANDLE;
+        }
 
-        // Destroy old swapchain
-        destroyOldSwapchain();
+        // Destroy current and retired swapchains
+        destroySwapchains();
 
-        // Destroy current swapchain
-        for (auto& imageView : mImageViews) {
-            mVk.DestroyImageView(mDevice, imageView, nullptr);
-        }
-        mImageViews.clear();
-        for (auto& framebuffer : mFramebuffers) {
-            mVk.DestroyFramebuffer(mDevice, framebuffer, nullptr);
-        }
-        mFramebuffers.clear();
-        mImages.clear();
-        mVk.DestroySwapchainKHR(mDevice, mSwapchain, nullptr);
+        // Destroy memory allocator, everything has been freed by now
+        mAllocator.destroy();
 
         // Destroy device
         mVk.DestroyDevice(mDevice, nullptr);
         mDevice = VK_NULL_HANDLE;
+        mDisplayTimingEnabled = false;
+        mRefreshDurationNanos = 0;
     }
 
     if (mInstance) {
-        // Destroy surface
+        // Destroy surface, already gone if destroyed after releaseSurface
         mVk.DestroySurfaceKHR(mInstance, mSurface, nullptr);
         mSurface = VK_NULL_HANDLE;
+        mWindow = nullptr;
 
         // Destroy instance
         mVk.DestroyInstance(mInstance, nullptr);
@@ -241,7 +708,7 @@ void Renderer::createInstance() {
 
     uint32_t instanceVersion = 0;
     ASSERT(mVk.EnumerateInstanceVersion(&instanceVersion) == VK_SUCCESS);
-    ASSERT(instanceVersion >= VK_MAKE_VERSION(1, 1, 0));
+    ASSERT(instanceVersion >= kApiVersion);
 
     uint32_t extensionCount = 0;
     ASSERT(mVk.EnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr) ==
@@ -264,7 +731,7 @@ void Renderer::createInstance() {
             .applicationVersion = 0,
             .pEngineName = nullptr,
             .engineVersion = 0,
-            .apiVersion = VK_MAKE_VERSION(1, 1, 0),
+            .apiVersion = kApiVersion,
     };
     const VkInstanceCreateInfo instanceInfo = {
             .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -305,6 +772,21 @@ void Renderer::createDevice() {
         enabledDeviceExtensions.push_back(extension);
     }
 
+    // Display timing is optional and only used to report the actual present time
+    if (hasExtension(VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME, supportedDeviceExtensions)) {
+        enabledDeviceExtensions.push_back(VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME);
+        mDisplayTimingEnabled = true;
+    }
+    ALOGD("VK_GOOGLE_display_timing enabled = %d", mDisplayTimingEnabled);
+
+    // The memory budget only sizes the texture budget when the app didn't set one
+    mMemoryBudgetEnabled = false;
+    if (hasExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, supportedDeviceExtensions)) {
+        enabledDeviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        mMemoryBudgetEnabled = true;
+    }
+    ALOGD("VK_EXT_memory_budget enabled = %d", mMemoryBudgetEnabled);
+
     uint32_t queueFamilyCount = 0;
     mVk.GetPhysicalDeviceQueueFamilyProperties(mGpu, &queueFamilyCount, nullptr);
     ASSERT(queueFamilyCount);
@@ -313,9 +795,17 @@ void Renderer::createDevice() {
     mVk.GetPhysicalDeviceQueueFamilyProperties(mGpu, &queueFamilyCount,
                                                queueFamilyProperties.data());
 
-    uint32_t queueFamilyIndex;
-    for (queueFamilyIndex = 0; queueFamilyIndex < queueFamilyCount; ++queueFamilyIndex) {
-        if (queueFamilyProperties[queueFamilyIndex].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+    // Prefer a graphics family that also supports compute, so compute work always has a queue
+    uint32_t queueFamilyIndex = queueFamilyCount;
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        const VkQueueFlags queueFlags = queueFamilyProperties[i].queueFlags;
+        if (!(queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            continue;
+        }
+        if (queueFamilyIndex == queueFamilyCount || (queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+            queueFamilyIndex = i;
+        }
+        if (queueFlags & VK_QUEUE_COMPUTE_BIT) {
             break;
         }
     }
@@ -323,30 +813,177 @@ void Renderer::createDevice() {
     mQueueFamilyIndex = queueFamilyIndex;
     ALOGD("queueFamilyIndex = %u", queueFamilyIndex);
 
-    const float priority = 1.0F;
-    const VkDeviceQueueCreateInfo queueCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+    // Stream textures on a transfer only queue family if there is one, which usually maps to a DMA
+    // engine running alongside graphics. Otherwise uploads share the graphics queue.
+    mTransferQueueFamilyIndex = mQueueFamilyIndex;
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        const VkQueueFlags queueFlags = queueFamilyProperties[i].queueFlags;
+        if ((queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+            !(queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            mTransferQueueFamilyIndex = i;
+            break;
+        }
+    }
+    ALOGD("transferQueueFamilyIndex = %u", mTransferQueueFamilyIndex);
+
+    // Likewise for async compute, a compute family without graphics can run alongside rendering.
+    // Otherwise compute work goes to the graphics queue, if that supports compute at all.
+    mComputeQueueFamilyIndex = mQueueFamilyIndex;
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        const VkQueueFlags queueFlags = queueFamilyProperties[i].queueFlags;
+        if ((queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            mComputeQueueFamilyIndex = i;
+            break;
+        }
+    }
+    mComputeQueueEnabled =
+            queueFamilyProperties[mComputeQueueFamilyIndex].queueFlags & VK_QUEUE_COMPUTE_BIT;
+    ALOGD("computeQueueFamilyIndex = %u, enabled = %d", mComputeQueueFamilyIndex,
+          mComputeQueueEnabled);
+
+    // timestampValidBits of 0 means the queue doesn't support timestamps at all
+    const uint32_t timestampValidBits = queueFamilyProperties[queueFamilyIndex].timestampValidBits;
+    mTimestampMask = timestampValidBits >= 64 ? UINT64_MAX : (1ULL << timestampValidBits) - 1;
+    mVk.GetPhysicalDeviceProperties(mGpu, &mGpuProperties);
+    mTimestampPeriod = mGpuProperties.limits.timestampPeriod;
+    ALOGD("timestampValidBits = %u, timestampPeriod = %f", timestampValidBits, mTimestampPeriod);
+
+    // Query the optional features of the extensions we may enable in one go
+    const bool wantsTimelineSemaphore =
+            hasExtension(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, supportedDeviceExtensions);
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineSemaphoreFeatures = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
             .pNext = nullptr,
-            .flags = 0,
-            .queueFamilyIndex = mQueueFamilyIndex,
-            .queueCount = 1,
-            .pQueuePriorities = &priority,
+            .timelineSemaphore = VK_FALSE,
+    };
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexingFeatures = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+            .pNext = wantsTimelineSemaphore ? &timelineSemaphoreFeatures : nullptr,
+    };
+    VkPhysicalDeviceFeatures2 features = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            .pNext = &descriptorIndexingFeatures,
+            .features = {},
+    };
+    const bool hasDescriptorIndexing =
+            hasExtension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME, supportedDeviceExtensions);
+    if (!hasDescriptorIndexing) {
+        features.pNext = descriptorIndexingFeatures.pNext;
+    }
+    mVk.GetPhysicalDeviceFeatures2(mGpu, &features);
+
+    // Both texture tables index their sampler array with a value that is not a constant. Without
+    // it every texture gets a descriptor set of its own, bound for each draw.
+    VkPhysicalDeviceFeatures enabledFeatures = {};
+    mDynamicIndexingEnabled = features.features.shaderSampledImageArrayDynamicIndexing;
+    enabledFeatures.shaderSampledImageArrayDynamicIndexing =
+            mDynamicIndexingEnabled ? VK_TRUE : VK_FALSE;
+
+    // Without anisotropy the anisotropic sampler mode is plain trilinear
+    mMaxAnisotropy = 1.0F;
+    if (features.features.samplerAnisotropy) {
+        enabledFeatures.samplerAnisotropy = VK_TRUE;
+        mMaxAnisotropy = std::min(mGpuProperties.limits.maxSamplerAnisotropy, kMaxAnisotropy);
+    }
+    ALOGD("Sampler anisotropy = %.1f", mMaxAnisotropy);
+
+    // The chain of extension features to enable, only holding the ones actually used
+    void* enabledFeaturesChain = nullptr;
+
+    // Timeline semaphores track the frames and the upload batches by serial instead of fences,
+    // and hand the uploads over to the graphics queue without a CPU wait
+    mTimelineSemaphoreEnabled = false;
+    if (wantsTimelineSemaphore && timelineSemaphoreFeatures.timelineSemaphore) {
+        enabledDeviceExtensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+        mTimelineSemaphoreEnabled = true;
+        timelineSemaphoreFeatures.pNext = enabledFeaturesChain;
+        enabledFeaturesChain = &timelineSemaphoreFeatures;
+    }
+    ALOGD("VK_KHR_timeline_semaphore enabled = %d", mTimelineSemaphoreEnabled);
+
+    // Descriptor indexing lets the quads of one draw sample different textures of a large table,
+    // without having to write the descriptors of the unused entries. The maintenance3 dependency
+    // of the extension is core in Vulkan 1.1. Each set holds a single table.
+    const VkPhysicalDeviceLimits& limits = mGpuProperties.limits;
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT enabledDescriptorIndexingFeatures = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+            .pNext = nullptr,
+            .shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
+            .descriptorBindingPartiallyBound = VK_TRUE,
     };
+    mDescriptorIndexingEnabled = false;
+    if (hasDescriptorIndexing && mDynamicIndexingEnabled &&
+        descriptorIndexingFeatures.shaderSampledImageArrayNonUniformIndexing &&
+        descriptorIndexingFeatures.descriptorBindingPartiallyBound &&
+        limits.maxPerStageDescriptorSamplers >= kBindlessTextureTableSize &&
+        limits.maxPerStageDescriptorSampledImages >= kBindlessTextureTableSize &&
+        limits.maxDescriptorSetSamplers >= kBindlessTextureTableSize &&
+        limits.maxDescriptorSetSampledImages >= kBindlessTextureTableSize) {
+        enabledDeviceExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+        mDescriptorIndexingEnabled = true;
+        enabledDescriptorIndexingFeatures.pNext = enabledFeaturesChain;
+        enabledFeaturesChain = &enabledDescriptorIndexingFeatures;
+    }
+    if (mDescriptorIndexingEnabled) {
+        mTextureTableSize = kBindlessTextureTableSize;
+        mTextureSetCount = 1;
+    } else if (mDynamicIndexingEnabled) {
+        mTextureTableSize = kTextureTableSize;
+        mTextureSetCount = 1;
+    } else {
+        mTextureTableSize = 1;
+        mTextureSetCount = mTextureCount;
+    }
+    ALOGD("VK_EXT_descriptor_indexing enabled = %d, dynamic indexing = %d, textureTableSize = %u, "
+          "textureSetCount = %u",
+          mDescriptorIndexingEnabled, mDynamicIndexingEnabled, mTextureTableSize,
+          mTextureSetCount);
+
+    // One queue per distinct family, the transfer and compute queues fall back to the graphics
+    // queue itself when they share its family
+    const float priority = 1.0F;
+    const uint32_t queueFamilyIndices[3] = {mQueueFamilyIndex, mTransferQueueFamilyIndex,
+                                            mComputeQueueFamilyIndex};
+    VkDeviceQueueCreateInfo queueCreateInfos[3];
+    uint32_t queueCreateInfoCount = 0;
+    for (const uint32_t familyIndex : queueFamilyIndices) {
+        const auto isCreated = [&](const VkDeviceQueueCreateInfo& info) {
+            return info.queueFamilyIndex == familyIndex;
+        };
+        if (std::any_of(queueCreateInfos, queueCreateInfos + queueCreateInfoCount, isCreated)) {
+            continue;
+        }
+        queueCreateInfos[queueCreateInfoCount++] = {
+                .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = 0,
+                .queueFamilyIndex = familyIndex,
+                .queueCount = 1,
+                .pQueuePriorities = &priority,
+        };
+    }
     const VkDeviceCreateInfo deviceCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-            .pNext = nullptr,
-            .queueCreateInfoCount = 1,
-            .pQueueCreateInfos = &queueCreateInfo,
+            .pNext = enabledFeaturesChain,
+            .queueCreateInfoCount = queueCreateInfoCount,
+            .pQueueCreateInfos = queueCreateInfos,
             .enabledLayerCount = 0,
             .ppEnabledLayerNames = nullptr,
             .enabledExtensionCount = static_cast<uint32_t>(enabledDeviceExtensions.size()),
             .ppEnabledExtensionNames = enabledDeviceExtensions.data(),
-            .pEnabledFeatures = nullptr,
+            .pEnabledFeatures = &enabledFeatures,
     };
     ASSERT(mVk.CreateDevice(mGpu, &deviceCreateInfo, nullptr, &mDevice) == VK_SUCCESS);
-    mVk.initializeDeviceApi(mDevice);
+    // Only the entry points of the enabled extensions get resolved
+    mVk.initializeDeviceApi(mDevice, std::min(kApiVersion, mGpuProperties.apiVersion),
+                            {
+                                    .displayTiming = mDisplayTimingEnabled,
+                                    .timelineSemaphore = mTimelineSemaphoreEnabled,
+                            });
 
     mVk.GetDeviceQueue(mDevice, mQueueFamilyIndex, 0, &mQueue);
+    mVk.GetDeviceQueue(mDevice, mTransferQueueFamilyIndex, 0, &mTransferQueue);
+    mVk.GetDeviceQueue(mDevice, mComputeQueueFamilyIndex, 0, &mComputeQueue);
 
     ALOGD("Successfully created device");
 }
@@ -361,6 +998,7 @@ void Renderer::createSurface(ANativeWindow* window) {
             .window = window,
     };
     ASSERT(mVk.CreateAndroidSurfaceKHR(mInstance, &surfaceInfo, nullptr, &mSurface) == VK_SUCCESS);
+    mWindow = window;
 
     VkBool32 surfaceSupported = VK_FALSE;
     ASSERT(mVk.GetPhysicalDeviceSurfaceSupportKHR(mGpu, mQueueFamilyIndex, mSurface,
@@ -395,21 +1033,49 @@ void Renderer::createSwapchain(VkSwapchainKHR oldSwapchain) {
           surfaceCapabilities.currentExtent.height);
     ALOGD("Current transform: 0x%x\n", surfaceCapabilities.currentTransform);
 
-    mSurfaceWidth = mImageWidth = surfaceCapabilities.currentExtent.width;
-    mSurfaceHeight = mImageHeight = surfaceCapabilities.currentExtent.height;
+    mSurfaceWidth = surfaceCapabilities.currentExtent.width;
+    mSurfaceHeight = surfaceCapabilities.currentExtent.height;
     mPreTransform = surfaceCapabilities.currentTransform;
 
+    // Android scales a swapchain of any extent within the limits to the window
+    const VkExtent2D& minExtent = surfaceCapabilities.minImageExtent;
+    const VkExtent2D& maxExtent = surfaceCapabilities.maxImageExtent;
+    mImageWidth = std::clamp((uint32_t)std::lround(mSurfaceWidth * mRenderScale),
+                             minExtent.width, std::max(maxExtent.width, minExtent.width));
+    mImageHeight = std::clamp((uint32_t)std::lround(mSurfaceHeight * mRenderScale),
+                              minExtent.height, std::max(maxExtent.height, minExtent.height));
+
     if (mPreTransform == VK_SURFACE_TRANSFORM_ROTATE_90_BIT_KHR ||
         mPreTransform == VK_SURFACE_TRANSFORM_ROTATE_270_BIT_KHR) {
         std::swap(mImageWidth, mImageHeight);
     }
 
+    // A maxImageCount of 0 means there is no upper limit
+    const LatencyConfig& latencyConfig = getLatencyConfig(mLatencyMode);
+    mPresentMode = choosePresentMode();
+    uint32_t reqImageCount = latencyConfig.imageCount;
+    if (mPresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+        // Mailbox needs a spare image to replace the queued one without blocking
+        reqImageCount = std::max(reqImageCount, 3U);
+    }
+    reqImageCount = std::max(reqImageCount, surfaceCapabilities.minImageCount);
+    if (surfaceCapabilities.maxImageCount) {
+        reqImageCount = std::min(reqImageCount, surfaceCapabilities.maxImageCount);
+    }
+    ALOGD("Requested image count = %u, present mode = %u", reqImageCount, mPresentMode);
+
+    // The post stage writes the images on the compute queue and the present is on the graphics
+    // queue, concurrent sharing saves ownership transfers between the two
+    ASSERT(!mComputePost || (surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT));
+    const VkImageUsageFlags imageUsage =
+            mComputePost ? VK_IMAGE_USAGE_STORAGE_BIT : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    const uint32_t queueFamilyIndices[2] = {mQueueFamilyIndex, mComputeQueueFamilyIndex};
     const VkSwapchainCreateInfoKHR swapchainCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
             .pNext = nullptr,
             .flags = 0,
             .surface = mSurface,
-            .minImageCount = kReqImageCount,
+            .minImageCount = reqImageCount,
             .imageFormat = mFormat,
             .imageColorSpace = mColorSpace,
             .imageExtent =
@@ -418,13 +1084,13 @@ void Renderer::createSwapchain(VkSwapchainKHR oldSwapchain) {
                             .height = mImageHeight,
                     },
             .imageArrayLayers = 1,
-            .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-            .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
-            .queueFamilyIndexCount = 1,
-            .pQueueFamilyIndices = &mQueueFamilyIndex,
+            .imageUsage = imageUsage,
+            .imageSharingMode = mAsyncPost ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = mAsyncPost ? 2U : 1U,
+            .pQueueFamilyIndices = queueFamilyIndices,
             .preTransform = mPreTransform,
             .compositeAlpha = VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR,
-            .presentMode = VK_PRESENT_MODE_FIFO_KHR,
+            .presentMode = mPresentMode,
             .clipped = VK_FALSE,
             .oldSwapchain = oldSwapchain,
     };
@@ -434,6 +1100,9 @@ void Renderer::createSwapchain(VkSwapchainKHR oldSwapchain) {
     uint32_t imageCount = 0;
     ASSERT(mVk.GetSwapchainImagesKHR(mDevice, mSwapchain, &imageCount, nullptr) == VK_SUCCESS);
     ALOGD("Swapchain image count = %u", imageCount);
+    mSpareImageCount = imageCount - std::min(imageCount, surfaceCapabilities.minImageCount);
+    mSwapchainSerial++;
+    mSwapchainOutdated = false;
 
     mImages.resize(imageCount, VK_NULL_HANDLE);
     ASSERT(mVk.GetSwapchainImagesKHR(mDevice, mSwapchain, &imageCount, mImages.data()) ==
@@ -441,442 +1110,513 @@ void Renderer::createSwapchain(VkSwapchainKHR oldSwapchain) {
 
     mImageViews.resize(imageCount, VK_NULL_HANDLE);
     mFramebuffers.resize(imageCount, VK_NULL_HANDLE);
+    createAttachmentImages();
 
-    ALOGD("Successfully created swapchain");
-}
+    // Reused command buffers bake in the framebuffers, extent and preTransform
+    markCommandBuffersDirty();
 
-static std::vector<char> readFileFromAsset(AAssetManager* assetManager, const char* filePath,
-                                           int mode) {
-    ASSERT(filePath);
+    if (mDisplayTimingEnabled) {
+        VkRefreshCycleDurationGOOGLE refreshCycleDuration;
+        if (mVk.GetRefreshCycleDurationGOOGLE(mDevice, mSwapchain, &refreshCycleDuration) ==
+            VK_SUCCESS) {
+            mRefreshDurationNanos = (int64_t)refreshCycleDuration.refreshDuration;
+            ALOGD("Refresh cycle duration = %lld ns", (long long)mRefreshDurationNanos);
+        }
+    }
 
-    AAsset* file = AAssetManager_open(assetManager, filePath, mode);
-    ASSERT(file);
+    ALOGD("Successfully created swapchain");
+}
 
-    auto fileLength = (size_t)AAsset_getLength(file);
-    std::vector<char> fileContent(fileLength);
-    AAsset_read(file, fileContent.data(), fileLength);
-    AAsset_close(file);
+void Renderer::destroySwapchains() {
+    destroyRetiredSwapchains(true);
 
-    return fileContent;
+    destroyOffscreenTarget(&mOffscreenTarget);
+    destroyAttachmentImage(&mColorAttachment);
+    destroyAttachmentImage(&mDepthAttachment);
+    for (auto& imageView : mImageViews) {
+        mVk.DestroyImageView(mDevice, imageView, nullptr);
+    }
+    mImageViews.clear();
+    for (auto& framebuffer : mFramebuffers) {
+        mVk.DestroyFramebuffer(mDevice, framebuffer, nullptr);
+    }
+    mFramebuffers.clear();
+    mImages.clear();
+    mVk.DestroySwapchainKHR(mDevice, mSwapchain, nullptr);
+    mSwapchain = VK_NULL_HANDLE;
 }
 
-uint32_t Renderer::getMemoryTypeIndex(uint32_t typeBits, VkFlags mask) {
-    VkPhysicalDeviceMemoryProperties memoryProperties;
-    mVk.GetPhysicalDeviceMemoryProperties(mGpu, &memoryProperties);
-
-    for (uint32_t typeIndex = 0; typeIndex < std::numeric_limits<uint32_t>::digits; typeIndex++) {
-        if ((typeBits & 1U) == 1 &&
-            (memoryProperties.memoryTypes[typeIndex].propertyFlags & mask) == mask) {
-            return typeIndex;
+VkPresentModeKHR Renderer::choosePresentMode() {
+    uint32_t presentModeCount = 0;
+    ASSERT(mVk.GetPhysicalDeviceSurfacePresentModesKHR(mGpu, mSurface, &presentModeCount,
+                                                       nullptr) == VK_SUCCESS);
+    std::vector<VkPresentModeKHR> presentModes(presentModeCount);
+    ASSERT(mVk.GetPhysicalDeviceSurfacePresentModesKHR(mGpu, mSurface, &presentModeCount,
+                                                       presentModes.data()) == VK_SUCCESS);
+
+    const LatencyConfig& latencyConfig = getLatencyConfig(mLatencyMode);
+    for (uint32_t i = 0; i < latencyConfig.presentModeCount; i++) {
+        if (std::find(presentModes.cbegin(), presentModes.cend(), latencyConfig.presentModes[i]) !=
+            presentModes.cend()) {
+            return latencyConfig.presentModes[i];
         }
-        typeBits >>= 1U;
     }
-    ASSERT(false);
+    return VK_PRESENT_MODE_FIFO_KHR;
 }
 
-void Renderer::setImageLayout(VkCommandBuffer commandBuffer, VkImage image,
-                              VkImageLayout oldImageLayout, VkImageLayout newImageLayout,
-                              VkPipelineStageFlags srcStageMask,
-                              VkPipelineStageFlags dstStageMask) {
-    VkImageMemoryBarrier imageMemoryBarrier = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .pNext = nullptr,
-            .srcAccessMask = 0,
-            .dstAccessMask = 0,
-            .oldLayout = oldImageLayout,
-            .newLayout = newImageLayout,
-            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-            .image = image,
-            .subresourceRange =
-                    {
-                            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                            .baseMipLevel = 0,
-                            .levelCount = 1,
-                            .baseArrayLayer = 0,
-                            .layerCount = 1,
-                    },
+void Renderer::recreateSwapchain() {
+    waitFramebuffers();
+
+    // The frames in flight may still render to the current swapchain, the last of them has been
+    // submitted already.
+    const VkSwapchainKHR oldSwapchain = mSwapchain;
+    mRetiredSwapchains.push_back({
+            .swapchain = mSwapchain,
+            .imageViews = std::move(mImageViews),
+            .framebuffers = std::move(mFramebuffers),
+            .offscreenTarget = mOffscreenTarget,
+            .colorAttachment = mColorAttachment,
+            .depthAttachment = mDepthAttachment,
+            .retireSerial = mSubmittedSerial,
+    });
+    mSwapchain = VK_NULL_HANDLE;
+    mOffscreenTarget = OffscreenTarget();
+    mColorAttachment = AttachmentImage();
+    mDepthAttachment = AttachmentImage();
+    mImages.clear();
+    mImageViews.clear();
+    mFramebuffers.clear();
+
+    // Recreate the new swapchain with the latest preTransform. Numbers of swapchain images,
+    // image views and framebuffers are also allowed to change. Even the aspect ratio of the
+    // swapchain can change, which requires us to use dynamic viewport and scissor
+    createSwapchain(oldSwapchain);
+    createFramebuffersAsync();
+    if (mOffscreenRendering) {
+        createOffscreenTarget();
+    }
+    updateTransform();
+}
+
+void Renderer::updateTransform() {
+    // Fit the texture into the surface, keeping its aspect ratio
+    const float scaleW = mSurfaceWidth / (float)mTextures[0].width;
+    const float scaleH = mSurfaceHeight / (float)mTextures[0].height;
+    const float minimalScale = scaleW < scaleH ? scaleW : scaleH;
+    mScale[0] = minimalScale / scaleW;
+    mScale[1] = minimalScale / scaleH;
+
+    // mvp = preRotate * scale, only the upper left 2x2 block is not the identity
+    mPreRotation = getQuarterTurns(mPreTransform);
+    const float* preRotate = kPreRotations[mPreRotation];
+    const float mvp[16] = {
+            preRotate[0] * mScale[0], preRotate[1] * mScale[0], 0.0F, 0.0F,
+            preRotate[2] * mScale[1], preRotate[3] * mScale[1], 0.0F, 0.0F,
+            0.0F,                     0.0F,                     1.0F, 0.0F,
+            0.0F,                     0.0F,                     0.0F, 1.0F,
     };
+    memcpy(mMvp, mvp, sizeof(mvp));
 
-    switch (oldImageLayout) {
-        case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
-            imageMemoryBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-            break;
+    // The transform is written every frame, but reused command buffers have the pipeline variant
+    // baked in
+    markCommandBuffersDirty();
+}
 
-        case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-            imageMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            break;
+void Renderer::createTextures() {
+    createSamplers();
+    mStreamer.initialize(&mVk, mGpu, mDevice, &mAllocator, mAssetManager, mTransferQueue,
+                         mTransferQueueFamilyIndex, mQueue, mQueueFamilyIndex, &mQueueLock,
+                         mTimelineSemaphoreEnabled);
+
+    // Sampled by the first frames while the real textures are decoded and uploaded
+    const uint8_t placeholderPixel[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+    const TextureStreamer::StreamedTexture placeholder =
+            mStreamer.uploadPixels(placeholderPixel, 1, 1);
+    mPlaceholderTexture.image = placeholder.image;
+    mPlaceholderTexture.memory = placeholder.memory;
+    mPlaceholderTexture.view = placeholder.view;
+    mPlaceholderTexture.width = placeholder.width;
+    mPlaceholderTexture.height = placeholder.height;
+    mPlaceholderTexture.levelCount = placeholder.levelCount;
+    mPlaceholderTexture.samplerMode = SamplerMode::NEAREST;
+
+#ifdef VKDEMO_UPLOAD_BENCHMARK
+    // Large enough for the fixed cost of a submit to no longer hide the copy throughput
+    mStreamer.benchmarkUpload(1024, 1024, 8);
+    mStreamer.benchmarkUpload(2048, 2048, 8);
+#endif
+
+    // A checkerboard of 8x8 texel squares, uploaded right away instead of being streamed
+    std::vector<uint8_t> syntheticPixels;
+    if (mSyntheticTextureSize) {
+        syntheticPixels.resize((size_t)mSyntheticTextureSize * mSyntheticTextureSize * 4);
+        for (uint32_t y = 0; y < mSyntheticTextureSize; y++) {
+            for (uint32_t x = 0; x < mSyntheticTextureSize; x++) {
+                const uint8_t value = ((x ^ y) & 8) ? 0xFF : 0x40;
+                uint8_t* texel = &syntheticPixels[((size_t)y * mSyntheticTextureSize + x) * 4];
+                texel[0] = value;
+                texel[1] = value;
+                texel[2] = value;
+                texel[3] = 0xFF;
+            }
+        }
+    }
 
-        case VK_IMAGE_LAYOUT_PREINITIALIZED:
-            imageMemoryBarrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-            break;
+    mTextures.resize(mTextureCount);
+    mResidentTextureBytes = 0;
+    mQueriedTextureBudget = UINT64_MAX;
+    mTextureCacheHits = 0;
+    mTextureCacheMisses = 0;
+    mTextureEvictions = 0;
+    for (uint32_t i = 0; i < mTextures.size(); i++) {
+        if (mSyntheticTextureSize) {
+            const TextureStreamer::StreamedTexture synthetic = mStreamer.uploadPixels(
+                    syntheticPixels.data(), mSyntheticTextureSize, mSyntheticTextureSize);
+            mTextures[i].image = synthetic.image;
+            mTextures[i].memory = synthetic.memory;
+            mTextures[i].view = synthetic.view;
+            mTextures[i].width = synthetic.width;
+            mTextures[i].height = synthetic.height;
+            mTextures[i].levelCount = synthetic.levelCount;
+            mResidentTextureBytes += synthetic.memory.size;
+        } else {
+            // The size comes from the image header, so the mvp is already final with the
+            // placeholder. The mip tail is small enough to usually arrive first.
+            Texture& texture = mTextures[i];
+            mStreamer.requestFromAsset(i, getTextureFile(i), 0, &texture.width, &texture.height);
+            texture.isRequested = true;
+            if (std::max(texture.width, texture.height) > kResidentMipSize) {
+                mStreamer.requestFromAsset(i, getTextureFile(i), kResidentMipSize, &texture.width,
+                                           &texture.height);
+            }
+        }
 
-        default:
-            break;
+        mTextures[i].samplerMode = mDefaultSamplerMode;
     }
 
-    switch (newImageLayout) {
-        case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-            imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            break;
+    // The mvp is derived from the texture size
+    updateTransform();
 
-        case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
-            imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-            break;
+    ALOGD("Successfully created textures");
+}
 
-        case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
-            imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-            break;
+void Renderer::createSamplers() {
+    for (uint32_t i = 0; i < kSamplerModeCount; i++) {
+        const SamplerMode mode = static_cast<SamplerMode>(i);
+        const VkFilter filter = mode == SamplerMode::NEAREST ? VK_FILTER_NEAREST : VK_FILTER_LINEAR;
+        // Modes without mipmapping only ever sample the base level
+        const bool isMipmapped = mode == SamplerMode::TRILINEAR || mode == SamplerMode::ANISOTROPIC;
+        const bool isAnisotropic = mode == SamplerMode::ANISOTROPIC && mMaxAnisotropy > 1.0F;
+        const VkSamplerCreateInfo samplerCreateInfo = {
+                .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = 0,
+                .magFilter = filter,
+                .minFilter = filter,
+                .mipmapMode = isMipmapped ? VK_SAMPLER_MIPMAP_MODE_LINEAR
+                                          : VK_SAMPLER_MIPMAP_MODE_NEAREST,
+                .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+                .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+                .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+                .mipLodBias = 0.0F,
+                .anisotropyEnable = isAnisotropic ? VK_TRUE : VK_FALSE,
+                .maxAnisotropy = isAnisotropic ? mMaxAnisotropy : 1.0F,
+                .compareEnable = VK_FALSE,
+                .compareOp = VK_COMPARE_OP_NEVER,
+                .minLod = 0.0F,
+                .maxLod = isMipmapped ? VK_LOD_CLAMP_NONE : 0.0F,
+                .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+                .unnormalizedCoordinates = VK_FALSE,
+        };
+        ASSERT(mVk.CreateSampler(mDevice, &samplerCreateInfo, nullptr, &mSamplers[i]) ==
+               VK_SUCCESS);
+    }
+}
 
-        case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
-            imageMemoryBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-            break;
+void Renderer::updateStreamedTextures() {
+    mStreamer.update();
+
+    uint32_t id;
+    TextureStreamer::StreamedTexture streamed;
+    while (mStreamer.popReadyTexture(&id, &streamed)) {
+        ASSERT(id < mTextures.size());
+        Texture& texture = mTextures[id];
+        mResidentTextureBytes += streamed.memory.size;
+        std::fill(mDescriptorSetsDirty.begin(), mDescriptorSetsDirty.end(), true);
+        if (streamed.baseLevel) {
+            ASSERT(texture.lowResView == VK_NULL_HANDLE);
+            texture.lowResImage = streamed.image;
+            texture.lowResMemory = streamed.memory;
+            texture.lowResView = streamed.view;
+            ALOGD("Streamed in the mip tail of %s from level %u", getTextureFile(id),
+                  streamed.baseLevel);
+            continue;
+        }
+        ASSERT(texture.width == streamed.width && texture.height == streamed.height);
+        ASSERT(texture.view == VK_NULL_HANDLE);
+        texture.image = streamed.image;
+        texture.memory = streamed.memory;
+        texture.view = streamed.view;
+        texture.levelCount = streamed.levelCount;
+        texture.isRequested = false;
+        ALOGD("Streamed in %s", getTextureFile(id));
+    }
+}
 
-        case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL:
-            imageMemoryBarrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-            break;
+void Renderer::updateTextureResidency(const SceneFrame& scene) {
+    destroyRetiredTextures(false);
 
-        default:
-            break;
+    // The serial this frame's submit will signal, the scene is recorded before it is handed over
+    const uint64_t useSerial = mSubmittedSerial + 1;
+    for (const auto& quad : scene.quads) {
+        // Indices past the textures sample the placeholder
+        if (quad.textureIndex >= mTextures.size()) {
+            continue;
+        }
+        Texture& texture = mTextures[quad.textureIndex];
+        if (texture.lastUseSerial == useSerial) {
+            continue;
+        }
+        texture.lastUseSerial = useSerial;
+        if (texture.view != VK_NULL_HANDLE) {
+            mTextureCacheHits++;
+            continue;
+        }
+        mTextureCacheMisses++;
+        if (!texture.isRequested) {
+            mStreamer.requestFromAsset(quad.textureIndex, getTextureFile(quad.textureIndex), 0,
+                                       &texture.width, &texture.height);
+            texture.isRequested = true;
+            ALOGD("Streaming %s in again", getTextureFile(quad.textureIndex));
+        }
     }
 
-    mVk.CmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 0, nullptr, 0, nullptr, 1,
-                           &imageMemoryBarrier);
+    // Whatever the rest of the app and the system use of the heap is not the textures' to take
+    if (mMemoryBudgetEnabled && mFrameCount % kMemoryBudgetQueryInterval == 0) {
+        const MemoryAllocator::HeapBudget heapBudget = mAllocator.getDeviceLocalBudget();
+        const VkDeviceSize otherBytes =
+                heapBudget.usageBytes - std::min(heapBudget.usageBytes, mResidentTextureBytes);
+        const VkDeviceSize shareBytes =
+                (VkDeviceSize)((double)heapBudget.budgetBytes * kTextureBudgetShare);
+        mQueriedTextureBudget = shareBytes - std::min(shareBytes, otherBytes);
+    }
+    const VkDeviceSize budget = mTextureBudget ? mTextureBudget : mQueriedTextureBudget;
 
-    ALOGD("Successfully transferred image layout from %u to %u", oldImageLayout, newImageLayout);
-}
-
-void Renderer::loadTextureFromFile(const char* filePath, Texture* outTexture) {
-    std::vector<char> file = readFileFromAsset(mAssetManager, filePath, AASSET_MODE_BUFFER);
-    ASSERT(!file.empty());
-
-    VkFormatProperties formatProperties;
-    mVk.GetPhysicalDeviceFormatProperties(mGpu, VK_FORMAT_R8G8B8A8_UNORM, &formatProperties);
-    ASSERT(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
-
-    uint32_t imageWidth = 0;
-    uint32_t imageHeight = 0;
-    uint32_t channel = 0;
-    uint8_t* imageData =
-            stbi_load_from_memory((const stbi_uc*)file.data(), file.size(),
-                                  reinterpret_cast<int*>(&imageWidth),
-                                  reinterpret_cast<int*>(&imageHeight),
-                                  reinterpret_cast<int*>(&channel), 4 /*desired_channels*/);
-    ASSERT(imageData);
-    ASSERT(imageWidth);
-    ASSERT(imageHeight);
-    ASSERT(channel == 4);
-
-    // Create a stageImage and stageMemory for the original texture uploading
-    VkImage stageImage = VK_NULL_HANDLE;
-    VkDeviceMemory stageMemory = VK_NULL_HANDLE;
-    VkImageCreateInfo imageCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-            .pNext = nullptr,
-            .flags = 0,
-            .imageType = VK_IMAGE_TYPE_2D,
-            .format = VK_FORMAT_R8G8B8A8_UNORM,
-            .extent =
-                    {
-                            .width = imageWidth,
-                            .height = imageHeight,
-                            .depth = 1,
-                    },
-            .mipLevels = 1,
-            .arrayLayers = 1,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
-            .tiling = VK_IMAGE_TILING_LINEAR,
-            .usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-            .queueFamilyIndexCount = 1,
-            .pQueueFamilyIndices = &mQueueFamilyIndex,
-            .initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED,
-    };
-    ASSERT(mVk.CreateImage(mDevice, &imageCreateInfo, nullptr, &stageImage) == VK_SUCCESS);
-
-    VkMemoryRequirements memoryRequirements;
-    mVk.GetImageMemoryRequirements(mDevice, stageImage, &memoryRequirements);
-
-    const uint32_t typeIndex = getMemoryTypeIndex(memoryRequirements.memoryTypeBits,
-                                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-    VkMemoryAllocateInfo memoryAllocateInfo = {
-            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-            .pNext = nullptr,
-            .allocationSize = memoryRequirements.size,
-            .memoryTypeIndex = typeIndex,
-    };
-    ASSERT(mVk.AllocateMemory(mDevice, &memoryAllocateInfo, nullptr, &stageMemory) == VK_SUCCESS);
-    ASSERT(mVk.BindImageMemory(mDevice, stageImage, stageMemory, 0) == VK_SUCCESS);
-
-    const VkImageSubresource imageSubresource = {
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .mipLevel = 0,
-            .arrayLayer = 0,
-    };
-    VkSubresourceLayout subresourceLayout;
-    mVk.GetImageSubresourceLayout(mDevice, stageImage, &imageSubresource, &subresourceLayout);
-
-    void* textureData;
-    ASSERT(mVk.MapMemory(mDevice, stageMemory, 0, memoryAllocateInfo.allocationSize, 0,
-                         &textureData) == VK_SUCCESS);
-
-    for (uint32_t row = 0, srcPos = 0, cols = 4 * imageWidth; row < imageHeight; row++) {
-        for (uint32_t col = 0; col < cols; col++) {
-            ((uint8_t*)textureData)[col] = imageData[srcPos++];
+    // Only textures with a resident mip tail are evicted, and never one this frame samples, so
+    // the scene doesn't fall back to the placeholder or thrash. The table is small enough for a
+    // linear search of the least recently used one.
+    while (mResidentTextureBytes > budget) {
+        Texture* leastRecentlyUsed = nullptr;
+        for (auto& texture : mTextures) {
+            if (texture.view != VK_NULL_HANDLE && texture.lowResView != VK_NULL_HANDLE &&
+                texture.lastUseSerial != useSerial &&
+                (!leastRecentlyUsed || texture.lastUseSerial < leastRecentlyUsed->lastUseSerial)) {
+                leastRecentlyUsed = &texture;
+            }
         }
-        textureData = (uint8_t*)textureData + subresourceLayout.rowPitch;
+        if (!leastRecentlyUsed) {
+            break;
+        }
+        evictTexture(leastRecentlyUsed);
     }
-
-    mVk.UnmapMemory(mDevice, stageMemory);
-    stbi_image_free(imageData);
-    file.clear();
-
-    // Create a tile texture to blit into
-    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    ASSERT(mVk.CreateImage(mDevice, &imageCreateInfo, nullptr, &outTexture->image) == VK_SUCCESS);
-
-    mVk.GetImageMemoryRequirements(mDevice, outTexture->image, &memoryRequirements);
-
-    memoryAllocateInfo.allocationSize = memoryRequirements.size;
-    memoryAllocateInfo.memoryTypeIndex = getMemoryTypeIndex(memoryRequirements.memoryTypeBits,
-                                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    ASSERT(mVk.AllocateMemory(mDevice, &memoryAllocateInfo, nullptr, &outTexture->memory) ==
-           VK_SUCCESS);
-    ASSERT(mVk.BindImageMemory(mDevice, outTexture->image, outTexture->memory, 0) == VK_SUCCESS);
-
-    VkCommandPoolCreateInfo commandPoolCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-            .pNext = nullptr,
-            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-            .queueFamilyIndex = mQueueFamilyIndex,
-    };
-    VkCommandPool commandPool;
-    ASSERT(mVk.CreateCommandPool(mDevice, &commandPoolCreateInfo, nullptr, &commandPool) ==
-           VK_SUCCESS);
-
-    VkCommandBuffer commandBuffer;
-    const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .pNext = nullptr,
-            .commandPool = commandPool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1,
-    };
-
-    ASSERT(mVk.AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo, &commandBuffer) ==
-           VK_SUCCESS);
-    VkCommandBufferBeginInfo commandBufferBeginInfo = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .pNext = nullptr,
-            .flags = 0,
-            .pInheritanceInfo = nullptr,
-    };
-    ASSERT(mVk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo) == VK_SUCCESS);
-
-    setImageLayout(commandBuffer, stageImage, VK_IMAGE_LAYOUT_PREINITIALIZED,
-                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_HOST_BIT,
-                   VK_PIPELINE_STAGE_TRANSFER_BIT);
-
-    // Transitions image out of UNDEFINED type
-    setImageLayout(commandBuffer, outTexture->image, VK_IMAGE_LAYOUT_UNDEFINED,
-                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_HOST_BIT,
-                   VK_PIPELINE_STAGE_TRANSFER_BIT);
-
-    const VkImageCopy blitInfo = {
-            .srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .srcSubresource.mipLevel = 0,
-            .srcSubresource.baseArrayLayer = 0,
-            .srcSubresource.layerCount = 1,
-            .srcOffset.x = 0,
-            .srcOffset.y = 0,
-            .srcOffset.z = 0,
-            .dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .dstSubresource.mipLevel = 0,
-            .dstSubresource.baseArrayLayer = 0,
-            .dstSubresource.layerCount = 1,
-            .dstOffset.x = 0,
-            .dstOffset.y = 0,
-            .dstOffset.z = 0,
-            .extent.width = imageWidth,
-            .extent.height = imageHeight,
-            .extent.depth = 1,
-    };
-    mVk.CmdCopyImage(commandBuffer, stageImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                     outTexture->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blitInfo);
-
-    setImageLayout(commandBuffer, outTexture->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                   VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
-
-    ASSERT(mVk.EndCommandBuffer(commandBuffer) == VK_SUCCESS);
-
-    const VkFenceCreateInfo fenceCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            .pNext = nullptr,
-            .flags = 0,
-    };
-    VkFence fence;
-    ASSERT(mVk.CreateFence(mDevice, &fenceCreateInfo, nullptr, &fence) == VK_SUCCESS);
-
-    const VkSubmitInfo submitInfo = {
-            .pNext = nullptr,
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .waitSemaphoreCount = 0,
-            .pWaitSemaphores = nullptr,
-            .pWaitDstStageMask = nullptr,
-            .commandBufferCount = 1,
-            .pCommandBuffers = &commandBuffer,
-            .signalSemaphoreCount = 0,
-            .pSignalSemaphores = nullptr,
-    };
-    ASSERT(mVk.QueueSubmit(mQueue, 1, &submitInfo, fence) == VK_SUCCESS);
-    ASSERT(mVk.WaitForFences(mDevice, 1, &fence, VK_TRUE, kTimeout30Sec) == VK_SUCCESS);
-    mVk.DestroyFence(mDevice, fence, nullptr);
-
-    mVk.FreeCommandBuffers(mDevice, commandPool, 1, &commandBuffer);
-    mVk.DestroyCommandPool(mDevice, commandPool, nullptr);
-    mVk.DestroyImage(mDevice, stageImage, nullptr);
-    mVk.FreeMemory(mDevice, stageMemory, nullptr);
-
-    // Record the image's original dimensions so we can respect it later
-    outTexture->width = imageWidth;
-    outTexture->height = imageHeight;
-
-    ALOGD("Successfully loaded texture from %s", filePath);
 }
 
-void Renderer::createTextures() {
-    mTextures.resize(kTextureCount);
-    for (uint32_t i = 0; i < kTextureCount; i++) {
-        loadTextureFromFile(kTextureFiles[i], &mTextures[i]);
-
-        const VkSamplerCreateInfo samplerCreateInfo = {
-                .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-                .pNext = nullptr,
-                .flags = 0,
-                .magFilter = VK_FILTER_NEAREST,
-                .minFilter = VK_FILTER_NEAREST,
-                .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
-                .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-                .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-                .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-                .mipLodBias = 0.0F,
-                .anisotropyEnable = VK_FALSE,
-                .maxAnisotropy = 1,
-                .compareEnable = VK_FALSE,
-                .compareOp = VK_COMPARE_OP_NEVER,
-                .minLod = 0.0F,
-                .maxLod = 0.0F,
-                .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
-                .unnormalizedCoordinates = VK_FALSE,
-        };
-        ASSERT(mVk.CreateSampler(mDevice, &samplerCreateInfo, nullptr, &mTextures[i].sampler) ==
-               VK_SUCCESS);
+void Renderer::evictTexture(Texture* texture) {
+    // Every frame handed over so far may sample it through its descriptor set, the later ones
+    // get their set updated without it first
+    mRetiredTextures.push_back({
+            .image = texture->image,
+            .memory = texture->memory,
+            .view = texture->view,
+            .retireSerial = mSubmittedSerial,
+    });
+    mResidentTextureBytes -= texture->memory.size;
+    texture->image = VK_NULL_HANDLE;
+    texture->memory = {};
+    texture->view = VK_NULL_HANDLE;
+    std::fill(mDescriptorSetsDirty.begin(), mDescriptorSetsDirty.end(), true);
+    mTextureEvictions++;
+    ALOGD("Evicted %s, %.2f MB of textures resident",
+          getTextureFile((uint32_t)(texture - mTextures.data())),
+          mResidentTextureBytes / (1024.0 * 1024.0));
+}
 
-        const VkImageViewCreateInfo viewCreateInfo = {
-                .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-                .pNext = nullptr,
-                .flags = 0,
-                .image = mTextures[i].image,
-                .viewType = VK_IMAGE_VIEW_TYPE_2D,
-                .format = VK_FORMAT_R8G8B8A8_UNORM,
-                .components =
-                        {
-                                VK_COMPONENT_SWIZZLE_R,
-                                VK_COMPONENT_SWIZZLE_G,
-                                VK_COMPONENT_SWIZZLE_B,
-                                VK_COMPONENT_SWIZZLE_A,
-                        },
-                .subresourceRange =
-                        {
-                                VK_IMAGE_ASPECT_COLOR_BIT,
-                                0,
-                                1,
-                                0,
-                                1,
-                        },
-        };
-        ASSERT(mVk.CreateImageView(mDevice, &viewCreateInfo, nullptr, &mTextures[i].view) ==
-               VK_SUCCESS);
+void Renderer::destroyRetiredTextures(bool deviceIdle) {
+    while (!mRetiredTextures.empty() &&
+           (deviceIdle || isFrameSerialComplete(mRetiredTextures.front().retireSerial))) {
+        RetiredTexture& retired = mRetiredTextures.front();
+        mVk.DestroyImageView(mDevice, retired.view, nullptr);
+        mVk.DestroyImage(mDevice, retired.image, nullptr);
+        mAllocator.free(&retired.memory);
+        mRetiredTextures.pop_front();
     }
-
-    ALOGD("Successfully created textures");
 }
 
 void Renderer::createDescriptorSet() {
+    ASSERT(mTextures.size() <= mTextureTableSize * mTextureSetCount);
+
     const VkDescriptorSetLayoutBinding descriptorSetLayoutBinding = {
             .binding = 0,
             .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .descriptorCount = kTextureCount,
+            .descriptorCount = mTextureTableSize,
             .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
             .pImmutableSamplers = nullptr,
     };
+    // Entries past the registered textures are never sampled, so they are left unwritten
+    const VkDescriptorBindingFlagsEXT bindingFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+    const VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT,
+            .pNext = nullptr,
+            .bindingCount = 1,
+            .pBindingFlags = &bindingFlags,
+    };
     const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-            .pNext = nullptr,
+            .pNext = mDescriptorIndexingEnabled ? &bindingFlagsCreateInfo : nullptr,
             .bindingCount = 1,
             .pBindings = &descriptorSetLayoutBinding,
     };
     ASSERT(mVk.CreateDescriptorSetLayout(mDevice, &descriptorSetLayoutCreateInfo, nullptr,
                                          &mDescriptorSetLayout) == VK_SUCCESS);
 
-    const VkDescriptorPoolSize descriptorPoolSize = {
-            .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .descriptorCount = kTextureCount,
+    // The scene uniforms of every frame live in the upload ring, so a single set with a dynamic
+    // offset covers them all
+    const VkDescriptorSetLayoutBinding sceneUniformBinding = {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+            .pImmutableSamplers = nullptr,
+    };
+    const VkDescriptorSetLayoutCreateInfo sceneUniformSetLayoutCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .bindingCount = 1,
+            .pBindings = &sceneUniformBinding,
+    };
+    ASSERT(mVk.CreateDescriptorSetLayout(mDevice, &sceneUniformSetLayoutCreateInfo, nullptr,
+                                         &mSceneUniformSetLayout) == VK_SUCCESS);
+
+    const VkDescriptorPoolSize descriptorPoolSizes[2] = {
+            {
+                    .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                    .descriptorCount = mTextureTableSize * mTextureSetCount * kMaxInflight,
+            },
+            {
+                    .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                    .descriptorCount = 1,
+            },
     };
     const VkDescriptorPoolCreateInfo descriptor_pool = {
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
             .pNext = nullptr,
             .flags = 0,
-            .maxSets = 1,
-            .poolSizeCount = 1,
-            .pPoolSizes = &descriptorPoolSize,
+            .maxSets = mTextureSetCount * kMaxInflight + 1,
+            .poolSizeCount = 2,
+            .pPoolSizes = descriptorPoolSizes,
     };
 
     ASSERT(mVk.CreateDescriptorPool(mDevice, &descriptor_pool, nullptr, &mDescriptorPool) ==
            VK_SUCCESS);
 
+    // mTextureSetCount consecutive sets per frame
+    const uint32_t setCount = mTextureSetCount * kMaxInflight;
+    const std::vector<VkDescriptorSetLayout> setLayouts(setCount, mDescriptorSetLayout);
     VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
             .pNext = nullptr,
             .descriptorPool = mDescriptorPool,
-            .descriptorSetCount = 1,
-            .pSetLayouts = &mDescriptorSetLayout,
+            .descriptorSetCount = setCount,
+            .pSetLayouts = setLayouts.data(),
     };
-    ASSERT(mVk.AllocateDescriptorSets(mDevice, &descriptorSetAllocateInfo, &mDescriptorSet) ==
-           VK_SUCCESS);
+    mDescriptorSets.resize(setCount);
+    ASSERT(mVk.AllocateDescriptorSets(mDevice, &descriptorSetAllocateInfo,
+                                      mDescriptorSets.data()) == VK_SUCCESS);
 
-    VkDescriptorImageInfo descriptorImageInfo[kTextureCount];
-    for (uint32_t i = 0; i < kTextureCount; i++) {
-        descriptorImageInfo[i].sampler = mTextures[i].sampler;
-        descriptorImageInfo[i].imageView = mTextures[i].view;
-        descriptorImageInfo[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    }
+    // Written lazily by each frame once its serial has been waited
+    mDescriptorSetsDirty.assign(kMaxInflight, true);
 
-    VkWriteDescriptorSet writeDescriptorSet = {
+    const VkDescriptorSetAllocateInfo sceneUniformSetAllocateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .descriptorPool = mDescriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &mSceneUniformSetLayout,
+    };
+    ASSERT(mVk.AllocateDescriptorSets(mDevice, &sceneUniformSetAllocateInfo, &mSceneUniformSet) ==
+           VK_SUCCESS);
+    // The ring buffer never changes, only the dynamic offset given at bind time does
+    const VkDescriptorBufferInfo sceneUniformBufferInfo = {
+            .buffer = mUploadRing.getBuffer(),
+            .offset = 0,
+            .range = sizeof(SceneUniformBlock),
+    };
+    const VkWriteDescriptorSet sceneUniformWrite = {
             .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
             .pNext = nullptr,
-            .dstSet = mDescriptorSet,
+            .dstSet = mSceneUniformSet,
             .dstBinding = 0,
             .dstArrayElement = 0,
-            .descriptorCount = kTextureCount,
-            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .pImageInfo = descriptorImageInfo,
-            .pBufferInfo = nullptr,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .pImageInfo = nullptr,
+            .pBufferInfo = &sceneUniformBufferInfo,
             .pTexelBufferView = nullptr,
     };
-    mVk.UpdateDescriptorSets(mDevice, 1, &writeDescriptorSet, 0, nullptr);
+    mVk.UpdateDescriptorSets(mDevice, 1, &sceneUniformWrite, 0, nullptr);
+    // Set by the first writeSceneUniforms of each frame
+    mSceneUniformOffsets.assign(kMaxInflight, UINT32_MAX);
 
     ALOGD("Successfully created descriptor set");
 }
 
+void Renderer::updateDescriptorSet(uint32_t frameIndex) {
+    // Without partially bound descriptors every entry of the table must be valid, the unused ones
+    // point to the placeholder. Texture i is entry i % descriptorCount of set i / descriptorCount.
+    const uint32_t textureCount = (uint32_t)mTextures.size();
+    const uint32_t descriptorCount = mDescriptorIndexingEnabled ? textureCount : mTextureTableSize;
+    std::vector<VkDescriptorImageInfo> descriptorImageInfo(descriptorCount * mTextureSetCount);
+    for (uint32_t i = 0; i < descriptorImageInfo.size(); i++) {
+        const Texture& texture = i < textureCount ? mTextures[i] : mPlaceholderTexture;
+        VkImageView imageView = texture.view;
+        if (imageView == VK_NULL_HANDLE) {
+            imageView = texture.lowResView != VK_NULL_HANDLE ? texture.lowResView
+                                                             : mPlaceholderTexture.view;
+        }
+        descriptorImageInfo[i].sampler = mSamplers[static_cast<uint32_t>(texture.samplerMode)];
+        descriptorImageInfo[i].imageView = imageView;
+        descriptorImageInfo[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets(mTextureSetCount);
+    for (uint32_t i = 0; i < mTextureSetCount; i++) {
+        writeDescriptorSets[i] = {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .pNext = nullptr,
+                .dstSet = mDescriptorSets[frameIndex * mTextureSetCount + i],
+                .dstBinding = 0,
+                .dstArrayElement = 0,
+                .descriptorCount = descriptorCount,
+                .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .pImageInfo = &descriptorImageInfo[i * descriptorCount],
+                .pBufferInfo = nullptr,
+                .pTexelBufferView = nullptr,
+        };
+    }
+    mVk.UpdateDescriptorSets(mDevice, mTextureSetCount, writeDescriptorSets.data(), 0, nullptr);
+    mDescriptorSetsDirty[frameIndex] = false;
+
+    // Reused command buffers of this frame reference the set, which is now invalidated
+    markCommandBuffersDirty();
+}
+
 void Renderer::loadShaderFromFile(const char* filePath, VkShaderModule* outShader) {
     ASSERT(filePath);
 
-    std::vector<char> file = readFileFromAsset(mAssetManager, filePath, AASSET_MODE_BUFFER);
+    // Mapped or buffered by the asset manager, either way aligned for SPIR-V words
+    AssetView file;
+    ASSERT(file.open(mAssetManager, filePath));
+    ASSERT(reinterpret_cast<uintptr_t>(file.data()) % sizeof(uint32_t) == 0);
 
     const VkShaderModuleCreateInfo shaderModuleCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
@@ -892,11 +1632,160 @@ void Renderer::loadShaderFromFile(const char* filePath, VkShaderModule* outShade
 }
 
 void Renderer::createRenderPass() {
+    // The final color attachment is the swapchain image, or the offscreen target sampled by the
+    // upscale pass. With MSAA it is only resolved to, at the end of the subpass while the samples
+    // are still on tile, and the multisampled color and the depth are never stored.
+    const bool isMultisampled = mSampleCount != VK_SAMPLE_COUNT_1_BIT;
+    const VkImageLayout finalLayout = mOffscreenRendering
+            ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+            : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkAttachmentDescription attachmentDescriptions[kMaxSceneAttachmentCount];
+    uint32_t attachmentCount = 0;
+    if (isMultisampled) {
+        attachmentDescriptions[attachmentCount++] = {
+                .flags = 0,
+                .format = mFormat,
+                .samples = mSampleCount,
+                .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+                .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+                .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+                .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+                .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        };
+    }
+    const VkAttachmentReference colorReference = {
+            .attachment = attachmentCount,
+            .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+    attachmentDescriptions[attachmentCount++] = {
+            .flags = 0,
+            .format = mFormat,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            // Fully written by the resolve
+            .loadOp = isMultisampled ? VK_ATTACHMENT_LOAD_OP_DONT_CARE
+                                     : VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .finalLayout = finalLayout,
+    };
+    const VkAttachmentReference depthReference = {
+            .attachment = attachmentCount,
+            .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+    if (mDepthBuffer) {
+        attachmentDescriptions[attachmentCount++] = {
+                .flags = 0,
+                .format = kDepthFormat,
+                .samples = mSampleCount,
+                .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+                .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+                .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+                .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+                .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        };
+    }
+    mSceneAttachmentCount = attachmentCount;
+
+    // Without MSAA the color reference is the final attachment itself
+    const VkAttachmentReference multisampledReference = {
+            .attachment = 0,
+            .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+    const VkSubpassDescription subpassDescription = {
+            .flags = 0,
+            .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+            .inputAttachmentCount = 0,
+            .pInputAttachments = nullptr,
+            .colorAttachmentCount = 1,
+            .pColorAttachments = isMultisampled ? &multisampledReference : &colorReference,
+            .pResolveAttachments = isMultisampled ? &colorReference : nullptr,
+            .pDepthStencilAttachment = mDepthBuffer ? &depthReference : nullptr,
+            .preserveAttachmentCount = 0,
+            .pPreserveAttachments = nullptr,
+    };
+
+    // The first dependency chains the layout transitions after the acquire semaphore, which the
+    // submit waits for at COLOR_ATTACHMENT_OUTPUT. The transient attachments and the offscreen
+    // target are shared by the frames in flight, so it also orders this frame's writes after the
+    // previous frame's attachment writes and upscale or post reads. The second one makes the
+    // color visible to the upscale pass or the post stage, or orders it before the present
+    // semaphore signal. An async post stage is ordered by the frame timeline instead.
+    VkPipelineStageFlags srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkPipelineStageFlags dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkAccessFlags srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    VkAccessFlags dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    if (mDepthBuffer) {
+        srcStageMask |= VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dstStageMask |= VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+        srcAccessMask |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dstAccessMask |= VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    }
+    VkPipelineStageFlags finalStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    VkAccessFlags finalAccessMask = 0;
+    if (mOffscreenRendering) {
+        const VkPipelineStageFlags readStageMask = mComputePost
+                ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        srcStageMask |= readStageMask;
+        finalStageMask = readStageMask;
+        finalAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    }
+    const VkSubpassDependency dependencies[2] = {
+            {
+                    .srcSubpass = VK_SUBPASS_EXTERNAL,
+                    .dstSubpass = 0,
+                    .srcStageMask = srcStageMask,
+                    .dstStageMask = dstStageMask,
+                    .srcAccessMask = srcAccessMask,
+                    .dstAccessMask = dstAccessMask,
+                    .dependencyFlags = 0,
+            },
+            {
+                    .srcSubpass = 0,
+                    .dstSubpass = VK_SUBPASS_EXTERNAL,
+                    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                    .dstStageMask = finalStageMask,
+                    .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                    .dstAccessMask = finalAccessMask,
+                    .dependencyFlags = 0,
+            },
+    };
+    const VkRenderPassCreateInfo renderPassCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .attachmentCount = attachmentCount,
+            .pAttachments = attachmentDescriptions,
+            .subpassCount = 1,
+            .pSubpasses = &subpassDescription,
+            .dependencyCount = 2,
+            .pDependencies = dependencies,
+    };
+    ASSERT(mVk.CreateRenderPass(mDevice, &renderPassCreateInfo, nullptr, &mRenderPass) ==
+           VK_SUCCESS);
+
+    // The swapchain framebuffers are created right after, for the upscale pass when offscreen.
+    // The post stage needs neither.
+    if (mOffscreenRendering && !mComputePost) {
+        createUpscaleRenderPass();
+    }
+
+    ALOGD("Successfully created render pass, %u samples, %s depth", mSampleCount,
+          mDepthBuffer ? "with" : "without");
+}
+
+void Renderer::createUpscaleRenderPass() {
+    // The fullscreen triangle writes every pixel, so the old contents are never loaded
     const VkAttachmentDescription attachmentDescription = {
             .flags = 0,
             .format = mFormat,
             .samples = VK_SAMPLE_COUNT_1_BIT,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
             .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
@@ -919,6 +1808,28 @@ void Renderer::createRenderPass() {
             .preserveAttachmentCount = 0,
             .pPreserveAttachments = nullptr,
     };
+    // Same acquire and present chaining as the scene render pass, the read of the offscreen
+    // target is covered by the scene render pass's own dependency
+    const VkSubpassDependency dependencies[2] = {
+            {
+                    .srcSubpass = VK_SUBPASS_EXTERNAL,
+                    .dstSubpass = 0,
+                    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                    .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                    .srcAccessMask = 0,
+                    .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                    .dependencyFlags = 0,
+            },
+            {
+                    .srcSubpass = 0,
+                    .dstSubpass = VK_SUBPASS_EXTERNAL,
+                    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                    .dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                    .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                    .dstAccessMask = 0,
+                    .dependencyFlags = 0,
+            },
+    };
     const VkRenderPassCreateInfo renderPassCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
             .pNext = nullptr,
@@ -927,64 +1838,276 @@ void Renderer::createRenderPass() {
             .pAttachments = &attachmentDescription,
             .subpassCount = 1,
             .pSubpasses = &subpassDescription,
-            .dependencyCount = 0,
-            .pDependencies = nullptr,
+            .dependencyCount = 2,
+            .pDependencies = dependencies,
     };
-    ASSERT(mVk.CreateRenderPass(mDevice, &renderPassCreateInfo, nullptr, &mRenderPass) ==
+    ASSERT(mVk.CreateRenderPass(mDevice, &renderPassCreateInfo, nullptr, &mUpscaleRenderPass) ==
            VK_SUCCESS);
 
-    ALOGD("Successfully created render pass");
+    ALOGD("Successfully created upscale render pass");
 }
 
-void Renderer::createGraphicsPipeline() {
-    const VkPushConstantRange pushConstantRange = {
-            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-            .offset = 0,
-            .size = sizeof(PushConstantBlock),
-    };
-    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+void Renderer::createAttachmentImages() {
+    if (mSampleCount != VK_SAMPLE_COUNT_1_BIT) {
+        createAttachmentImage(mFormat, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                              VK_IMAGE_ASPECT_COLOR_BIT, &mColorAttachment);
+    }
+    if (mDepthBuffer) {
+        createAttachmentImage(kDepthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                              VK_IMAGE_ASPECT_DEPTH_BIT, &mDepthAttachment);
+    }
+}
+
+void Renderer::createAttachmentImage(VkFormat format, VkImageUsageFlags usage,
+                                     VkImageAspectFlags aspect, AttachmentImage* outImage) {
+    const VkImageCreateInfo imageCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
             .pNext = nullptr,
             .flags = 0,
-            .setLayoutCount = 1,
-            .pSetLayouts = &mDescriptorSetLayout,
-            .pushConstantRangeCount = 1,
-            .pPushConstantRanges = &pushConstantRange,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = format,
+            .extent =
+                    {
+                            .width = mImageWidth,
+                            .height = mImageHeight,
+                            .depth = 1,
+                    },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = mSampleCount,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = 1,
+            .pQueueFamilyIndices = &mQueueFamilyIndex,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
-    ASSERT(mVk.CreatePipelineLayout(mDevice, &pipelineLayoutCreateInfo, nullptr,
-                                    &mPipelineLayout) == VK_SUCCESS);
-
-    VkShaderModule vertexShader = VK_NULL_HANDLE;
-    VkShaderModule fragmentShader = VK_NULL_HANDLE;
-    loadShaderFromFile(kVertexShaderFile, &vertexShader);
-    loadShaderFromFile(kFragmentShaderFile, &fragmentShader);
+    ASSERT(mVk.CreateImage(mDevice, &imageCreateInfo, nullptr, &outImage->image) == VK_SUCCESS);
+    outImage->memory = mAllocator.allocateTransientImage(outImage->image, &mLazyAttachments);
 
-    const VkPipelineShaderStageCreateInfo shaderStages[2] = {
+    const VkImageViewCreateInfo imageViewCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .image = outImage->image,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = format,
+            .components =
+                    {
+                            .r = VK_COMPONENT_SWIZZLE_R,
+                            .g = VK_COMPONENT_SWIZZLE_G,
+                            .b = VK_COMPONENT_SWIZZLE_B,
+                            .a = VK_COMPONENT_SWIZZLE_A,
+                    },
+            .subresourceRange =
+                    {
+                            .aspectMask = aspect,
+                            .baseMipLevel = 0,
+                            .levelCount = 1,
+                            .baseArrayLayer = 0,
+                            .layerCount = 1,
+                    },
+    };
+    ASSERT(mVk.CreateImageView(mDevice, &imageViewCreateInfo, nullptr, &outImage->view) ==
+           VK_SUCCESS);
+
+    ALOGD("Successfully created %ux%u transient attachment, format %d, %s", mImageWidth,
+          mImageHeight, format, mLazyAttachments ? "lazily allocated" : "device local");
+}
+
+void Renderer::destroyAttachmentImage(AttachmentImage* image) {
+    mVk.DestroyImageView(mDevice, image->view, nullptr);
+    mVk.DestroyImage(mDevice, image->image, nullptr);
+    mAllocator.free(&image->memory);
+    *image = AttachmentImage();
+}
+
+uint32_t Renderer::getSceneAttachments(VkImageView colorView, VkImageView* outViews) const {
+    uint32_t count = 0;
+    if (mColorAttachment.view != VK_NULL_HANDLE) {
+        outViews[count++] = mColorAttachment.view;
+    }
+    outViews[count++] = colorView;
+    if (mDepthAttachment.view != VK_NULL_HANDLE) {
+        outViews[count++] = mDepthAttachment.view;
+    }
+    return count;
+}
+
+static std::vector<char> readPipelineCacheFile(const std::string& path,
+                                               const VkPhysicalDeviceProperties& gpuProperties) {
+    std::vector<char> data;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        ALOGD("No pipeline cache found at %s", path.c_str());
+        return data;
+    }
+
+    PipelineCacheFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == kPipelineCacheMagic &&
+        header.vendorID == gpuProperties.vendorID && header.deviceID == gpuProperties.deviceID &&
+        header.driverVersion == gpuProperties.driverVersion &&
+        memcmp(header.pipelineCacheUUID, gpuProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0 &&
+        header.dataSize > 0 && header.dataSize <= kMaxPipelineCacheSize) {
+        data.resize(header.dataSize);
+        if (fread(data.data(), 1, data.size(), file) != data.size()) {
+            data.clear();
+        }
+    }
+    fclose(file);
+
+    if (data.empty()) {
+        ALOGD("Discarded stale or corrupted pipeline cache at %s", path.c_str());
+    }
+    return data;
+}
+
+void Renderer::createPipelineCache() {
+    std::vector<char> cacheData;
+    if (!mPipelineCachePath.empty()) {
+        VkPhysicalDeviceProperties gpuProperties;
+        mVk.GetPhysicalDeviceProperties(mGpu, &gpuProperties);
+        cacheData = readPipelineCacheFile(mPipelineCachePath, gpuProperties);
+    }
+
+    const VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .initialDataSize = cacheData.size(),
+            .pInitialData = cacheData.empty() ? nullptr : cacheData.data(),
+    };
+    ASSERT(mVk.CreatePipelineCache(mDevice, &pipelineCacheCreateInfo, nullptr, &mPipelineCache) ==
+           VK_SUCCESS);
+
+    ALOGD("Successfully created pipeline cache with %zu bytes of initial data", cacheData.size());
+}
+
+void Renderer::savePipelineCache() {
+    if (mPipelineCache == VK_NULL_HANDLE || mPipelineCachePath.empty()) {
+        return;
+    }
+
+    size_t dataSize = 0;
+    if (mVk.GetPipelineCacheData(mDevice, mPipelineCache, &dataSize, nullptr) != VK_SUCCESS ||
+        dataSize == 0) {
+        return;
+    }
+    std::vector<char> data(dataSize);
+    if (mVk.GetPipelineCacheData(mDevice, mPipelineCache, &dataSize, data.data()) != VK_SUCCESS) {
+        return;
+    }
+
+    VkPhysicalDeviceProperties gpuProperties;
+    mVk.GetPhysicalDeviceProperties(mGpu, &gpuProperties);
+    PipelineCacheFileHeader header = {
+            .magic = kPipelineCacheMagic,
+            .vendorID = gpuProperties.vendorID,
+            .deviceID = gpuProperties.deviceID,
+            .driverVersion = gpuProperties.driverVersion,
+            .pipelineCacheUUID = {},
+            .dataSize = dataSize,
+    };
+    memcpy(header.pipelineCacheUUID, gpuProperties.pipelineCacheUUID, VK_UUID_SIZE);
+
+    // Write to a temporary file and rename, so a kill in the middle never leaves a torn cache
+    const std::string tempPath = mPipelineCachePath + ".tmp";
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        ALOGD("Failed to open %s for writing", tempPath.c_str());
+        return;
+    }
+    const bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                         fwrite(data.data(), 1, dataSize, file) == dataSize;
+    if (fclose(file) != 0 || !written ||
+        rename(tempPath.c_str(), mPipelineCachePath.c_str()) != 0) {
+        ALOGD("Failed to write pipeline cache to %s", mPipelineCachePath.c_str());
+        remove(tempPath.c_str());
+        return;
+    }
+
+    ALOGD("Successfully saved %zu bytes of pipeline cache", dataSize);
+}
+
+void Renderer::createGraphicsPipeline() {
+    // Set 0 is the texture table and set 1 the uniforms in the upload ring
+    const VkDescriptorSetLayout setLayouts[2] = {mDescriptorSetLayout, mSceneUniformSetLayout};
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .setLayoutCount = 2,
+            .pSetLayouts = setLayouts,
+            .pushConstantRangeCount = 0,
+            .pPushConstantRanges = nullptr,
+    };
+    ASSERT(mVk.CreatePipelineLayout(mDevice, &pipelineLayoutCreateInfo, nullptr,
+                                    &mPipelineLayout) == VK_SUCCESS);
+
+    VkShaderModule vertexShader = VK_NULL_HANDLE;
+    VkShaderModule fragmentShader = VK_NULL_HANDLE;
+    loadShaderFromFile(mSpecializedPreRotation ? kSpecializedVertexShaderFile : kVertexShaderFile,
+                       &vertexShader);
+    // Only the bindless table can be indexed with a different texture per quad, and only the
+    // single texture shader does without dynamic indexing
+    const char* fragmentShaderFile = kSingleFragmentShaderFile;
+    if (mDescriptorIndexingEnabled) {
+        fragmentShaderFile = kBindlessFragmentShaderFile;
+    } else if (mDynamicIndexingEnabled) {
+        fragmentShaderFile = kFragmentShaderFile;
+    }
+    loadShaderFromFile(fragmentShaderFile, &fragmentShader);
+
+    // One pipeline per quarter turn when specializing, all sharing the same fragment stage
+    const uint32_t pipelineCount = mSpecializedPreRotation ? kPreRotationCount : 1;
+    const uint32_t preRotations[kPreRotationCount] = {0, 1, 2, 3};
+    const VkSpecializationMapEntry specializationMapEntry = {
+            .constantID = 0,
+            .offset = 0,
+            .size = sizeof(uint32_t),
+    };
+    VkSpecializationInfo specializationInfos[kPreRotationCount];
+    VkPipelineShaderStageCreateInfo shaderStages[kPreRotationCount][2];
+    for (uint32_t i = 0; i < pipelineCount; i++) {
+        specializationInfos[i] = {
+                .mapEntryCount = 1,
+                .pMapEntries = &specializationMapEntry,
+                .dataSize = sizeof(uint32_t),
+                .pData = &preRotations[i],
+        };
+        shaderStages[i][0] = {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = 0,
+                .stage = VK_SHADER_STAGE_VERTEX_BIT,
+                .module = vertexShader,
+                .pName = "main",
+                .pSpecializationInfo = mSpecializedPreRotation ? &specializationInfos[i] : nullptr,
+        };
+        shaderStages[i][1] = {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = 0,
+                .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+                .module = fragmentShader,
+                .pName = "main",
+                .pSpecializationInfo = nullptr,
+        };
+    }
+    // Binding 0 is the unit quad and binding 1 the per instance data of mQuadBatch
+    const VkVertexInputBindingDescription vertexInputBindingDescriptions[2] = {
             {
-                    .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-                    .pNext = nullptr,
-                    .flags = 0,
-                    .stage = VK_SHADER_STAGE_VERTEX_BIT,
-                    .module = vertexShader,
-                    .pName = "main",
-                    .pSpecializationInfo = nullptr,
+                    .binding = 0,
+                    .stride = 4 * sizeof(float),
+                    .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
             },
             {
-                    .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-                    .pNext = nullptr,
-                    .flags = 0,
-                    .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-                    .module = fragmentShader,
-                    .pName = "main",
-                    .pSpecializationInfo = nullptr,
+                    .binding = 1,
+                    .stride = sizeof(QuadBatch::Instance),
+                    .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
             },
     };
-    const VkVertexInputBindingDescription vertexInputBindingDescription = {
-            .binding = 0,
-            .stride = 4 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
-    };
-    const VkVertexInputAttributeDescription vertexInputAttributeDescriptions[2] = {
+    const VkVertexInputAttributeDescription vertexInputAttributeDescriptions[6] = {
             {
                     .location = 0,
                     .binding = 0,
@@ -998,14 +2121,38 @@ void Renderer::createGraphicsPipeline() {
                     .format = VK_FORMAT_R32G32_SFLOAT,
                     .offset = sizeof(float) * 2,
             },
+            {
+                    .location = 2,
+                    .binding = 1,
+                    .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                    .offset = offsetof(QuadBatch::Instance, transform),
+            },
+            {
+                    .location = 3,
+                    .binding = 1,
+                    .format = VK_FORMAT_R32G32_SFLOAT,
+                    .offset = offsetof(QuadBatch::Instance, offset),
+            },
+            {
+                    .location = 4,
+                    .binding = 1,
+                    .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                    .offset = offsetof(QuadBatch::Instance, uvRect),
+            },
+            {
+                    .location = 5,
+                    .binding = 1,
+                    .format = VK_FORMAT_R32_UINT,
+                    .offset = offsetof(QuadBatch::Instance, textureIndex),
+            },
     };
     const VkPipelineVertexInputStateCreateInfo vertexInputInfo = {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
             .pNext = nullptr,
             .flags = 0,
-            .vertexBindingDescriptionCount = 1,
-            .pVertexBindingDescriptions = &vertexInputBindingDescription,
-            .vertexAttributeDescriptionCount = 2,
+            .vertexBindingDescriptionCount = 2,
+            .pVertexBindingDescriptions = vertexInputBindingDescriptions,
+            .vertexAttributeDescriptionCount = 6,
             .pVertexAttributeDescriptions = vertexInputAttributeDescriptions,
     };
     const VkPipelineInputAssemblyStateCreateInfo inputAssemblyInfo = {
@@ -1040,6 +2187,225 @@ void Renderer::createGraphicsPipeline() {
             .lineWidth = 1,
     };
     const VkSampleMask sampleMask = ~0U;
+    const VkPipelineMultisampleStateCreateInfo multisampleInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .rasterizationSamples = mSampleCount,
+            .sampleShadingEnable = VK_FALSE,
+            .minSampleShading = 0,
+            .pSampleMask = &sampleMask,
+            .alphaToCoverageEnable = VK_FALSE,
+            .alphaToOneEnable = VK_FALSE,
+    };
+    // The quads all lie at z = 0, LESS_OR_EQUAL keeps them drawn in order
+    const VkPipelineDepthStencilStateCreateInfo depthStencilInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .depthTestEnable = VK_TRUE,
+            .depthWriteEnable = VK_TRUE,
+            .depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
+            .depthBoundsTestEnable = VK_FALSE,
+            .stencilTestEnable = VK_FALSE,
+            .front = {},
+            .back = {},
+            .minDepthBounds = 0.0F,
+            .maxDepthBounds = 1.0F,
+    };
+    const VkPipelineColorBlendAttachmentState attachmentStates = {
+            .blendEnable = VK_FALSE,
+            .srcColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+            .dstColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+            .colorBlendOp = VK_BLEND_OP_ADD,
+            .srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+            .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+            .alphaBlendOp = VK_BLEND_OP_ADD,
+            .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                    VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+    };
+    const VkPipelineColorBlendStateCreateInfo colorBlendInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .logicOpEnable = VK_FALSE,
+            .logicOp = VK_LOGIC_OP_COPY,
+            .attachmentCount = 1,
+            .pAttachments = &attachmentStates,
+            .blendConstants = {0.0F, 0.0F, 0.0F, 0.0F},
+    };
+    const VkDynamicState dynamicStates[2] = {
+            VK_DYNAMIC_STATE_VIEWPORT,
+            VK_DYNAMIC_STATE_SCISSOR,
+    };
+    const VkPipelineDynamicStateCreateInfo dynamicInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .dynamicStateCount = 2,
+            .pDynamicStates = dynamicStates,
+    };
+    VkGraphicsPipelineCreateInfo pipelineCreateInfos[kPreRotationCount];
+    for (uint32_t i = 0; i < pipelineCount; i++) {
+        pipelineCreateInfos[i] = {
+                .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = 0,
+                .stageCount = 2,
+                .pStages = shaderStages[i],
+                .pVertexInputState = &vertexInputInfo,
+                .pInputAssemblyState = &inputAssemblyInfo,
+                .pTessellationState = nullptr,
+                .pViewportState = &viewportInfo,
+                .pRasterizationState = &rasterInfo,
+                .pMultisampleState = &multisampleInfo,
+                .pDepthStencilState = mDepthBuffer ? &depthStencilInfo : nullptr,
+                .pColorBlendState = &colorBlendInfo,
+                .pDynamicState = &dynamicInfo,
+                .layout = mPipelineLayout,
+                .renderPass = mRenderPass,
+                .subpass = 0,
+                .basePipelineHandle = VK_NULL_HANDLE,
+                .basePipelineIndex = 0,
+        };
+    }
+    // Created in one call so that the driver may compile the variants in parallel
+    mPipelines.resize(pipelineCount);
+    ASSERT(mVk.CreateGraphicsPipelines(mDevice, mPipelineCache, pipelineCount, pipelineCreateInfos,
+                                       nullptr, mPipelines.data()) == VK_SUCCESS);
+
+    mVk.DestroyShaderModule(mDevice, vertexShader, nullptr);
+    mVk.DestroyShaderModule(mDevice, fragmentShader, nullptr);
+
+    ALOGD("Successfully created %u graphics pipelines", pipelineCount);
+}
+
+void Renderer::createUpscaleSampler() {
+    // Clamping keeps the bilinear footprint at the border of the target inside it
+    const VkSamplerCreateInfo samplerCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .magFilter = VK_FILTER_LINEAR,
+            .minFilter = VK_FILTER_LINEAR,
+            .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .mipLodBias = 0.0F,
+            .anisotropyEnable = VK_FALSE,
+            .maxAnisotropy = 1.0F,
+            .compareEnable = VK_FALSE,
+            .compareOp = VK_COMPARE_OP_NEVER,
+            .minLod = 0.0F,
+            .maxLod = 0.0F,
+            .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+            .unnormalizedCoordinates = VK_FALSE,
+    };
+    ASSERT(mVk.CreateSampler(mDevice, &samplerCreateInfo, nullptr, &mUpscaleSampler) ==
+           VK_SUCCESS);
+}
+
+void Renderer::createUpscalePipeline() {
+    const VkDescriptorSetLayoutBinding descriptorSetLayoutBinding = {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pImmutableSamplers = nullptr,
+    };
+    const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .bindingCount = 1,
+            .pBindings = &descriptorSetLayoutBinding,
+    };
+    ASSERT(mVk.CreateDescriptorSetLayout(mDevice, &descriptorSetLayoutCreateInfo, nullptr,
+                                         &mUpscaleDescriptorSetLayout) == VK_SUCCESS);
+
+    const VkPushConstantRange pushConstantRange = {
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .offset = 0,
+            .size = sizeof(UpscalePushConstantBlock),
+    };
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .setLayoutCount = 1,
+            .pSetLayouts = &mUpscaleDescriptorSetLayout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = &pushConstantRange,
+    };
+    ASSERT(mVk.CreatePipelineLayout(mDevice, &pipelineLayoutCreateInfo, nullptr,
+                                    &mUpscalePipelineLayout) == VK_SUCCESS);
+
+    VkShaderModule vertexShader = VK_NULL_HANDLE;
+    VkShaderModule fragmentShader = VK_NULL_HANDLE;
+    loadShaderFromFile(kUpscaleVertexShaderFile, &vertexShader);
+    loadShaderFromFile(kUpscaleFragmentShaderFile, &fragmentShader);
+    const VkPipelineShaderStageCreateInfo shaderStages[2] = {
+            {
+                    .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .pNext = nullptr,
+                    .flags = 0,
+                    .stage = VK_SHADER_STAGE_VERTEX_BIT,
+                    .module = vertexShader,
+                    .pName = "main",
+                    .pSpecializationInfo = nullptr,
+            },
+            {
+                    .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                    .pNext = nullptr,
+                    .flags = 0,
+                    .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+                    .module = fragmentShader,
+                    .pName = "main",
+                    .pSpecializationInfo = nullptr,
+            },
+    };
+    // The fullscreen triangle is generated from gl_VertexIndex
+    const VkPipelineVertexInputStateCreateInfo vertexInputInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .vertexBindingDescriptionCount = 0,
+            .pVertexBindingDescriptions = nullptr,
+            .vertexAttributeDescriptionCount = 0,
+            .pVertexAttributeDescriptions = nullptr,
+    };
+    const VkPipelineInputAssemblyStateCreateInfo inputAssemblyInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+            .primitiveRestartEnable = VK_FALSE,
+    };
+    const VkPipelineViewportStateCreateInfo viewportInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .viewportCount = 1,
+            .pViewports = nullptr,
+            .scissorCount = 1,
+            .pScissors = nullptr,
+    };
+    const VkPipelineRasterizationStateCreateInfo rasterInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .depthClampEnable = VK_FALSE,
+            .rasterizerDiscardEnable = VK_FALSE,
+            .polygonMode = VK_POLYGON_MODE_FILL,
+            .cullMode = VK_CULL_MODE_NONE,
+            .frontFace = VK_FRONT_FACE_CLOCKWISE,
+            .depthBiasEnable = VK_FALSE,
+            .depthBiasConstantFactor = 0,
+            .depthBiasClamp = 0,
+            .depthBiasSlopeFactor = 0,
+            .lineWidth = 1,
+    };
+    const VkSampleMask sampleMask = ~0U;
     const VkPipelineMultisampleStateCreateInfo multisampleInfo = {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
             .pNext = nullptr,
@@ -1098,19 +2464,347 @@ void Renderer::createGraphicsPipeline() {
             .pDepthStencilState = nullptr,
             .pColorBlendState = &colorBlendInfo,
             .pDynamicState = &dynamicInfo,
-            .layout = mPipelineLayout,
-            .renderPass = mRenderPass,
+            .layout = mUpscalePipelineLayout,
+            .renderPass = mUpscaleRenderPass,
             .subpass = 0,
             .basePipelineHandle = VK_NULL_HANDLE,
             .basePipelineIndex = 0,
     };
-    ASSERT(mVk.CreateGraphicsPipelines(mDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr,
-                                       &mPipeline) == VK_SUCCESS);
+    ASSERT(mVk.CreateGraphicsPipelines(mDevice, mPipelineCache, 1, &pipelineCreateInfo, nullptr,
+                                       &mUpscalePipeline) == VK_SUCCESS);
 
     mVk.DestroyShaderModule(mDevice, vertexShader, nullptr);
     mVk.DestroyShaderModule(mDevice, fragmentShader, nullptr);
 
-    ALOGD("Successfully created graphics pipeline");
+    ALOGD("Successfully created upscale pipeline");
+}
+
+void Renderer::createPostPipeline() {
+    const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2] = {
+            {
+                    .binding = 0,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                    .descriptorCount = 1,
+                    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .pImmutableSamplers = nullptr,
+            },
+            {
+                    .binding = 1,
+                    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                    .descriptorCount = 1,
+                    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                    .pImmutableSamplers = nullptr,
+            },
+    };
+    const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .bindingCount = 2,
+            .pBindings = descriptorSetLayoutBindings,
+    };
+    ASSERT(mVk.CreateDescriptorSetLayout(mDevice, &descriptorSetLayoutCreateInfo, nullptr,
+                                         &mPostDescriptorSetLayout) == VK_SUCCESS);
+
+    const VkPushConstantRange pushConstantRange = {
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .offset = 0,
+            .size = sizeof(PostPushConstantBlock),
+    };
+    const VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .setLayoutCount = 1,
+            .pSetLayouts = &mPostDescriptorSetLayout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = &pushConstantRange,
+    };
+    ASSERT(mVk.CreatePipelineLayout(mDevice, &pipelineLayoutCreateInfo, nullptr,
+                                    &mPostPipelineLayout) == VK_SUCCESS);
+
+    VkShaderModule computeShader = VK_NULL_HANDLE;
+    loadShaderFromFile(kPostComputeShaderFile, &computeShader);
+    const VkComputePipelineCreateInfo pipelineCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .stage =
+                    {
+                            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                            .pNext = nullptr,
+                            .flags = 0,
+                            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                            .module = computeShader,
+                            .pName = "main",
+                            .pSpecializationInfo = nullptr,
+                    },
+            .layout = mPostPipelineLayout,
+            .basePipelineHandle = VK_NULL_HANDLE,
+            .basePipelineIndex = 0,
+    };
+    ASSERT(mVk.CreateComputePipelines(mDevice, mPipelineCache, 1, &pipelineCreateInfo, nullptr,
+                                      &mPostPipeline) == VK_SUCCESS);
+
+    mVk.DestroyShaderModule(mDevice, computeShader, nullptr);
+
+    ALOGD("Successfully created post pipeline");
+}
+
+void Renderer::createOffscreenTarget() {
+    // Already pre-rotated like the swapchain images, so the upscale pass is a plain stretch.
+    // Sampled on the compute queue by an async post stage.
+    const uint32_t queueFamilyIndices[2] = {mQueueFamilyIndex, mComputeQueueFamilyIndex};
+    const VkImageCreateInfo imageCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = mFormat,
+            .extent =
+                    {
+                            .width = mImageWidth,
+                            .height = mImageHeight,
+                            .depth = 1,
+                    },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            .sharingMode = mAsyncPost ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = mAsyncPost ? 2U : 1U,
+            .pQueueFamilyIndices = queueFamilyIndices,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    ASSERT(mVk.CreateImage(mDevice, &imageCreateInfo, nullptr, &mOffscreenTarget.image) ==
+           VK_SUCCESS);
+    mOffscreenTarget.memory = mAllocator.allocateImage(
+            mOffscreenTarget.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            MemoryAllocator::Pool::GENERAL);
+
+    const VkImageViewCreateInfo imageViewCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .image = mOffscreenTarget.image,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = mFormat,
+            .components =
+                    {
+                            .r = VK_COMPONENT_SWIZZLE_R,
+                            .g = VK_COMPONENT_SWIZZLE_G,
+                            .b = VK_COMPONENT_SWIZZLE_B,
+                            .a = VK_COMPONENT_SWIZZLE_A,
+                    },
+            .subresourceRange =
+                    {
+                            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                            .baseMipLevel = 0,
+                            .levelCount = 1,
+                            .baseArrayLayer = 0,
+                            .layerCount = 1,
+                    },
+    };
+    ASSERT(mVk.CreateImageView(mDevice, &imageViewCreateInfo, nullptr, &mOffscreenTarget.view) ==
+           VK_SUCCESS);
+
+    VkImageView attachments[kMaxSceneAttachmentCount];
+    const uint32_t attachmentCount = getSceneAttachments(mOffscreenTarget.view, attachments);
+    const VkFramebufferCreateInfo framebufferCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .renderPass = mRenderPass,
+            .attachmentCount = attachmentCount,
+            .pAttachments = attachments,
+            .width = mImageWidth,
+            .height = mImageHeight,
+            .layers = 1,
+    };
+    ASSERT(mVk.CreateFramebuffer(mDevice, &framebufferCreateInfo, nullptr,
+                                 &mOffscreenTarget.framebuffer) == VK_SUCCESS);
+
+    if (mComputePost) {
+        createPostDescriptorSets();
+    } else {
+        createUpscaleDescriptorSet();
+    }
+
+    ALOGD("Successfully created %ux%u offscreen target", mImageWidth, mImageHeight);
+}
+
+void Renderer::createUpscaleDescriptorSet() {
+    // A pool of its own, so the set lives and dies with the target while older ones retire
+    const VkDescriptorPoolSize descriptorPoolSize = {
+            .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+    };
+    const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = 1,
+            .poolSizeCount = 1,
+            .pPoolSizes = &descriptorPoolSize,
+    };
+    ASSERT(mVk.CreateDescriptorPool(mDevice, &descriptorPoolCreateInfo, nullptr,
+                                    &mOffscreenTarget.descriptorPool) == VK_SUCCESS);
+    const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .descriptorPool = mOffscreenTarget.descriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &mUpscaleDescriptorSetLayout,
+    };
+    ASSERT(mVk.AllocateDescriptorSets(mDevice, &descriptorSetAllocateInfo,
+                                      &mOffscreenTarget.descriptorSet) == VK_SUCCESS);
+
+    const VkDescriptorImageInfo descriptorImageInfo = {
+            .sampler = mUpscaleSampler,
+            .imageView = mOffscreenTarget.view,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+    const VkWriteDescriptorSet writeDescriptorSet = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = mOffscreenTarget.descriptorSet,
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &descriptorImageInfo,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+    };
+    mVk.UpdateDescriptorSets(mDevice, 1, &writeDescriptorSet, 0, nullptr);
+}
+
+void Renderer::createPostDescriptorSets() {
+    // Storage views of their own, the swapchain image views are made on the framebuffer thread
+    const uint32_t imageCount = mImages.size();
+    mOffscreenTarget.storageViews.resize(imageCount, VK_NULL_HANDLE);
+    for (uint32_t i = 0; i < imageCount; i++) {
+        const VkImageViewCreateInfo imageViewCreateInfo = {
+                .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = 0,
+                .image = mImages[i],
+                .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                .format = mFormat,
+                .components =
+                        {
+                                .r = VK_COMPONENT_SWIZZLE_R,
+                                .g = VK_COMPONENT_SWIZZLE_G,
+                                .b = VK_COMPONENT_SWIZZLE_B,
+                                .a = VK_COMPONENT_SWIZZLE_A,
+                        },
+                .subresourceRange =
+                        {
+                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                .baseMipLevel = 0,
+                                .levelCount = 1,
+                                .baseArrayLayer = 0,
+                                .layerCount = 1,
+                        },
+        };
+        ASSERT(mVk.CreateImageView(mDevice, &imageViewCreateInfo, nullptr,
+                                   &mOffscreenTarget.storageViews[i]) == VK_SUCCESS);
+    }
+
+    // Same as the upscale set, the pool lives and dies with the target
+    const VkDescriptorPoolSize descriptorPoolSizes[2] = {
+            {
+                    .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                    .descriptorCount = imageCount,
+            },
+            {
+                    .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                    .descriptorCount = imageCount,
+            },
+    };
+    const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = imageCount,
+            .poolSizeCount = 2,
+            .pPoolSizes = descriptorPoolSizes,
+    };
+    ASSERT(mVk.CreateDescriptorPool(mDevice, &descriptorPoolCreateInfo, nullptr,
+                                    &mOffscreenTarget.descriptorPool) == VK_SUCCESS);
+    const std::vector<VkDescriptorSetLayout> setLayouts(imageCount, mPostDescriptorSetLayout);
+    const VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .descriptorPool = mOffscreenTarget.descriptorPool,
+            .descriptorSetCount = imageCount,
+            .pSetLayouts = setLayouts.data(),
+    };
+    mOffscreenTarget.postDescriptorSets.resize(imageCount, VK_NULL_HANDLE);
+    ASSERT(mVk.AllocateDescriptorSets(mDevice, &descriptorSetAllocateInfo,
+                                      mOffscreenTarget.postDescriptorSets.data()) == VK_SUCCESS);
+
+    const VkDescriptorImageInfo offscreenImageInfo = {
+            .sampler = mUpscaleSampler,
+            .imageView = mOffscreenTarget.view,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+    std::vector<VkDescriptorImageInfo> storageImageInfos(imageCount);
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+    writeDescriptorSets.reserve(2 * imageCount);
+    for (uint32_t i = 0; i < imageCount; i++) {
+        storageImageInfos[i] = {
+                .sampler = VK_NULL_HANDLE,
+                .imageView = mOffscreenTarget.storageViews[i],
+                .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        };
+        writeDescriptorSets.push_back({
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .pNext = nullptr,
+                .dstSet = mOffscreenTarget.postDescriptorSets[i],
+                .dstBinding = 0,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .pImageInfo = &offscreenImageInfo,
+                .pBufferInfo = nullptr,
+                .pTexelBufferView = nullptr,
+        });
+        writeDescriptorSets.push_back({
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .pNext = nullptr,
+                .dstSet = mOffscreenTarget.postDescriptorSets[i],
+                .dstBinding = 1,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                .pImageInfo = &storageImageInfos[i],
+                .pBufferInfo = nullptr,
+                .pTexelBufferView = nullptr,
+        });
+    }
+    mVk.UpdateDescriptorSets(mDevice, writeDescriptorSets.size(), writeDescriptorSets.data(), 0,
+                             nullptr);
+}
+
+void Renderer::destroyOffscreenTarget(OffscreenTarget* target) {
+    // Also frees the descriptor sets
+    mVk.DestroyDescriptorPool(mDevice, target->descriptorPool, nullptr);
+    for (auto& storageView : target->storageViews) {
+        mVk.DestroyImageView(mDevice, storageView, nullptr);
+    }
+    mVk.DestroyFramebuffer(mDevice, target->framebuffer, nullptr);
+    mVk.DestroyImageView(mDevice, target->view, nullptr);
+    mVk.DestroyImage(mDevice, target->image, nullptr);
+    mAllocator.free(&target->memory);
+    *target = OffscreenTarget();
+}
+
+VkExtent2D Renderer::getOffscreenExtent() const {
+    return {
+            .width = std::max((uint32_t)std::lround(mImageWidth * mOffscreenScale), 1U),
+            .height = std::max((uint32_t)std::lround(mImageHeight * mOffscreenScale), 1U),
+    };
 }
 
 void Renderer::createVertexBuffer() {
@@ -1121,103 +2815,519 @@ void Renderer::createVertexBuffer() {
             1.0F,  1.0F,  1.0F, 1.0F, // RB
     };
 
+    createStaticBuffer(vertexData, sizeof(vertexData), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                       &mVertexBuffer, &mVertexMemory);
+
+    ALOGD("Successfully created vertex buffer");
+}
+
+void Renderer::createStaticBuffer(const void* data, VkDeviceSize size, VkBufferUsageFlags usage,
+                                  VkBuffer* outBuffer, MemoryAllocator::Allocation* outMemory) {
     const uint32_t queueFamilyIndex = mQueueFamilyIndex;
     const VkBufferCreateInfo bufferCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
             .pNext = nullptr,
             .flags = 0,
-            .size = sizeof(vertexData),
-            .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            .size = size,
+            .usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
             .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
             .queueFamilyIndexCount = 1,
             .pQueueFamilyIndices = &queueFamilyIndex,
     };
-    ASSERT(mVk.CreateBuffer(mDevice, &bufferCreateInfo, nullptr, &mVertexBuffer) == VK_SUCCESS);
+    ASSERT(mVk.CreateBuffer(mDevice, &bufferCreateInfo, nullptr, outBuffer) == VK_SUCCESS);
+    *outMemory = mAllocator.allocateBuffer(*outBuffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                           MemoryAllocator::Pool::LINEAR);
 
-    VkMemoryRequirements memoryRequirements;
-    mVk.GetBufferMemoryRequirements(mDevice, mVertexBuffer, &memoryRequirements);
+    // No frame has used the ring yet, so any slice can stage the data
+    mUploadRing.begin(0);
+    const UploadRing::Allocation staging = mUploadRing.allocate(size);
+    memcpy(staging.mapped, data, size);
+    mUploadRing.end();
 
-    uint32_t typeIndex = getMemoryTypeIndex(memoryRequirements.memoryTypeBits,
-                                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-    VkMemoryAllocateInfo memoryAllocateInfo = {
-            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
             .pNext = nullptr,
-            .allocationSize = memoryRequirements.size,
-            .memoryTypeIndex = typeIndex,
+            .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = mQueueFamilyIndex,
     };
-    ASSERT(mVk.AllocateMemory(mDevice, &memoryAllocateInfo, nullptr, &mVertexMemory) == VK_SUCCESS);
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    ASSERT(mVk.CreateCommandPool(mDevice, &commandPoolCreateInfo, nullptr, &commandPool) ==
+           VK_SUCCESS);
+    const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .commandPool = commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+    };
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    ASSERT(mVk.AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo, &commandBuffer) ==
+           VK_SUCCESS);
+
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            .pInheritanceInfo = nullptr,
+    };
+    ASSERT(mVk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo) == VK_SUCCESS);
+    const VkBufferCopy region = {
+            .srcOffset = staging.offset,
+            .dstOffset = 0,
+            .size = size,
+    };
+    mVk.CmdCopyBuffer(commandBuffer, staging.buffer, *outBuffer, 1, &region);
+    // Later submits to the queue read it as vertex, index or uniform data. The fence wait alone
+    // doesn't make the copy visible to them.
+    const VkBufferMemoryBarrier bufferMemoryBarrier = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+                             VK_ACCESS_UNIFORM_READ_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = *outBuffer,
+            .offset = 0,
+            .size = VK_WHOLE_SIZE,
+    };
+    mVk.CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                           0, 0, nullptr, 1, &bufferMemoryBarrier, 0, nullptr);
+    ASSERT(mVk.EndCommandBuffer(commandBuffer) == VK_SUCCESS);
+
+    const VkFenceCreateInfo fenceCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+    };
+    VkFence fence = VK_NULL_HANDLE;
+    ASSERT(mVk.CreateFence(mDevice, &fenceCreateInfo, nullptr, &fence) == VK_SUCCESS);
+    const VkSubmitInfo submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = nullptr,
+            .waitSemaphoreCount = 0,
+            .pWaitSemaphores = nullptr,
+            .pWaitDstStageMask = nullptr,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &commandBuffer,
+            .signalSemaphoreCount = 0,
+            .pSignalSemaphores = nullptr,
+    };
+    {
+        std::lock_guard<std::mutex> lock(mQueueLock);
+        ASSERT(mVk.QueueSubmit(mQueue, 1, &submitInfo, fence) == VK_SUCCESS);
+    }
+    ASSERT(mVk.WaitForFences(mDevice, 1, &fence, VK_TRUE, kTimeout30Sec) == VK_SUCCESS);
+    mVk.DestroyFence(mDevice, fence, nullptr);
+    mVk.DestroyCommandPool(mDevice, commandPool, nullptr);
+}
+
+void Renderer::writeSceneUniforms(uint32_t frameIndex) {
+    const UploadRing::Allocation uniforms = mUploadRing.allocate(sizeof(SceneUniformBlock));
+    if (mSpecializedPreRotation) {
+        SpecializedSceneUniformBlock uniformBlock;
+        memcpy(uniformBlock.scale, mScale, sizeof(mScale));
+        memcpy(uniforms.mapped, &uniformBlock, sizeof(uniformBlock));
+    } else {
+        SceneUniformBlock uniformBlock;
+        memcpy(uniformBlock.mvp, mMvp, sizeof(mMvp));
+        memcpy(uniforms.mapped, &uniformBlock, sizeof(uniformBlock));
+    }
+
+    // Always the same offset in practice, but reused command buffers have it baked in
+    const uint32_t offset = (uint32_t)uniforms.offset;
+    if (offset != mSceneUniformOffsets[frameIndex]) {
+        mSceneUniformOffsets[frameIndex] = offset;
+        markCommandBuffersDirty();
+    }
+}
+
+void Renderer::buildQuadBatch(uint32_t frameIndex, const SceneFrame& scene) {
+    mQuadBatch.begin(frameIndex);
+    for (const auto& quad : scene.quads) {
+        mQuadBatch.addQuad(quad);
+    }
+    if (mQuadBatch.end()) {
+        markCommandBuffersDirty();
+    }
+}
+
+void Renderer::updateThreadMain() {
+    uint32_t sceneIndex;
+    while (mFreeScenes.pop(&sceneIndex)) {
+        updateScene(&mSceneFrames[sceneIndex]);
+        mFreeScenes.finish();
+        if (!mBuiltScenes.push(sceneIndex)) {
+            break;
+        }
+    }
+}
+
+void Renderer::updateScene(SceneFrame* scene) {
+    // Tiles covering the [-1, 1] square the single quad used to, each sampling its own part of
+    // the texture, so the picture is unchanged as long as the quad count is a square number
+    const uint32_t quadCount = mSceneQuadCount.load(std::memory_order_relaxed);
+    uint32_t gridSize = 1;
+    while (gridSize * gridSize < quadCount) {
+        gridSize++;
+    }
+    const float tileScale = 1.0F / gridSize;
+
+    // Contiguous bands of quads per texture keep the draws split by texture few. mTextures is
+    // only resized by createTextures, before the update thread starts.
+    const uint32_t textureCount = (uint32_t)mTextures.size();
+    uint32_t sceneTextureCount = mSceneTextureCount.load(std::memory_order_relaxed);
+    if (sceneTextureCount == 0 || sceneTextureCount > textureCount) {
+        sceneTextureCount = textureCount;
+    }
+    // Only a window over a subset moves, so that the draws don't change for nothing
+    const uint32_t firstTexture = sceneTextureCount < textureCount
+            ? (uint32_t)(mSceneFrameNumber / kSceneTextureInterval)
+            : 0;
+
+    scene->frameNumber = mSceneFrameNumber++;
+    scene->quads.resize(quadCount);
+    for (uint32_t i = 0; i < quadCount; i++) {
+        const uint32_t x = i % gridSize;
+        const uint32_t y = i / gridSize;
+        const uint32_t band = (uint32_t)((uint64_t)i * sceneTextureCount / quadCount);
+        scene->quads[i] = {
+                .transform = {tileScale, 0.0F, 0.0F, tileScale},
+                .offset = {-1.0F + (2 * x + 1) * tileScale, -1.0F + (2 * y + 1) * tileScale},
+                .uvRect = {x * tileScale, y * tileScale, tileScale, tileScale},
+                .textureIndex = (firstTexture + band) % textureCount,
+                .padding = 0,
+        };
+    }
+}
+
+void Renderer::createCommandBuffers() {
+    const VkCommandPoolCreateInfo commandPoolCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = mQueueFamilyIndex,
+    };
+    ASSERT(mVk.CreateCommandPool(mDevice, &commandPoolCreateInfo, nullptr, &mCommandPool) ==
+           VK_SUCCESS);
+
+    mCommandBuffers.resize(mInflight, VK_NULL_HANDLE);
+    const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .commandPool = mCommandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = mInflight,
+    };
+    ASSERT(mVk.AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo,
+                                      mCommandBuffers.data()) == VK_SUCCESS);
+
+    // Secondary command buffers are allocated on demand by the thread recording them
+    const VkCommandPoolCreateInfo recordPoolCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = mQueueFamilyIndex,
+    };
+    mRecordPools.resize(mInflight * mJobSystem.getThreadCount());
+    for (auto& recordPool : mRecordPools) {
+        ASSERT(mVk.CreateCommandPool(mDevice, &recordPoolCreateInfo, nullptr,
+                                     &recordPool.commandPool) == VK_SUCCESS);
+    }
+
+    if (mAsyncPost) {
+        const VkCommandPoolCreateInfo postPoolCreateInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+                         VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                .queueFamilyIndex = mComputeQueueFamilyIndex,
+        };
+        ASSERT(mVk.CreateCommandPool(mDevice, &postPoolCreateInfo, nullptr, &mPostCommandPool) ==
+               VK_SUCCESS);
+        mPostCommandBuffers.resize(mInflight, VK_NULL_HANDLE);
+        const VkCommandBufferAllocateInfo postBufferAllocateInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .commandPool = mPostCommandPool,
+                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = mInflight,
+        };
+        ASSERT(mVk.AllocateCommandBuffers(mDevice, &postBufferAllocateInfo,
+                                          mPostCommandBuffers.data()) == VK_SUCCESS);
+    }
+
+    ALOGD("Successfully created command buffers");
+}
+
+void Renderer::createSemaphore(VkSemaphore* outSemaphore) {
+    const VkSemaphoreCreateInfo semaphoreCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+    };
+    ASSERT(mVk.CreateSemaphore(mDevice, &semaphoreCreateInfo, nullptr, outSemaphore) == VK_SUCCESS);
+}
+
+void Renderer::createSemaphores() {
+    mAcquireSemaphores.resize(mInflight, VK_NULL_HANDLE);
+    mRenderSemaphores.resize(mInflight, VK_NULL_HANDLE);
+    for (uint32_t i = 0; i < mInflight; i++) {
+        createSemaphore(&mAcquireSemaphores[i]);
+        createSemaphore(&mRenderSemaphores[i]);
+    }
+
+    ALOGD("Successfully created semaphores");
+}
+
+void Renderer::createFrameTimeline() {
+    if (!mTimelineSemaphoreEnabled) {
+        ALOGD("Timeline semaphores are not supported, frames are tracked with fences");
+        return;
+    }
+
+    // Picks up the serials where the previous device left them, so they stay monotonic
+    const VkSemaphoreTypeCreateInfoKHR semaphoreTypeCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR,
+            .pNext = nullptr,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+            .initialValue = mSubmittedSerial,
+    };
+    const VkSemaphoreCreateInfo semaphoreCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = &semaphoreTypeCreateInfo,
+            .flags = 0,
+    };
+    ASSERT(mVk.CreateSemaphore(mDevice, &semaphoreCreateInfo, nullptr, &mFrameTimeline) ==
+           VK_SUCCESS);
+    mCompletedSerial = mSubmittedSerial;
+
+    ALOGD("Successfully created frame timeline");
+}
+
+void Renderer::createFences() {
+    mFrameSerials.assign(mInflight, 0);
+    if (mFrameTimeline != VK_NULL_HANDLE) {
+        return;
+    }
+
+    mInflightFences.resize(mInflight, VK_NULL_HANDLE);
+    const VkFenceCreateInfo fenceCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+    };
+    for (uint32_t i = 0; i < mInflight; i++) {
+        ASSERT(mVk.CreateFence(mDevice, &fenceCreateInfo, nullptr, &mInflightFences[i]) ==
+               VK_SUCCESS);
+    }
+
+    ALOGD("Successfully created fences");
+}
+
+void Renderer::createQueryPool() {
+    mTimestampsPending.resize(mInflight, false);
+    mPresentRecords.resize(kPresentRecordCount, {.presentId = 0, .startNanos = 0});
+
+    if (mTimestampMask == 0) {
+        ALOGD("GPU timestamps are not supported on this queue");
+        return;
+    }
+
+    const VkQueryPoolCreateInfo queryPoolCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = mInflight * kTimestampsPerFrame,
+            .pipelineStatistics = 0,
+    };
+    ASSERT(mVk.CreateQueryPool(mDevice, &queryPoolCreateInfo, nullptr, &mTimestampQueryPool) ==
+           VK_SUCCESS);
+
+    ALOGD("Successfully created query pool");
+}
+
+void Renderer::createFrameResources() {
+    createCommandBuffers();
+    createSemaphores();
+    createFences();
+    createQueryPool();
+    startFramePipeline();
+}
+
+void Renderer::destroyFrameResources() {
+    stopFramePipeline();
+    mVk.DestroyQueryPool(mDevice, mTimestampQueryPool, nullptr);
+    mTimestampQueryPool = VK_NULL_HANDLE;
+    mTimestampsPending.clear();
+
+    for (auto& fence : mInflightFences) {
+        mVk.DestroyFence(mDevice, fence, nullptr);
+    }
+    mInflightFences.clear();
+    mFrameSerials.clear();
+    for (auto& semaphore : mAcquireSemaphores) {
+        mVk.DestroySemaphore(mDevice, semaphore, nullptr);
+    }
+    mAcquireSemaphores.clear();
+    for (auto& semaphore : mRenderSemaphores) {
+        mVk.DestroySemaphore(mDevice, semaphore, nullptr);
+    }
+    mRenderSemaphores.clear();
 
-    void* data;
-    ASSERT(mVk.MapMemory(mDevice, mVertexMemory, 0, sizeof(vertexData), 0, &data) == VK_SUCCESS);
+    if (!mCommandBuffers.empty()) {
+        mVk.FreeCommandBuffers(mDevice, mCommandPool, mCommandBuffers.size(),
+                               mCommandBuffers.data());
+    }
+    mCommandBuffers.clear();
+    if (!mReusedCommandBuffers.empty()) {
+        mVk.FreeCommandBuffers(mDevice, mCommandPool, mReusedCommandBuffers.size(),
+                               mReusedCommandBuffers.data());
+    }
+    mReusedCommandBuffers.clear();
+    mReusedCommandBufferGenerations.clear();
+    mVk.DestroyCommandPool(mDevice, mCommandPool, nullptr);
+    mCommandPool = VK_NULL_HANDLE;
+    // Also frees the secondary command buffers
+    for (auto& recordPool : mRecordPools) {
+        mVk.DestroyCommandPool(mDevice, recordPool.commandPool, nullptr);
+    }
+    mRecordPools.clear();
+    mSecondaryCommandBuffers.clear();
+    // Also frees the post command buffers
+    mVk.DestroyCommandPool(mDevice, mPostCommandPool, nullptr);
+    mPostCommandPool = VK_NULL_HANDLE;
+    mPostCommandBuffers.clear();
+}
 
-    memcpy(data, vertexData, sizeof(vertexData));
-    mVk.UnmapMemory(mDevice, mVertexMemory);
+void Renderer::startFramePipeline() {
+    ASSERT(!mUpdateThread.joinable() && !mSubmitThread.joinable());
+    mSceneFrames.resize(mInflight);
+    mFreeScenes.reset(mInflight);
+    mBuiltScenes.reset(mInflight);
+    for (uint32_t i = 0; i < mInflight; i++) {
+        ASSERT(mFreeScenes.push(i));
+    }
+    mSubmissions.reset(mInflight);
+    mUpdateThread = std::thread(&Renderer::updateThreadMain, this);
+    mSubmitThread = std::thread(&Renderer::submitThreadMain, this);
 
-    ASSERT(mVk.BindBufferMemory(mDevice, mVertexBuffer, mVertexMemory, 0) == VK_SUCCESS);
+    ALOGD("Successfully started frame pipeline: %u frames deep", mInflight);
+}
 
-    ALOGD("Successfully created vertex buffer");
+void Renderer::stopFramePipeline() {
+    if (!mUpdateThread.joinable()) {
+        return;
+    }
+    mFreeScenes.close();
+    mBuiltScenes.close();
+    mSubmissions.close();
+    mUpdateThread.join();
+    mSubmitThread.join();
+    mSceneFrames.clear();
 }
 
-void Renderer::createCommandBuffers() {
-    const VkCommandPoolCreateInfo commandPoolCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-            .pNext = nullptr,
-            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-            .queueFamilyIndex = mQueueFamilyIndex,
-    };
-    ASSERT(mVk.CreateCommandPool(mDevice, &commandPoolCreateInfo, nullptr, &mCommandPool) ==
-           VK_SUCCESS);
+void Renderer::applyLatencyMode() {
+    ALOGD("%s[%u] - latency mode %u -> %u", __FUNCTION__, mFrameCount,
+          static_cast<uint32_t>(mLatencyMode), static_cast<uint32_t>(mPendingLatencyMode));
+
+    // Drain all frames in flight, so that the per frame resources can be resized safely. Pending
+    // presents may still wait on the frame semaphores or hold retired swapchains, and nothing but
+    // an idle device tells when the presentation engine is done with them.
+    waitFrameSubmissions();
+    mVk.DeviceWaitIdle(mDevice);
+    mCompletedSerial = mSubmittedSerial;
+    for (uint32_t i = 0; i < mInflight; i++) {
+        collectGpuTimestamps(i);
+    }
+    destroyFrameResources();
 
-    mCommandBuffers.resize(kInflight, VK_NULL_HANDLE);
-    const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .pNext = nullptr,
-            .commandPool = mCommandPool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = kInflight,
-    };
-    ASSERT(mVk.AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo,
-                                      mCommandBuffers.data()) == VK_SUCCESS);
+    mLatencyMode = mPendingLatencyMode;
+    mInflight = getLatencyConfig(mLatencyMode).inflight;
+    ASSERT(mInflight <= kMaxInflight);
+    createFrameResources();
 
-    ALOGD("Successfully created command buffers");
+    // All the frames are drained, so every swapchain still retiring can go away right away
+    destroyRetiredSwapchains(true);
+    recreateSwapchain();
 }
 
-void Renderer::createSemaphore(VkSemaphore* outSemaphore) {
-    const VkSemaphoreCreateInfo semaphoreCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-            .pNext = nullptr,
-            .flags = 0,
-    };
-    ASSERT(mVk.CreateSemaphore(mDevice, &semaphoreCreateInfo, nullptr, outSemaphore) == VK_SUCCESS);
-}
+bool Renderer::isFrameSerialComplete(uint64_t serial) {
+    if (serial <= mCompletedSerial) {
+        return true;
+    }
 
-void Renderer::createSemaphores() {
-    mAcquireSemaphores.resize(kInflight, VK_NULL_HANDLE);
-    mRenderSemaphores.resize(kInflight, VK_NULL_HANDLE);
-    for (int i = 0; i < kInflight; i++) {
-        createSemaphore(&mAcquireSemaphores[i]);
-        createSemaphore(&mRenderSemaphores[i]);
+    if (mFrameTimeline != VK_NULL_HANDLE) {
+        ASSERT(mVk.GetSemaphoreCounterValueKHR(mDevice, mFrameTimeline, &mCompletedSerial) ==
+               VK_SUCCESS);
+        return serial <= mCompletedSerial;
     }
 
-    ALOGD("Successfully created semaphores");
+    // Fences signal in submission order on the one queue, so the latest signaled one completes
+    // every serial before it as well. The fence of a frame the submit thread is still to submit
+    // must not be touched, vkQueueSubmit needs it externally synchronized.
+    const uint64_t submitThreadSerial = mSubmitThreadSerial.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < mInflight; i++) {
+        if (mFrameSerials[i] > mCompletedSerial && mFrameSerials[i] <= submitThreadSerial &&
+            mVk.GetFenceStatus(mDevice, mInflightFences[i]) == VK_SUCCESS) {
+            mCompletedSerial = mFrameSerials[i];
+        }
+    }
+    return serial <= mCompletedSerial;
 }
 
-void Renderer::createFences() {
-    mInflightFences.resize(kInflight, VK_NULL_HANDLE);
-    const VkFenceCreateInfo fenceCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            .pNext = nullptr,
-            .flags = VK_FENCE_CREATE_SIGNALED_BIT,
-    };
-    for (int i = 0; i < kInflight; i++) {
-        ASSERT(mVk.CreateFence(mDevice, &fenceCreateInfo, nullptr, &mInflightFences[i]) ==
-               VK_SUCCESS);
+void Renderer::waitFrameSerial(uint64_t serial) {
+    if (serial <= mCompletedSerial) {
+        return;
     }
 
-    ALOGD("Successfully created fences");
+    if (mFrameTimeline != VK_NULL_HANDLE) {
+        const VkSemaphoreWaitInfoKHR semaphoreWaitInfo = {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR,
+                .pNext = nullptr,
+                .flags = 0,
+                .semaphoreCount = 1,
+                .pSemaphores = &mFrameTimeline,
+                .pValues = &serial,
+        };
+        ASSERT(mVk.WaitSemaphoresKHR(mDevice, &semaphoreWaitInfo, kTimeout30Sec) == VK_SUCCESS);
+        mCompletedSerial = serial;
+        return;
+    }
+
+    // Wait for the earliest frame whose fence covers the serial
+    uint32_t waitIndex = mInflight;
+    for (uint32_t i = 0; i < mInflight; i++) {
+        if (mFrameSerials[i] >= serial &&
+            (waitIndex == mInflight || mFrameSerials[i] < mFrameSerials[waitIndex])) {
+            waitIndex = i;
+        }
+    }
+    ASSERT(waitIndex < mInflight);
+
+    // Frames handed over later than the awaited one each use another frame index, as reusing one
+    // waits for its previous serial first. Letting only those stay pending therefore makes sure
+    // the submit thread is done with the awaited frame and its fence.
+    if (mFrameSerials[waitIndex] > mSubmitThreadSerial.load(std::memory_order_acquire)) {
+        uint32_t laterCount = 0;
+        for (uint32_t i = 0; i < mInflight; i++) {
+            laterCount += mFrameSerials[i] > mFrameSerials[waitIndex] ? 1 : 0;
+        }
+        mSubmissions.waitPending(laterCount);
+    }
+    ASSERT(mVk.WaitForFences(mDevice, 1, &mInflightFences[waitIndex], VK_TRUE, kTimeout30Sec) ==
+           VK_SUCCESS);
+    mCompletedSerial = mFrameSerials[waitIndex];
 }
 
 void Renderer::createFramebuffer(uint32_t index) {
+    // The post stage writes the image through a storage view of the offscreen target instead
+    if (mComputePost) {
+        return;
+    }
+
     const VkImageViewCreateInfo imageViewCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
             .pNext = nullptr,
@@ -1244,13 +3354,21 @@ void Renderer::createFramebuffer(uint32_t index) {
     ASSERT(mVk.CreateImageView(mDevice, &imageViewCreateInfo, nullptr, &mImageViews[index]) ==
            VK_SUCCESS);
 
+    // With offscreen rendering the swapchain images are only written by the upscale pass
+    VkImageView attachments[kMaxSceneAttachmentCount];
+    uint32_t attachmentCount = 1;
+    if (mOffscreenRendering) {
+        attachments[0] = mImageViews[index];
+    } else {
+        attachmentCount = getSceneAttachments(mImageViews[index], attachments);
+    }
     const VkFramebufferCreateInfo framebufferCreateInfo = {
             .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
             .pNext = nullptr,
             .flags = 0,
-            .renderPass = mRenderPass,
-            .attachmentCount = 1,
-            .pAttachments = &mImageViews[index],
+            .renderPass = mOffscreenRendering ? mUpscaleRenderPass : mRenderPass,
+            .attachmentCount = attachmentCount,
+            .pAttachments = attachments,
             .width = mImageWidth,
             .height = mImageHeight,
             .layers = 1,
@@ -1261,27 +3379,90 @@ void Renderer::createFramebuffer(uint32_t index) {
     ALOGD("Successfully created framebuffer[%u]", index);
 }
 
-void Renderer::recordCommandBuffer(uint32_t frameIndex, uint32_t imageIndex) {
+void Renderer::createFramebuffersAsync() {
+    ASSERT(!mFramebufferThread.joinable());
+    mFramebufferThread = std::thread([this]() {
+        for (uint32_t i = 0; i < mFramebuffers.size(); i++) {
+            createFramebuffer(i);
+        }
+    });
+}
+
+void Renderer::waitFramebuffers() {
+    if (mFramebufferThread.joinable()) {
+        mFramebufferThread.join();
+    }
+}
+
+void Renderer::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t frameIndex,
+                                   uint32_t imageIndex, VkCommandBufferUsageFlags usage,
+                                   bool allowSecondary) {
     const VkCommandBufferBeginInfo commandBufferBeginInfo = {
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
             .pNext = nullptr,
-            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            .flags = usage,
             .pInheritanceInfo = nullptr,
     };
-    ASSERT(mVk.BeginCommandBuffer(mCommandBuffers[frameIndex], &commandBufferBeginInfo) ==
-           VK_SUCCESS);
+    ASSERT(mVk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo) == VK_SUCCESS);
+
+    const uint32_t firstQuery = frameIndex * kTimestampsPerFrame;
+    if (mTimestampQueryPool != VK_NULL_HANDLE) {
+        mVk.CmdResetQueryPool(commandBuffer, mTimestampQueryPool, firstQuery, kTimestampsPerFrame);
+        mVk.CmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                              mTimestampQueryPool, firstQuery);
+    }
 
+    if (mOffscreenRendering) {
+        recordScenePass(commandBuffer, frameIndex, mOffscreenTarget.framebuffer,
+                        getOffscreenExtent(), allowSecondary);
+        // An async post stage is recorded into a command buffer of its own
+        if (!mComputePost) {
+            recordUpscalePass(commandBuffer, imageIndex);
+        } else if (!mAsyncPost) {
+            recordPostDispatch(commandBuffer, imageIndex);
+        }
+    } else {
+        const VkExtent2D extent = {
+                .width = mImageWidth,
+                .height = mImageHeight,
+        };
+        recordScenePass(commandBuffer, frameIndex, mFramebuffers[imageIndex], extent,
+                        allowSecondary);
+    }
+
+    if (mTimestampQueryPool != VK_NULL_HANDLE) {
+        mVk.CmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                              mTimestampQueryPool, firstQuery + 1);
+    }
+
+    ASSERT(mVk.EndCommandBuffer(commandBuffer) == VK_SUCCESS);
+}
+
+void Renderer::recordScenePass(VkCommandBuffer commandBuffer, uint32_t frameIndex,
+                               VkFramebuffer framebuffer, const VkExtent2D& extent,
+                               bool allowSecondary) {
     const VkClearValue clearVals = {
             .color.float32[0] = 0.5F,
             .color.float32[1] = 0.5F,
             .color.float32[2] = 0.5F,
             .color.float32[3] = 1.0F,
     };
+    // Indexed by attachment, the resolve attachment's value is ignored
+    VkClearValue clearValues[kMaxSceneAttachmentCount] = {clearVals, clearVals, clearVals};
+    if (mDepthBuffer) {
+        clearValues[mSceneAttachmentCount - 1] = {
+                .depthStencil =
+                        {
+                                .depth = 1.0F,
+                                .stencil = 0,
+                        },
+        };
+    }
     const VkRenderPassBeginInfo renderPassBeginInfo = {
             .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
             .pNext = nullptr,
             .renderPass = mRenderPass,
-            .framebuffer = mFramebuffers[imageIndex],
+            .framebuffer = framebuffer,
             .renderArea =
                     {
                             .offset =
@@ -1289,29 +3470,136 @@ void Renderer::recordCommandBuffer(uint32_t frameIndex, uint32_t imageIndex) {
                                             .x = 0,
                                             .y = 0,
                                     },
-                            .extent =
-                                    {
-                                            .width = mImageWidth,
-                                            .height = mImageHeight,
-                                    },
+                            .extent = extent,
                     },
-            .clearValueCount = 1,
-            .pClearValues = &clearVals,
+            .clearValueCount = mSceneAttachmentCount,
+            .pClearValues = clearValues,
     };
-    mVk.CmdBeginRenderPass(mCommandBuffers[frameIndex], &renderPassBeginInfo,
-                           VK_SUBPASS_CONTENTS_INLINE);
 
+    // Only worth the fork and join with enough instances for every job, a draw may well be split
+    // across jobs. Reused command buffers are recorded inline, as the per frame pools of the
+    // secondary ones are reset every frame.
+    const uint32_t instanceCount = mQuadBatch.getInstanceCount(frameIndex);
+    const uint32_t jobCount = allowSecondary ? std::min(mJobSystem.getThreadCount(),
+                                                        instanceCount / kMinInstancesPerRecordJob)
+                                             : 0;
+    if (jobCount > 1) {
+        recordSecondaryCommandBuffers(frameIndex, framebuffer, extent, jobCount);
+        mVk.CmdBeginRenderPass(commandBuffer, &renderPassBeginInfo,
+                               VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        mVk.CmdExecuteCommands(commandBuffer, jobCount, mSecondaryCommandBuffers.data());
+    } else {
+        mVk.CmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+        recordScene(commandBuffer, frameIndex, extent, 0, instanceCount);
+    }
+
+    mVk.CmdEndRenderPass(commandBuffer);
+}
+
+void Renderer::recordScene(VkCommandBuffer commandBuffer, uint32_t frameIndex,
+                           const VkExtent2D& extent, uint32_t firstInstance,
+                           uint32_t instanceCount) {
     const VkViewport viewport = {
             .x = 0.0F,
             .y = 0.0F,
-            .width = (float)mImageWidth,
-            .height = (float)mImageHeight,
+            .width = (float)extent.width,
+            .height = (float)extent.height,
             .minDepth = 0.0F,
             .maxDepth = 1.0F,
     };
-    mVk.CmdSetViewport(mCommandBuffers[frameIndex], 0, 1, &viewport);
+    mVk.CmdSetViewport(commandBuffer, 0, 1, &viewport);
 
     const VkRect2D scissor = {
+            .offset =
+                    {
+                            .x = 0,
+                            .y = 0,
+                    },
+            .extent = extent,
+    };
+    mVk.CmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    // The pre-rotation is either folded into the mvp or baked into the pipeline variant
+    mVk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                        mPipelines[mSpecializedPreRotation ? mPreRotation : 0]);
+
+    // The uniforms written by writeSceneUniforms for this frame
+    const VkDescriptorSet* textureSets = &mDescriptorSets[frameIndex * mTextureSetCount];
+    const VkDescriptorSet descriptorSets[2] = {textureSets[0], mSceneUniformSet};
+    mVk.CmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mPipelineLayout, 0,
+                              2, descriptorSets, 1, &mSceneUniformOffsets[frameIndex]);
+
+    const VkDeviceSize offset = 0;
+    mVk.CmdBindVertexBuffers(commandBuffer, 0, 1, &mVertexBuffer, &offset);
+
+    // Without a table to index, each draw binds the set of its texture
+    mQuadBatch.recordDraws(commandBuffer, frameIndex, firstInstance, instanceCount, mPipelineLayout,
+                           mDynamicIndexingEnabled ? nullptr : textureSets);
+}
+
+void Renderer::recordSecondaryCommandBuffers(uint32_t frameIndex, VkFramebuffer framebuffer,
+                                             const VkExtent2D& extent, uint32_t jobCount) {
+    // The serial of frameIndex has been waited, so none of its secondary command buffers is
+    // pending anymore
+    const uint32_t threadCount = mJobSystem.getThreadCount();
+    for (uint32_t i = 0; i < threadCount; i++) {
+        RecordPool& recordPool = mRecordPools[frameIndex * threadCount + i];
+        if (recordPool.usedCount) {
+            ASSERT(mVk.ResetCommandPool(mDevice, recordPool.commandPool, 0) == VK_SUCCESS);
+            recordPool.usedCount = 0;
+        }
+    }
+
+    const VkCommandBufferInheritanceInfo inheritanceInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+            .pNext = nullptr,
+            .renderPass = mRenderPass,
+            .subpass = 0,
+            .framebuffer = framebuffer,
+            .occlusionQueryEnable = VK_FALSE,
+            .queryFlags = 0,
+            .pipelineStatistics = 0,
+    };
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                     VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+            .pInheritanceInfo = &inheritanceInfo,
+    };
+
+    // Contiguous instance ranges, executed in job order so the quads keep their order
+    const uint32_t instanceCount = mQuadBatch.getInstanceCount(frameIndex);
+    const uint32_t instancesPerJob = (instanceCount + jobCount - 1) / jobCount;
+    mSecondaryCommandBuffers.resize(jobCount, VK_NULL_HANDLE);
+    mJobSystem.run(jobCount, [&](uint32_t jobIndex, uint32_t threadIndex) {
+        // Only touched by this thread while the jobs run
+        RecordPool& recordPool = mRecordPools[frameIndex * threadCount + threadIndex];
+        if (recordPool.usedCount == recordPool.commandBuffers.size()) {
+            const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                    .pNext = nullptr,
+                    .commandPool = recordPool.commandPool,
+                    .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                    .commandBufferCount = 1,
+            };
+            VkCommandBuffer newCommandBuffer = VK_NULL_HANDLE;
+            ASSERT(mVk.AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo,
+                                              &newCommandBuffer) == VK_SUCCESS);
+            recordPool.commandBuffers.push_back(newCommandBuffer);
+        }
+        const VkCommandBuffer commandBuffer = recordPool.commandBuffers[recordPool.usedCount++];
+
+        ASSERT(mVk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo) == VK_SUCCESS);
+        recordScene(commandBuffer, frameIndex, extent, jobIndex * instancesPerJob,
+                    instancesPerJob);
+        ASSERT(mVk.EndCommandBuffer(commandBuffer) == VK_SUCCESS);
+        mSecondaryCommandBuffers[jobIndex] = commandBuffer;
+    });
+}
+
+void Renderer::recordUpscalePass(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+    const VkRect2D renderArea = {
             .offset =
                     {
                             .x = 0,
@@ -1323,91 +3611,414 @@ void Renderer::recordCommandBuffer(uint32_t frameIndex, uint32_t imageIndex) {
                             .height = mImageHeight,
                     },
     };
-    mVk.CmdSetScissor(mCommandBuffers[frameIndex], 0, 1, &scissor);
+    const VkRenderPassBeginInfo renderPassBeginInfo = {
+            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+            .pNext = nullptr,
+            .renderPass = mUpscaleRenderPass,
+            .framebuffer = mFramebuffers[imageIndex],
+            .renderArea = renderArea,
+            .clearValueCount = 0,
+            .pClearValues = nullptr,
+    };
+    mVk.CmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-    // Calculate the simple mvp for this demo
-    const float scaleW = mSurfaceWidth / (float)mTextures[0].width;
-    const float scaleH = mSurfaceHeight / (float)mTextures[0].height;
-    const float minimalScale = scaleW < scaleH ? scaleW : scaleH;
-    const float scaleX = minimalScale / scaleW;
-    const float scaleY = minimalScale / scaleH;
-    const glm::mat4 mvp = glm::scale(glm::mat4(1.0F), glm::vec3(scaleX, scaleY, 1.0F));
+    const VkViewport viewport = {
+            .x = 0.0F,
+            .y = 0.0F,
+            .width = (float)mImageWidth,
+            .height = (float)mImageHeight,
+            .minDepth = 0.0F,
+            .maxDepth = 1.0F,
+    };
+    mVk.CmdSetViewport(commandBuffer, 0, 1, &viewport);
+    mVk.CmdSetScissor(commandBuffer, 0, 1, &renderArea);
+
+    // The scene covers the top left extent of the target, sampled up to half a texel inside it
+    const VkExtent2D extent = getOffscreenExtent();
+    const UpscalePushConstantBlock pushConstantBlock = {
+            .uvScale = {extent.width / (float)mImageWidth, extent.height / (float)mImageHeight},
+            .uvMax = {(extent.width - 0.5F) / mImageWidth, (extent.height - 0.5F) / mImageHeight},
+    };
+    mVk.CmdPushConstants(commandBuffer, mUpscalePipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+                         sizeof(UpscalePushConstantBlock), &pushConstantBlock);
+    mVk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mUpscalePipeline);
+    mVk.CmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              mUpscalePipelineLayout, 0, 1, &mOffscreenTarget.descriptorSet, 0,
+                              nullptr);
+    mVk.CmdDraw(commandBuffer, 3, 1, 0, 0);
+
+    mVk.CmdEndRenderPass(commandBuffer);
+}
 
-    // Generate the simple 2x2 rotation matrix for fixing pre-rotation in the clipping space
-    float radians = 0.0F;
-    switch (mPreTransform) {
-        case VK_SURFACE_TRANSFORM_ROTATE_90_BIT_KHR:
-            radians = glm::radians(90.0F);
-            break;
-        case VK_SURFACE_TRANSFORM_ROTATE_180_BIT_KHR:
-            radians = glm::radians(180.0F);
-            break;
-        case VK_SURFACE_TRANSFORM_ROTATE_270_BIT_KHR:
-            radians = glm::radians(270.0F);
-            break;
-        default:
-            break;
-    }
-    const glm::mat2 preRotate = glm::rotate(glm::mat4(1.0), radians, glm::vec3(0.0F, 0.0F, 1.0F));
+void Renderer::recordPostDispatch(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+    // Nothing reads the previous contents. The source stage chains the transition after the
+    // acquire semaphore, which is waited for at COMPUTE_SHADER.
+    VkImageMemoryBarrier imageMemoryBarrier = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = mImages[imageIndex],
+            .subresourceRange =
+                    {
+                            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                            .baseMipLevel = 0,
+                            .levelCount = 1,
+                            .baseArrayLayer = 0,
+                            .layerCount = 1,
+                    },
+    };
+    mVk.CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                           &imageMemoryBarrier);
 
-    // We can do the preRotate * mvp here, but separate to be explicit in this demo
-    const PushConstantBlock pushConstantBlock = {
-            .mvp = mvp,
-            .preRotate = preRotate,
+    // Same coordinates as the upscale pass, the swapchain image and the target have the same size
+    const VkExtent2D extent = getOffscreenExtent();
+    const PostPushConstantBlock pushConstantBlock = {
+            .uvScale = {extent.width / (float)mImageWidth, extent.height / (float)mImageHeight},
+            .uvMax = {(extent.width - 0.5F) / mImageWidth, (extent.height - 0.5F) / mImageHeight},
+            .texelSize = {1.0F / mImageWidth, 1.0F / mImageHeight},
+            .sharpness = kPostSharpness,
+            .saturation = kPostSaturation,
+            .contrast = kPostContrast,
     };
-    mVk.CmdPushConstants(mCommandBuffers[frameIndex], mPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
-                         0, sizeof(PushConstantBlock), &pushConstantBlock);
+    mVk.CmdPushConstants(commandBuffer, mPostPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                         sizeof(PostPushConstantBlock), &pushConstantBlock);
+    mVk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mPostPipeline);
+    mVk.CmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mPostPipelineLayout,
+                              0, 1, &mOffscreenTarget.postDescriptorSets[imageIndex], 0, nullptr);
+    mVk.CmdDispatch(commandBuffer, (mImageWidth + kPostGroupSize - 1) / kPostGroupSize,
+                    (mImageHeight + kPostGroupSize - 1) / kPostGroupSize, 1);
+
+    // The present semaphore signal waits for every stage
+    imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    imageMemoryBarrier.dstAccessMask = 0;
+    imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    mVk.CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                           &imageMemoryBarrier);
+}
+
+void Renderer::submitThreadMain() {
+    FrameSubmission submission;
+    while (mSubmissions.pop(&submission)) {
+        submitFrame(submission);
+        mSubmissions.finish();
+    }
+}
 
-    mVk.CmdBindPipeline(mCommandBuffers[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS, mPipeline);
+void Renderer::submitFrame(const FrameSubmission& submission) {
+    const uint32_t frameIndex = submission.frameIndex;
+    const int64_t submitStartNanos = nowNanos();
+    if (mAsyncPost) {
+        submitAsyncPost(frameIndex, submission.commandBuffer, submission.postCommandBuffer,
+                        submission.serial);
+    } else {
+        // Streamed textures from the transfer queue are either acquired by an earlier submit on
+        // this queue or only handed out once their fence signaled, so no wait is needed for them.
+        // The binary acquire and render semaphores are only kept for the swapchain, their values
+        // are ignored. A compute post stage is the first to touch the swapchain image, so only it
+        // waits for it.
+        const bool signalTimeline = mFrameTimeline != VK_NULL_HANDLE;
+        const VkPipelineStageFlags waitStageMask = mComputePost
+                ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        const uint64_t waitValue = 0;
+        const VkSemaphore signalSemaphores[2] = {mRenderSemaphores[frameIndex], mFrameTimeline};
+        const uint64_t signalValues[2] = {0, submission.serial};
+        const VkTimelineSemaphoreSubmitInfoKHR timelineSubmitInfo = {
+                .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+                .pNext = nullptr,
+                .waitSemaphoreValueCount = 1,
+                .pWaitSemaphoreValues = &waitValue,
+                .signalSemaphoreValueCount = 2,
+                .pSignalSemaphoreValues = signalValues,
+        };
+        const VkSubmitInfo submitInfo = {
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                .pNext = signalTimeline ? &timelineSubmitInfo : nullptr,
+                .waitSemaphoreCount = 1,
+                .pWaitSemaphores = &mAcquireSemaphores[frameIndex],
+                .pWaitDstStageMask = &waitStageMask,
+                .commandBufferCount = 1,
+                .pCommandBuffers = &submission.commandBuffer,
+                .signalSemaphoreCount = signalTimeline ? 2U : 1U,
+                .pSignalSemaphores = signalSemaphores,
+        };
+        const VkFence fence = signalTimeline ? VK_NULL_HANDLE : mInflightFences[frameIndex];
+        std::lock_guard<std::mutex> lock(mQueueLock);
+        ASSERT(mVk.QueueSubmit(mQueue, 1, &submitInfo, fence) == VK_SUCCESS);
+    }
+    // The render thread may poll or wait on the frame's fence from now on
+    mSubmitThreadSerial.store(mAsyncPost ? submission.serial + 1 : submission.serial,
+                              std::memory_order_release);
+    const int64_t presentStartNanos = nowNanos();
+    mMetrics.record(FrameMetrics::SUBMIT, presentStartNanos - submitStartNanos);
+
+    // Leaving the desiredPresentTime as 0 means no pacing request is made to the presentation
+    // engine
+    const VkPresentTimeGOOGLE presentTime = {
+            .presentID = submission.presentId,
+            .desiredPresentTime = 0,
+    };
+    const VkPresentTimesInfoGOOGLE presentTimesInfo = {
+            .sType = VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE,
+            .pNext = nullptr,
+            .swapchainCount = 1,
+            .pTimes = &presentTime,
+    };
+    const VkPresentInfoKHR presentInfo = {
+            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+            .pNext = mDisplayTimingEnabled ? &presentTimesInfo : nullptr,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &mRenderSemaphores[frameIndex],
+            .swapchainCount = 1,
+            .pSwapchains = &mSwapchain,
+            .pImageIndices = &submission.imageIndex,
+            .pResults = nullptr,
+    };
+    VkResult ret;
+    {
+        std::lock_guard<std::mutex> swapchainLock(mSwapchainLock);
+        std::lock_guard<std::mutex> queueLock(mQueueLock);
+        ret = mVk.QueuePresentKHR(mQueue, &presentInfo);
+    }
+    const int64_t presentEndNanos = nowNanos();
+    mMetrics.record(FrameMetrics::PRESENT, presentEndNanos - presentStartNanos);
+
+    ASSERT(mPresentResults.push({
+            .result = ret,
+            .swapchainSerial = submission.swapchainSerial,
+            .frameStartNanos = submission.frameStartNanos,
+            .presentEndNanos = presentEndNanos,
+    }));
+}
 
-    mVk.CmdBindDescriptorSets(mCommandBuffers[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              mPipelineLayout, 0, 1, &mDescriptorSet, 0, nullptr);
+void Renderer::waitFrameSubmissions() {
+    mSubmissions.waitPending(0);
+    processPresentResults();
+}
 
-    const VkDeviceSize offset = 0;
-    mVk.CmdBindVertexBuffers(mCommandBuffers[frameIndex], 0, 1, &mVertexBuffer, &offset);
+void Renderer::processPresentResults() {
+    PresentResult result;
+    while (mPresentResults.pop(&result)) {
+        mMetrics.record(FrameMetrics::CPU_FRAME, result.presentEndNanos - result.frameStartNanos);
+        if (mTimeToFirstFrameNanos == 0) {
+            mTimeToFirstFrameNanos = result.presentEndNanos - mInitializeStartNanos;
+            ALOGD("Time to first frame = %lld us", (long long)mTimeToFirstFrameNanos / 1000);
+        }
+        if (mResumeStartNanos != 0) {
+            mMetrics.record(FrameMetrics::RESUME_LATENCY,
+                            result.presentEndNanos - mResumeStartNanos);
+            ALOGD("Resume to first frame = %lld us",
+                  (long long)(result.presentEndNanos - mResumeStartNanos) / 1000);
+            mResumeStartNanos = 0;
+        }
 
-    mVk.CmdDraw(mCommandBuffers[frameIndex], 4, 1, 0, 0);
+        if (result.result == VK_SUBOPTIMAL_KHR) {
+            // A frame presented to a swapchain replaced since has nothing left to report
+            mSwapchainOutdated |= result.swapchainSerial == mSwapchainSerial;
+            continue;
+        }
+        ASSERT(result.result == VK_SUCCESS);
+        // Only a present to a swapchain created for the new transform or size ends the rotation
+        if (mRotationStartNanos != 0 && result.swapchainSerial >= mRotationSwapchainSerial) {
+            mMetrics.record(FrameMetrics::ROTATION_LATENCY,
+                            result.presentEndNanos - mRotationStartNanos);
+            ALOGD("%s[%u] - rotation latency = %lld us", __FUNCTION__, mFrameCount,
+                  (long long)(result.presentEndNanos - mRotationStartNanos) / 1000);
+            mRotationStartNanos = 0;
+        }
+    }
+}
 
-    mVk.CmdEndRenderPass(mCommandBuffers[frameIndex]);
+void Renderer::submitAsyncPost(uint32_t frameIndex, VkCommandBuffer commandBuffer,
+                               VkCommandBuffer postCommandBuffer, uint64_t sceneSerial) {
+    // The scene overwrites the offscreen target the previous frame's post stage reads, the serial
+    // before. Waiting at COLOR_ATTACHMENT_OUTPUT still lets its vertex work overlap with it.
+    const uint64_t sceneWaitValue = sceneSerial - 1;
+    const VkPipelineStageFlags sceneWaitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    const VkTimelineSemaphoreSubmitInfoKHR sceneTimelineSubmitInfo = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+            .pNext = nullptr,
+            .waitSemaphoreValueCount = 1,
+            .pWaitSemaphoreValues = &sceneWaitValue,
+            .signalSemaphoreValueCount = 1,
+            .pSignalSemaphoreValues = &sceneSerial,
+    };
+    const VkSubmitInfo sceneSubmitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = &sceneTimelineSubmitInfo,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &mFrameTimeline,
+            .pWaitDstStageMask = &sceneWaitStageMask,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &commandBuffer,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &mFrameTimeline,
+    };
+    {
+        std::lock_guard<std::mutex> lock(mQueueLock);
+        ASSERT(mVk.QueueSubmit(mQueue, 1, &sceneSubmitInfo, VK_NULL_HANDLE) == VK_SUCCESS);
+    }
 
-    ASSERT(mVk.EndCommandBuffer(mCommandBuffers[frameIndex]) == VK_SUCCESS);
+    // The post stage waits for the swapchain image and the scene, and signals the frame's serial
+    // along with the present semaphore. The binary semaphore values are ignored.
+    const VkSemaphore waitSemaphores[2] = {mAcquireSemaphores[frameIndex], mFrameTimeline};
+    const uint64_t waitValues[2] = {0, sceneSerial};
+    const VkPipelineStageFlags waitStageMasks[2] = {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT};
+    const VkSemaphore signalSemaphores[2] = {mRenderSemaphores[frameIndex], mFrameTimeline};
+    const uint64_t signalValues[2] = {0, sceneSerial + 1};
+    const VkTimelineSemaphoreSubmitInfoKHR postTimelineSubmitInfo = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+            .pNext = nullptr,
+            .waitSemaphoreValueCount = 2,
+            .pWaitSemaphoreValues = waitValues,
+            .signalSemaphoreValueCount = 2,
+            .pSignalSemaphoreValues = signalValues,
+    };
+    const VkSubmitInfo postSubmitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = &postTimelineSubmitInfo,
+            .waitSemaphoreCount = 2,
+            .pWaitSemaphores = waitSemaphores,
+            .pWaitDstStageMask = waitStageMasks,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &postCommandBuffer,
+            .signalSemaphoreCount = 2,
+            .pSignalSemaphores = signalSemaphores,
+    };
+    ASSERT(mVk.QueueSubmit(mComputeQueue, 1, &postSubmitInfo, VK_NULL_HANDLE) == VK_SUCCESS);
 }
 
-void Renderer::destroyOldSwapchain() {
-    for (auto& framebuffer : mOldFramebuffers) {
-        mVk.DestroyFramebuffer(mDevice, framebuffer, nullptr);
+VkCommandBuffer Renderer::getCommandBuffer(uint32_t frameIndex, uint32_t imageIndex) {
+    if (!mReuseCommandBuffers) {
+        recordCommandBuffer(mCommandBuffers[frameIndex], frameIndex, imageIndex,
+                            VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, true);
+        return mCommandBuffers[frameIndex];
     }
-    mOldFramebuffers.clear();
 
-    for (auto& imageView : mOldImageViews) {
-        mVk.DestroyImageView(mDevice, imageView, nullptr);
+    // Image major indexing, so a swapchain with more images only appends new command buffers
+    const uint32_t index = imageIndex * mInflight + frameIndex;
+    if (index >= mReusedCommandBuffers.size()) {
+        const uint32_t oldCount = mReusedCommandBuffers.size();
+        const uint32_t newCount = (uint32_t)mImages.size() * mInflight;
+        ASSERT(index < newCount);
+
+        mReusedCommandBuffers.resize(newCount, VK_NULL_HANDLE);
+        mReusedCommandBufferGenerations.resize(newCount, 0);
+        const VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .commandPool = mCommandPool,
+                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = newCount - oldCount,
+        };
+        ASSERT(mVk.AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo,
+                                          mReusedCommandBuffers.data() + oldCount) == VK_SUCCESS);
     }
-    mOldImageViews.clear();
 
-    mOldImages.clear();
+    // The serial of frameIndex has been waited, so this command buffer is no longer pending and
+    // can be re-recorded. Without ONE_TIME_SUBMIT it stays executable for the next submits.
+    if (mReusedCommandBufferGenerations[index] != mCommandBufferGeneration) {
+        recordCommandBuffer(mReusedCommandBuffers[index], frameIndex, imageIndex, 0, false);
+        mReusedCommandBufferGenerations[index] = mCommandBufferGeneration;
+    }
+    return mReusedCommandBuffers[index];
+}
 
-    mVk.DestroySwapchainKHR(mDevice, mOldSwapchain, nullptr);
-    mOldSwapchain = VK_NULL_HANDLE;
+void Renderer::markCommandBuffersDirty() {
+    mCommandBufferGeneration++;
+}
 
-    ALOGD("Successfully destroyed old swapchain");
+void Renderer::destroyRetiredSwapchains(bool deviceIdle) {
+    while (!mRetiredSwapchains.empty() &&
+           (deviceIdle || isFrameSerialComplete(mRetiredSwapchains.front().retireSerial))) {
+        RetiredSwapchain& retired = mRetiredSwapchains.front();
+        for (auto& framebuffer : retired.framebuffers) {
+            mVk.DestroyFramebuffer(mDevice, framebuffer, nullptr);
+        }
+        for (auto& imageView : retired.imageViews) {
+            mVk.DestroyImageView(mDevice, imageView, nullptr);
+        }
+        destroyOffscreenTarget(&retired.offscreenTarget);
+        destroyAttachmentImage(&retired.colorAttachment);
+        destroyAttachmentImage(&retired.depthAttachment);
+        mVk.DestroySwapchainKHR(mDevice, retired.swapchain, nullptr);
+        mRetiredSwapchains.pop_front();
+
+        ALOGD("Successfully destroyed retired swapchain, %zu still retiring",
+              mRetiredSwapchains.size());
+    }
 }
 
-bool Renderer::is180Rotation() {
+bool Renderer::hasSurfaceTransformChanged() {
     VkSurfaceCapabilitiesKHR surfaceCapabilities;
     ASSERT(mVk.GetPhysicalDeviceSurfaceCapabilitiesKHR(mGpu, mSurface, &surfaceCapabilities) ==
            VK_SUCCESS);
-    VkSurfaceTransformFlagsKHR currentTransform = surfaceCapabilities.currentTransform;
-    switch (currentTransform) {
-        case VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR:
-            return mPreTransform == VK_SURFACE_TRANSFORM_ROTATE_180_BIT_KHR;
-        case VK_SURFACE_TRANSFORM_ROTATE_90_BIT_KHR:
-            return mPreTransform == VK_SURFACE_TRANSFORM_ROTATE_270_BIT_KHR;
-        case VK_SURFACE_TRANSFORM_ROTATE_180_BIT_KHR:
-            return mPreTransform == VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
-        case VK_SURFACE_TRANSFORM_ROTATE_270_BIT_KHR:
-            return mPreTransform == VK_SURFACE_TRANSFORM_ROTATE_90_BIT_KHR;
-        default:
-            break;
+    return surfaceCapabilities.currentTransform != mPreTransform;
+}
+
+void Renderer::collectGpuTimestamps(uint32_t frameIndex) {
+    if (!mTimestampsPending[frameIndex]) {
+        return;
+    }
+    mTimestampsPending[frameIndex] = false;
+
+    uint64_t timestamps[kTimestampsPerFrame];
+    if (mVk.GetQueryPoolResults(mDevice, mTimestampQueryPool, frameIndex * kTimestampsPerFrame,
+                                kTimestampsPerFrame, sizeof(timestamps), timestamps,
+                                sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+        return;
+    }
+
+    // Timestamps only have timestampValidBits, so mask the delta to survive a wrap around
+    const uint64_t ticks = (timestamps[1] - timestamps[0]) & mTimestampMask;
+    mMetrics.record(FrameMetrics::GPU_RENDER_PASS, (int64_t)((double)ticks * mTimestampPeriod));
+}
+
+void Renderer::collectPresentationTimings() {
+    std::lock_guard<std::mutex> lock(mSwapchainLock);
+    uint32_t timingCount = 0;
+    if (mVk.GetPastPresentationTimingGOOGLE(mDevice, mSwapchain, &timingCount, nullptr) !=
+                VK_SUCCESS ||
+        timingCount == 0) {
+        return;
+    }
+
+    std::vector<VkPastPresentationTimingGOOGLE> timings(timingCount);
+    if (mVk.GetPastPresentationTimingGOOGLE(mDevice, mSwapchain, &timingCount, timings.data()) <
+        VK_SUCCESS) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < timingCount; i++) {
+        const PresentRecord& record =
+                mPresentRecords[timings[i].presentID % kPresentRecordCount];
+        // Skip the ones that have been overwritten by a newer present
+        if (record.presentId != timings[i].presentID) {
+            continue;
+        }
+        mMetrics.record(FrameMetrics::PRESENT_LATENCY,
+                        (int64_t)timings[i].actualPresentTime - record.startNanos);
+    }
+}
+
+void Renderer::logFrameMetrics() {
+    for (uint32_t stage = 0; stage < FrameMetrics::STAGE_COUNT; stage++) {
+        const auto summary = mMetrics.getSummary((FrameMetrics::Stage)stage);
+        if (summary.count == 0) {
+            continue;
+        }
+        ALOGD("%16s(us): p50[%lld] p95[%lld] p99[%lld] max[%lld]",
+              FrameMetrics::getStageName((FrameMetrics::Stage)stage),
+              (long long)summary.p50 / 1000, (long long)summary.p95 / 1000,
+              (long long)summary.p99 / 1000, (long long)summary.max / 1000);
     }
-    return false;
 }
@@ -18,72 +18,430 @@
 
 #include <android_native_app_glue.h>
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "CommandQueue.h"
+#include "FrameMetrics.h"
+#include "JobSystem.h"
+#include "MemoryAllocator.h"
+#include "QuadBatch.h"
+#include "StageQueue.h"
+#include "TextureStreamer.h"
+#include "UploadRing.h"
 #include "VkHelper.h"
 
 class Renderer {
+public:
+    // How a texture is filtered. Only the mipmapped modes read below the base level, so NEAREST
+    // and BILINEAR keep sampling full resolution texels however much the texture is minified.
+    enum class SamplerMode : uint32_t {
+        NEAREST = 0,
+        BILINEAR,
+        TRILINEAR,
+        // Trilinear if the device doesn't support anisotropic filtering
+        ANISOTROPIC,
+    };
+    static constexpr const uint32_t kSamplerModeCount = 4;
+
 private:
     struct Texture {
-        VkSampler sampler;
+        SamplerMode samplerMode;
         VkImage image;
-        VkDeviceMemory memory;
+        MemoryAllocator::Allocation memory;
         VkImageView view;
         uint32_t width;
         uint32_t height;
+        uint32_t levelCount;
+        // Mip tail of a streamed texture, which stays resident and is sampled while the full
+        // texture is evicted or not streamed in yet
+        VkImage lowResImage;
+        MemoryAllocator::Allocation lowResMemory;
+        VkImageView lowResView;
+        // Serial of the last frame sampling it, the least recently used ones are evicted first
+        uint64_t lastUseSerial;
+        // A stream of the full texture is in flight
+        bool isRequested;
 
         Texture()
-              : sampler(VK_NULL_HANDLE),
+              : samplerMode(SamplerMode::NEAREST),
                 image(VK_NULL_HANDLE),
-                memory(VK_NULL_HANDLE),
+                memory(),
                 view(VK_NULL_HANDLE),
                 width(0),
-                height(0) {}
+                height(0),
+                levelCount(0),
+                lowResImage(VK_NULL_HANDLE),
+                lowResMemory(),
+                lowResView(VK_NULL_HANDLE),
+                lastUseSerial(0),
+                isRequested(false) {}
+    };
+
+    // An evicted texture, destroyed once the last frame that could sample it is done
+    struct RetiredTexture {
+        VkImage image;
+        MemoryAllocator::Allocation memory;
+        VkImageView view;
+        uint64_t retireSerial;
+    };
+
+    // Multisampled color or depth attachment of the scene render pass. Transient, so it never
+    // leaves the tile on tile based GPUs.
+    struct AttachmentImage {
+        VkImage image = VK_NULL_HANDLE;
+        MemoryAllocator::Allocation memory;
+        VkImageView view = VK_NULL_HANDLE;
+    };
+
+    // Color target the scene renders into before the upscale pass, as large as the swapchain
+    // images. The descriptor set samples it in the upscale pass. The compute post stage instead
+    // has a set per swapchain image, which also writes to the image through its storage view.
+    struct OffscreenTarget {
+        VkImage image = VK_NULL_HANDLE;
+        MemoryAllocator::Allocation memory;
+        VkImageView view = VK_NULL_HANDLE;
+        VkFramebuffer framebuffer = VK_NULL_HANDLE;
+        VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+        VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+        std::vector<VkImageView> storageViews;
+        std::vector<VkDescriptorSet> postDescriptorSets;
+    };
+
+    // A swapchain replaced by recreation, destroyed once the last frame presenting to it is done
+    struct RetiredSwapchain {
+        VkSwapchainKHR swapchain;
+        std::vector<VkImageView> imageViews;
+        std::vector<VkFramebuffer> framebuffers;
+        OffscreenTarget offscreenTarget;
+        AttachmentImage colorAttachment;
+        AttachmentImage depthAttachment;
+        // Serial of the last frame submitted while it was current
+        uint64_t retireSerial;
+    };
+
+    // Per frame command pool of one job system thread, reset once the frame's serial has been
+    // waited. The first usedCount command buffers are the ones recorded since the last reset.
+    struct RecordPool {
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        std::vector<VkCommandBuffer> commandBuffers;
+        uint32_t usedCount = 0;
+    };
+
+    struct PresentRecord {
+        uint32_t presentId;
+        int64_t startNanos;
+    };
+
+    // Simulation state of one frame, built by the update thread ahead of its recording
+    struct SceneFrame {
+        uint64_t frameNumber = 0;
+        std::vector<QuadBatch::Instance> quads;
+    };
+
+    // A recorded frame handed to the submit thread, its swapchain image already acquired
+    struct FrameSubmission {
+        uint32_t frameIndex;
+        uint32_t imageIndex;
+        VkCommandBuffer commandBuffer;
+        // Only recorded with mAsyncPost
+        VkCommandBuffer postCommandBuffer;
+        // Signaled by the first submit of the frame, with mAsyncPost the post stage signals the
+        // one after it
+        uint64_t serial;
+        uint32_t presentId;
+        uint32_t swapchainSerial;
+        int64_t frameStartNanos;
+    };
+
+    // Handed back by the submit thread once the frame has been presented
+    struct PresentResult {
+        VkResult result;
+        uint32_t swapchainSerial;
+        int64_t frameStartNanos;
+        int64_t presentEndNanos;
     };
 
 public:
+    // Trades input-to-photon latency against tolerance to frame time spikes by choosing the present
+    // mode, the swapchain depth and the number of frames in flight.
+    enum class LatencyMode : uint32_t {
+        LOW_LATENCY = 0,
+        BALANCED,
+        THROUGHPUT,
+    };
+
+    // Attachment bytes the render passes exchange with memory in a frame
+    struct AttachmentTraffic {
+        // With the transient attachments resolved and discarded on tile
+        uint64_t bytes;
+        // If the multisampled color and the depth were stored and resolved in memory instead
+        uint64_t offTileBytes;
+    };
+
+    struct TextureCacheStatistics {
+        // Counted once per texture sampled by a frame. A miss samples the mip tail or the
+        // placeholder instead of the full texture.
+        uint64_t hitCount;
+        uint64_t missCount;
+        uint64_t evictionCount;
+        // Full textures and mip tails, evicted ones excluded even while they are still retiring
+        VkDeviceSize residentBytes;
+        // UINT64_MAX without a budget
+        VkDeviceSize budgetBytes;
+    };
+
     explicit Renderer() {}
-    void initialize(ANativeWindow* window, AAssetManager* assetManager);
+    // dataPath is a writable app directory to persist the pipeline cache in, may be nullptr
+    void initialize(ANativeWindow* window, AAssetManager* assetManager, const char* dataPath);
     void drawFrame();
     void updateSurface(uint32_t width, uint32_t height);
+    // Drops the surface, the swapchain and everything sized to it once the frames in flight are
+    // done, and persists the pipeline cache. The device, textures and pipelines stay alive for
+    // resumeSurface.
+    void releaseSurface();
+    // Creates the surface and swapchain for a new window after releaseSurface. The settings that
+    // take effect at the next initialize are left as they were.
+    void resumeSurface(ANativeWindow* window);
+    // Releases and resumes on the current window, to measure resume the way the benchmark does
+    void cycleSurface();
+    // Whether initialize has run and destroy hasn't yet, with or without a surface
+    bool hasDevice() const { return mDevice != VK_NULL_HANDLE; }
     void destroy();
+    const FrameMetrics& getMetrics() const { return mMetrics; }
+    // 0 if the presentation engine does not report its refresh cycle
+    int64_t getRefreshDurationNanos() const { return mRefreshDurationNanos; }
+    // From the start of initialize until the first present returns, 0 before that
+    int64_t getTimeToFirstFrameNanos() const { return mTimeToFirstFrameNanos; }
+    // Takes effect at the start of the next frame, swapchain and frame resources are recreated
+    void setLatencyMode(LatencyMode mode);
+    // Records one command buffer per frame in flight and swapchain image once and resubmits it
+    // until the swapchain or a texture changes, instead of recording every frame
+    void setCommandBufferReuse(bool enable);
+    // Number of quads the demo scene is split into, clamped to the capacity of the quad batch.
+    // Takes effect right away.
+    void setSceneQuadCount(uint32_t count);
+    // Replaces the sample textures with generated ones of size x size texels from the next
+    // initialize on, 0 goes back to the sample textures
+    void setSyntheticTextureSize(uint32_t size);
+    // Number of textures, each streaming a sample texture of its own, clamped to
+    // [1, kMaxTextureCount]. Takes effect at the next initialize.
+    void setTextureCount(uint32_t count);
+    // Number of textures the demo scene samples at once, each over a band of its quads. The
+    // window moves on by one texture every kSceneTextureInterval scene frames, so that the others
+    // fall out of use and become eligible for eviction. 0, the default, samples all of them.
+    // Takes effect right away.
+    void setSceneTextureCount(uint32_t count);
+    // Selects texture_specialized.vert, with one pipeline per surface rotation, over texture.vert
+    // with the pre-rotation folded into the mvp uniform. Takes effect at the next initialize.
+    void setSpecializedPreRotation(bool enable);
+    // Sampler mode of every texture from the next initialize on
+    void setSamplerMode(SamplerMode mode);
+    // Changes the sampler mode of one texture from the next frame on, only valid after initialize
+    void setTextureSamplerMode(uint32_t textureIndex, SamplerMode mode);
+    static const char* getSamplerModeName(SamplerMode mode);
+    // Rough texture bytes read by a frame of the demo scene at the current surface size and
+    // sampler mode, assuming 4 bytes per texel. Only valid after initialize.
+    uint64_t estimateTextureReadBytes() const;
+    // Device memory the textures may keep resident, the least recently used ones beyond it are
+    // evicted down to their mip tail and streamed in again on their next use. 0, the default,
+    // derives the budget from VK_EXT_memory_budget, or never evicts without it. Takes effect at
+    // the next frame.
+    void setTextureBudget(VkDeviceSize bytes);
+    TextureCacheStatistics getTextureCacheStatistics() const;
+    // Renders the swapchain at a share of the surface size, clamped to [kMinRenderScale, 1], and
+    // lets the compositor upscale it. Takes effect with a swapchain recreation after the next
+    // frame.
+    void setRenderScale(float scale);
+    float getRenderScale() const { return mRenderScale; }
+    // Renders the scene into an offscreen target and upscales it to the swapchain image in a
+    // second pass. Takes effect at the next initialize.
+    void setOffscreenRendering(bool enable);
+    bool isOffscreenRenderingEnabled() const { return mOffscreenRendering; }
+    // Share of the swapchain size the scene renders at with offscreen rendering, clamped to
+    // [kMinRenderScale, 1]. Takes effect at the next frame without recreating anything.
+    void setOffscreenScale(float scale);
+    float getOffscreenScale() const { return mOffscreenScale; }
+    // Replaces the upscale pass with a compute shader that sharpens and color grades the
+    // offscreen target while writing it to the swapchain image, on the async compute queue when
+    // there is one. Needs offscreen rendering, and falls back to the upscale pass if the
+    // swapchain images can't be storage images. Takes effect at the next initialize.
+    void setComputePost(bool enable);
+    bool isComputePostEnabled() const { return mComputePost; }
+    bool isPostOnComputeQueue() const { return mAsyncPost; }
+    // Adds a depth attachment to the scene render pass. Takes effect at the next initialize.
+    void setDepthBuffer(bool enable);
+    // Renders the scene with 4x MSAA, resolved at the end of the subpass. Takes effect at the
+    // next initialize.
+    void setMultisampling(bool enable);
+    // Rough estimate at the current swapchain size, assuming 4 bytes per color sample. Only valid
+    // after initialize.
+    AttachmentTraffic estimateAttachmentTraffic() const;
+    // Whether the transient attachments got lazily allocated memory, only valid after initialize
+    bool areAttachmentsLazilyAllocated() const { return mLazyAttachments; }
+    // Recreates the swapchain after the next frame, the same way a resize does
+    void requestSwapchainRecreation();
+    // Only valid after initialize
+    const VkPhysicalDeviceProperties& getGpuProperties() const { return mGpuProperties; }
 
 private:
     void createInstance();
     void createDevice();
     void createSurface(ANativeWindow* window);
     void createSwapchain(VkSwapchainKHR oldSwapchain);
-    uint32_t getMemoryTypeIndex(uint32_t typeBits, VkFlags mask);
-    void setImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldImageLayout,
-                        VkImageLayout newImageLayout, VkPipelineStageFlags srcStages,
-                        VkPipelineStageFlags dstStages);
-    void loadTextureFromFile(const char* filePath, Texture* outTexture);
+    // Destroys the current and the retired swapchains, the device must be idle
+    void destroySwapchains();
+    VkPresentModeKHR choosePresentMode();
+    void recreateSwapchain();
+    void updateTransform();
     void createTextures();
+    // One sampler per SamplerMode, shared by all the textures
+    void createSamplers();
+    void updateStreamedTextures();
+    // Tracks the textures the scene samples, streams in the missing ones and evicts the least
+    // recently used ones over budget. Call before this frame's descriptor set is updated.
+    void updateTextureResidency(const SceneFrame& scene);
+    void evictTexture(Texture* texture);
+    void destroyRetiredTextures(bool deviceIdle);
     void createDescriptorSet();
+    void updateDescriptorSet(uint32_t frameIndex);
     void createRenderPass();
+    void createUpscaleRenderPass();
+    // Transient attachments of the scene render pass, sized like the swapchain images
+    void createAttachmentImages();
+    void createAttachmentImage(VkFormat format, VkImageUsageFlags usage,
+                               VkImageAspectFlags aspect, AttachmentImage* outImage);
+    void destroyAttachmentImage(AttachmentImage* image);
+    // Fills outViews with the attachments of a scene framebuffer resolving or rendering to
+    // colorView, in render pass order, and returns their count
+    uint32_t getSceneAttachments(VkImageView colorView, VkImageView* outViews) const;
     void loadShaderFromFile(const char* filePath, VkShaderModule* outShader);
+    void createPipelineCache();
+    void savePipelineCache();
     void createGraphicsPipeline();
+    // Clamps to the edge of the offscreen target, shared by the upscale pass and the post stage
+    void createUpscaleSampler();
+    // Sampler, layouts and pipeline of the upscale pass
+    void createUpscalePipeline();
+    // Sampler, layouts and compute pipeline of the post stage
+    void createPostPipeline();
+    void createOffscreenTarget();
+    // The descriptor sets of mOffscreenTarget, along with storage views of the swapchain images
+    // for the post stage
+    void createUpscaleDescriptorSet();
+    void createPostDescriptorSets();
+    void destroyOffscreenTarget(OffscreenTarget* target);
+    // Size of the top left corner of the offscreen target the scene renders to
+    VkExtent2D getOffscreenExtent() const;
     void createVertexBuffer();
+    // Device local buffer initialized with data, copied out of the upload ring by a submit that
+    // is waited for. Only meant for static data, before the first frame.
+    void createStaticBuffer(const void* data, VkDeviceSize size, VkBufferUsageFlags usage,
+                            VkBuffer* outBuffer, MemoryAllocator::Allocation* outMemory);
+    // Writes the uniforms of texture.vert for the frame into the upload ring
+    void writeSceneUniforms(uint32_t frameIndex);
+    // Copies the scene built by the update thread into this frame's slice of the quad batch
+    void buildQuadBatch(uint32_t frameIndex, const SceneFrame& scene);
     void createCommandBuffers();
     void createSemaphore(VkSemaphore* outSemaphore);
     void createSemaphores();
+    void createFrameTimeline();
     void createFences();
+    void createQueryPool();
+    void createFrameResources();
+    void destroyFrameResources();
+    // Starts the update and submit threads, with the update thread up to mInflight frames ahead
+    void startFramePipeline();
+    // Stops both threads, the submit thread must be idle
+    void stopFramePipeline();
+    void updateThreadMain();
+    // Builds the demo scene, only reads settings that are safe to change while it runs
+    static const char* getTextureFile(uint32_t textureIndex) {
+        return kTextureFiles[textureIndex % kTextureFileCount];
+    }
+    void updateScene(SceneFrame* scene);
+    void submitThreadMain();
+    // Submits and presents a frame, then hands back the result through mPresentResults
+    void submitFrame(const FrameSubmission& submission);
+    // Blocks until every frame handed to the submit thread has been presented, and processes the
+    // results. Call before anything the submit thread uses is changed or destroyed.
+    void waitFrameSubmissions();
+    void processPresentResults();
+    void applyLatencyMode();
+    // Serials count the frame submits from 1, 0 is always complete
+    bool isFrameSerialComplete(uint64_t serial);
+    void waitFrameSerial(uint64_t serial);
     void createFramebuffer(uint32_t index);
-    void recordCommandBuffer(uint32_t frameIndex, uint32_t imageIndex);
-    void destroyOldSwapchain();
-    bool is180Rotation();
+    void createFramebuffersAsync();
+    void waitFramebuffers();
+    // allowSecondary lets the draws be recorded in parallel into secondary command buffers valid
+    // until the next use of frameIndex, so it must be false for command buffers reused beyond that
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t frameIndex,
+                             uint32_t imageIndex, VkCommandBufferUsageFlags usage,
+                             bool allowSecondary);
+    // Records mRenderPass into framebuffer, over extent from the top left corner
+    void recordScenePass(VkCommandBuffer commandBuffer, uint32_t frameIndex,
+                         VkFramebuffer framebuffer, const VkExtent2D& extent, bool allowSecondary);
+    // Records the state and the quads of instanceCount instances from firstInstance on inside the
+    // render pass, safe to call from several threads at once for different command buffers
+    void recordScene(VkCommandBuffer commandBuffer, uint32_t frameIndex, const VkExtent2D& extent,
+                     uint32_t firstInstance, uint32_t instanceCount);
+    // Splits the frame's instances into jobCount ranges recorded on the job system into
+    // mSecondaryCommandBuffers, inheriting framebuffer
+    void recordSecondaryCommandBuffers(uint32_t frameIndex, VkFramebuffer framebuffer,
+                                       const VkExtent2D& extent, uint32_t jobCount);
+    // Stretches the offscreen target over the swapchain image
+    void recordUpscalePass(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+    // Writes the post processed offscreen target to the swapchain image and transitions it for
+    // the present
+    void recordPostDispatch(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+    // Submits the scene on the graphics queue and the post stage recorded in postCommandBuffer
+    // on the compute queue, signaling sceneSerial and the serial after it
+    void submitAsyncPost(uint32_t frameIndex, VkCommandBuffer commandBuffer,
+                         VkCommandBuffer postCommandBuffer, uint64_t sceneSerial);
+    VkCommandBuffer getCommandBuffer(uint32_t frameIndex, uint32_t imageIndex);
+    void markCommandBuffersDirty();
+    void destroyRetiredSwapchains(bool deviceIdle);
+    bool hasSurfaceTransformChanged();
+    void collectGpuTimestamps(uint32_t frameIndex);
+    void collectPresentationTimings();
+    void logFrameMetrics();
 
     // Helper member for Vulkan entry points
     VkHelper mVk;
     // A pointer to cache AAssetManager
     AAssetManager* mAssetManager = nullptr;
+    // The window of mSurface, only valid while the surface is
+    ANativeWindow* mWindow = nullptr;
 
     // Stable baseline members
     VkInstance mInstance = VK_NULL_HANDLE;
     VkPhysicalDevice mGpu = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties mGpuProperties = {};
     VkDevice mDevice = VK_NULL_HANDLE;
     uint32_t mQueueFamilyIndex = 0;
     VkQueue mQueue = VK_NULL_HANDLE;
+    // Same as the graphics queue if there is no dedicated transfer queue family
+    uint32_t mTransferQueueFamilyIndex = 0;
+    VkQueue mTransferQueue = VK_NULL_HANDLE;
+    // Same as the graphics queue if there is no compute only queue family
+    uint32_t mComputeQueueFamilyIndex = 0;
+    VkQueue mComputeQueue = VK_NULL_HANDLE;
+    // False if not even the graphics queue family supports compute
+    bool mComputeQueueEnabled = false;
+    bool mTimelineSemaphoreEnabled = false;
+    bool mDescriptorIndexingEnabled = false;
+    // shaderSampledImageArrayDynamicIndexing, needed by either texture table
+    bool mDynamicIndexingEnabled = false;
+    bool mMemoryBudgetEnabled = false;
+    // 1 if anisotropic filtering is not supported
+    float mMaxAnisotropy = 1.0F;
+    // Backs every buffer and image the renderer creates
+    MemoryAllocator mAllocator;
 
     // Swapchain related members
     VkSurfaceKHR mSurface = VK_NULL_HANDLE;
@@ -93,48 +451,207 @@ private:
     uint32_t mSurfaceHeight = 0;
     uint32_t mImageWidth = 0;
     uint32_t mImageHeight = 0;
+    // mImageWidth and mImageHeight are the surface size scaled by mRenderScale, then pre-rotated
+    float mRenderScale = 1.0F;
     VkSurfaceTransformFlagBitsKHR mPreTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+    VkPresentModeKHR mPresentMode = VK_PRESENT_MODE_FIFO_KHR;
     uint32_t mFrameCount = 0;
     VkSwapchainKHR mSwapchain = VK_NULL_HANDLE;
     std::vector<VkImage> mImages;
     std::vector<VkImageView> mImageViews;
     std::vector<VkFramebuffer> mFramebuffers;
-    // For swapchain recreation, old stuff can be refactored to kInflight buffered
+    // Images beyond the surface's minImageCount, how many can be acquired ahead of their present
+    uint32_t mSpareImageCount = 0;
+    // Counts the swapchains created, set by acquire or present reporting VK_SUBOPTIMAL_KHR
+    uint32_t mSwapchainSerial = 0;
+    bool mSwapchainOutdated = false;
+    // Creates the image views and framebuffers of a new swapchain ahead of its first frame. The
+    // vectors above are only touched by the render thread once it has been joined.
+    std::thread mFramebufferThread;
+    // For swapchain recreation. Replaced swapchains queue up in mRetiredSwapchains in retireSerial
+    // order, so any number of them can be retiring at once.
     bool mFireRecreateSwapchain = false;
-    uint32_t mPreRotationLatency = kPreRotationLatency;
-    uint32_t mRetireFrame = 0;
-    VkSwapchainKHR mOldSwapchain = VK_NULL_HANDLE;
-    std::vector<VkImage> mOldImages;
-    std::vector<VkImageView> mOldImageViews;
-    std::vector<VkFramebuffer> mOldFramebuffers;
+    std::deque<RetiredSwapchain> mRetiredSwapchains;
+    // Frame start time of the first frame presented to an outdated swapchain, 0 if none is pending,
+    // and the serial of the first swapchain created after it
+    int64_t mRotationStartNanos = 0;
+    uint32_t mRotationSwapchainSerial = 0;
 
     // Graphics pipeline related members
     VkRenderPass mRenderPass = VK_NULL_HANDLE;
     VkPipelineLayout mPipelineLayout = VK_NULL_HANDLE;
-    VkPipeline mPipeline = VK_NULL_HANDLE;
+    // Indexed by mPreRotation with specialized pre-rotation, a single pipeline otherwise
+    bool mSpecializedPreRotation = true;
+    std::vector<VkPipeline> mPipelines;
+    // Transform of the current swapchain. mMvp is column major and has mPreRotation quarter turns
+    // folded in, mScale is the same without the rotation.
+    float mMvp[16] = {};
+    float mScale[2] = {};
+    uint32_t mPreRotation = 0;
 
-    // Descriptor related members
+    // Scene render pass attachments. mRenderPass has the multisampled color attachment first if
+    // any, then the one rendered or resolved to, then the depth attachment if any. The transient
+    // attachments are recreated and retired along with the swapchain.
+    bool mDepthBuffer = false;
+    bool mMultisampling = false;
+    VkSampleCountFlagBits mSampleCount = VK_SAMPLE_COUNT_1_BIT;
+    uint32_t mSceneAttachmentCount = 1;
+    AttachmentImage mColorAttachment;
+    AttachmentImage mDepthAttachment;
+    bool mLazyAttachments = false;
+
+    // Offscreen rendering related members. The target is as large as the swapchain images and
+    // the scene only renders to its top left mOffscreenScale, so the scale can change every frame.
+    // The target is recreated and retired along with the swapchain. The swapchain framebuffers
+    // then belong to mUpscaleRenderPass, while the target's belongs to mRenderPass.
+    bool mOffscreenRendering = false;
+    float mOffscreenScale = 1.0F;
+    VkRenderPass mUpscaleRenderPass = VK_NULL_HANDLE;
+    OffscreenTarget mOffscreenTarget;
+    VkSampler mUpscaleSampler = VK_NULL_HANDLE;
+    VkDescriptorSetLayout mUpscaleDescriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout mUpscalePipelineLayout = VK_NULL_HANDLE;
+    VkPipeline mUpscalePipeline = VK_NULL_HANDLE;
+
+    // Compute post stage related members. It takes the place of mUpscaleRenderPass, so the
+    // swapchain images have no framebuffers. With mAsyncPost the dispatch gets a command buffer
+    // of its own per frame in flight on the compute queue, and the swapchain images and the
+    // offscreen target are shared concurrently by both queue families. The GPU timestamps then
+    // only cover the scene.
+    bool mComputePost = false;
+    bool mAsyncPost = false;
+    VkDescriptorSetLayout mPostDescriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout mPostPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline mPostPipeline = VK_NULL_HANDLE;
+    VkCommandPool mPostCommandPool = VK_NULL_HANDLE;
+    std::vector<VkCommandBuffer> mPostCommandBuffers;
+
+    // Pipeline cache related members
+    std::string mPipelineCachePath;
+    VkPipelineCache mPipelineCache = VK_NULL_HANDLE;
+
+    // Descriptor related members. All the textures live in one table, an array of combined image
+    // samplers indexed by QuadBatch::Instance::textureIndex, which is also the index in mTextures.
+    // Textures without an image sample mPlaceholderTexture until they are streamed in. There is a
+    // descriptor set per frame in flight, so that a set only gets updated after the serial of its
+    // frame has been waited.
+    TextureStreamer mStreamer;
+    SamplerMode mDefaultSamplerMode = SamplerMode::TRILINEAR;
+    VkSampler mSamplers[kSamplerModeCount] = {};
     std::vector<Texture> mTextures;
+    Texture mPlaceholderTexture;
     VkDescriptorSetLayout mDescriptorSetLayout = VK_NULL_HANDLE;
     VkDescriptorPool mDescriptorPool = VK_NULL_HANDLE;
-    VkDescriptorSet mDescriptorSet = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> mDescriptorSets;
+    std::vector<bool> mDescriptorSetsDirty;
+    uint32_t mTextureTableSize = 0;
+    // Sets per frame in mDescriptorSets, one per texture if the table can't be indexed at all
+    uint32_t mTextureSetCount = 1;
+    // Set 1 of the scene pipelines, a single dynamic uniform buffer descriptor covering the whole
+    // upload ring. Each frame binds it at the offset its uniforms got in mSceneUniformOffsets.
+    VkDescriptorSetLayout mSceneUniformSetLayout = VK_NULL_HANDLE;
+    VkDescriptorSet mSceneUniformSet = VK_NULL_HANDLE;
+    std::vector<uint32_t> mSceneUniformOffsets;
+
+    // Texture residency related members. Evicted textures wait in mRetiredTextures until the
+    // frames that could still sample them are done, their mip tail sampled in the meantime.
+    VkDeviceSize mTextureBudget = 0;
+    // Derived from VK_EXT_memory_budget every kMemoryBudgetQueryInterval frames
+    VkDeviceSize mQueriedTextureBudget = UINT64_MAX;
+    VkDeviceSize mResidentTextureBytes = 0;
+    std::deque<RetiredTexture> mRetiredTextures;
+    uint64_t mTextureCacheHits = 0;
+    uint64_t mTextureCacheMisses = 0;
+    uint64_t mTextureEvictions = 0;
 
-    // Vertex buffer related members
+    // Vertex buffer related members. The unit quad is static and device local, everything written
+    // per frame goes through mUploadRing.
     VkBuffer mVertexBuffer = VK_NULL_HANDLE;
-    VkDeviceMemory mVertexMemory = VK_NULL_HANDLE;
+    MemoryAllocator::Allocation mVertexMemory;
+    UploadRing mUploadRing;
+    // Instances of the unit quad in mVertexBuffer, rebuilt every frame
+    QuadBatch mQuadBatch;
+    // Read by the update thread
+    std::atomic<uint32_t> mSceneQuadCount{kSceneGridSize * kSceneGridSize};
+    std::atomic<uint32_t> mSceneTextureCount{0};
+    uint32_t mSyntheticTextureSize = 0;
+    // Size of mTextures from the next createTextures on
+    uint32_t mTextureCount = 1;
 
     // Command buffer related members
     VkCommandPool mCommandPool = VK_NULL_HANDLE;
     std::vector<VkCommandBuffer> mCommandBuffers;
+    // Reused command buffers indexed by imageIndex * mInflight + frameIndex. Each one remembers
+    // the generation it was recorded at and gets re-recorded once the generation moves on.
+    bool mReuseCommandBuffers = false;
+    uint32_t mCommandBufferGeneration = 1;
+    std::vector<VkCommandBuffer> mReusedCommandBuffers;
+    std::vector<uint32_t> mReusedCommandBufferGenerations;
+    // Parallel recording, mRecordPools is indexed by frameIndex * thread count + thread index.
+    // mSecondaryCommandBuffers holds the ones of the frame being recorded in execution order.
+    JobSystem mJobSystem;
+    std::vector<RecordPool> mRecordPools;
+    std::vector<VkCommandBuffer> mSecondaryCommandBuffers;
 
     // Semaphores for synchronization
     std::vector<VkSemaphore> mAcquireSemaphores;
     std::vector<VkSemaphore> mRenderSemaphores;
 
-    // Fences for latency control
+    // Frame completion tracking. Every submit signals the next serial on mFrameTimeline, which
+    // lives as long as the device, or on a fence per frame when timeline semaphores are not
+    // supported. mFrameSerials holds the serial of the last submit of each frame in flight.
+    VkSemaphore mFrameTimeline = VK_NULL_HANDLE;
     std::vector<VkFence> mInflightFences;
+    std::vector<uint64_t> mFrameSerials;
+    uint64_t mSubmittedSerial = 0;
+    // Last serial the submit thread has actually passed to vkQueueSubmit, mSubmittedSerial is
+    // taken at hand-over already
+    std::atomic<uint64_t> mSubmitThreadSerial{0};
+    // Cached, at most the actual completed serial
+    uint64_t mCompletedSerial = 0;
+
+    // Frame pipeline related members. The update thread builds the scene of the next frames, up
+    // to mInflight of them, while the render thread waits for and records the current frame and
+    // the submit thread submits and presents the previous ones. Scene slots go round through
+    // mFreeScenes and mBuiltScenes. Every frame in mSubmissions holds an acquired image, and the
+    // renderer state the submit thread reads only changes after waitFrameSubmissions.
+    std::vector<SceneFrame> mSceneFrames;
+    StageQueue<uint32_t> mFreeScenes;
+    StageQueue<uint32_t> mBuiltScenes;
+    std::thread mUpdateThread;
+    uint64_t mSceneFrameNumber = 0;
+    StageQueue<FrameSubmission> mSubmissions;
+    std::thread mSubmitThread;
+    // Drained by every frame, so never more than the frames in flight and the one recorded
+    CommandQueue<PresentResult, 8> mPresentResults;
+    // mQueue is shared by the submit thread and the texture uploads of the render thread, and
+    // mSwapchain by the acquire on the render thread and the present on the submit thread. Only
+    // ever locked in that order.
+    std::mutex mSwapchainLock;
+    std::mutex mQueueLock;
+
+    // Latency mode related members. All the per frame vectors above are sized to mInflight.
+    LatencyMode mLatencyMode = LatencyMode::BALANCED;
+    LatencyMode mPendingLatencyMode = LatencyMode::BALANCED;
+    uint32_t mInflight = 0;
+
+    // Frame instrumentation members
+    FrameMetrics mMetrics;
+    VkQueryPool mTimestampQueryPool = VK_NULL_HANDLE;
+    std::vector<bool> mTimestampsPending;
+    uint64_t mTimestampMask = 0;
+    float mTimestampPeriod = 0.0F;
+    bool mDisplayTimingEnabled = false;
+    int64_t mRefreshDurationNanos = 0;
+    // CPU frame start time of recent presentIDs to match against the reported present time
+    std::vector<PresentRecord> mPresentRecords;
+    int64_t mInitializeStartNanos = 0;
+    int64_t mTimeToFirstFrameNanos = 0;
+    // Start of the last resumeSurface, 0 once its first frame has been presented
+    int64_t mResumeStartNanos = 0;
 
     // App specific constants
+    static constexpr const uint32_t kApiVersion = VK_MAKE_VERSION(1, 1, 0);
     static constexpr const char* kRequiredInstanceExtensions[2] = {
             "VK_KHR_surface",
             "VK_KHR_android_surface",
@@ -142,15 +659,64 @@ private:
     static constexpr const char* kRequiredDeviceExtensions[1] = {
             "VK_KHR_swapchain",
     };
-    static constexpr const uint32_t kReqImageCount = 3;
-    static constexpr const uint32_t kInflight = 2;
-    static constexpr const uint32_t kTextureCount = 1;
-    static constexpr const char* kTextureFiles[kTextureCount] = {
+    // Assets the textures stream from, texture i uses file i % kTextureFileCount
+    static constexpr const uint32_t kTextureFileCount = 1;
+    static constexpr const char* kTextureFiles[kTextureFileCount] = {
             "sample_tex.png",
     };
+    // Longest side of the mip tail of a streamed texture kept resident
+    static constexpr const uint32_t kResidentMipSize = 64;
+    static constexpr const uint32_t kMemoryBudgetQueryInterval = 60;
+    // Share of the device local heap budget the textures may take, minus the other usage of it
+    static constexpr const float kTextureBudgetShare = 0.8F;
     static constexpr const char* kVertexShaderFile = "texture.vert.spv";
+    static constexpr const char* kSpecializedVertexShaderFile = "texture_specialized.vert.spv";
     static constexpr const char* kFragmentShaderFile = "texture.frag.spv";
+    static constexpr const char* kBindlessFragmentShaderFile = "texture_bindless.frag.spv";
+    static constexpr const char* kSingleFragmentShaderFile = "texture_single.frag.spv";
+    static constexpr const char* kUpscaleVertexShaderFile = "upscale.vert.spv";
+    static constexpr const char* kUpscaleFragmentShaderFile = "upscale.frag.spv";
+    static constexpr const char* kPostComputeShaderFile = "post.comp.spv";
+    static constexpr const char* kPipelineCacheFile = "pipeline_cache.bin";
     static constexpr const uint32_t kLogInterval = 100;
     static constexpr const uint64_t kTimeout30Sec = 30000000000;
-    static constexpr const uint32_t kPreRotationLatency = 30;
+    static constexpr const uint32_t kTimestampsPerFrame = 2;
+    // Upper bound of mInflight across all the latency modes
+    static constexpr const uint32_t kMaxInflight = 3;
+    static constexpr const uint32_t kPresentRecordCount = 64;
+    static constexpr const uint32_t kPreRotationCount = 4;
+    static constexpr const uint32_t kMaxQuads = 16384;
+    // Room for the uniforms and kMaxQuads instances of a frame
+    static constexpr const VkDeviceSize kUploadRingFrameSize = 1024 * 1024;
+    // Fewer quads than this per job are recorded faster inline than forked to the job system. The
+    // default scene of 32 x 32 quads gets up to 4 jobs.
+    static constexpr const uint32_t kMinInstancesPerRecordJob = 256;
+    // By default the demo scene splits the texture into kSceneGridSize x kSceneGridSize quads
+    static constexpr const uint32_t kSceneGridSize = 32;
+    // Texture table sizes, must match the array sizes in texture.frag and texture_bindless.frag.
+    // The fallback fits the minimum per stage sampler limit every device supports.
+    static constexpr const uint32_t kTextureTableSize = 16;
+    static constexpr const uint32_t kBindlessTextureTableSize = 1024;
+    // Fits the fallback table
+    static constexpr const uint32_t kMaxTextureCount = kTextureTableSize;
+    static constexpr const uint32_t kSceneTextureInterval = 60;
+    static constexpr const char* kSamplerModeNames[kSamplerModeCount] = {
+            "nearest",
+            "bilinear",
+            "trilinear",
+            "anisotropic",
+    };
+    static constexpr const float kMaxAnisotropy = 8.0F;
+    static constexpr const float kMinRenderScale = 0.25F;
+    static constexpr const uint64_t kTexelSizeEstimate = 4;
+    // D16 and 4x MSAA are supported for depth and color attachments by every device
+    static constexpr const VkFormat kDepthFormat = VK_FORMAT_D16_UNORM;
+    static constexpr const uint64_t kDepthSampleSize = 2;
+    static constexpr const VkSampleCountFlagBits kMsaaSampleCount = VK_SAMPLE_COUNT_4_BIT;
+    static constexpr const uint32_t kMaxSceneAttachmentCount = 3;
+    // Must match the local size of post.comp
+    static constexpr const uint32_t kPostGroupSize = 8;
+    static constexpr const float kPostSharpness = 0.2F;
+    static constexpr const float kPostSaturation = 1.1F;
+    static constexpr const float kPostContrast = 1.05F;
 };
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+// Bounded blocking queue between two stages of the frame pipeline, each on its own thread. push
+// waits while the queue is full and pop while it is empty, so the faster stage never gets more
+// than the capacity ahead of the other. The consumer calls finish once it is done with a popped
+// value, so that the producer can wait for the values it handed over to be fully processed.
+template <typename T>
+class StageQueue {
+public:
+    explicit StageQueue() {}
+
+    // Drops anything left from a previous use and reopens the queue
+    void reset(uint32_t capacity) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mValues.clear();
+        mCapacity = capacity;
+        mPendingCount = 0;
+        mClosed = false;
+    }
+
+    // Wakes up every waiting push and pop for good, while waitPending returns once the values
+    // already popped are finished
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mClosed = true;
+            mPendingCount -= (uint32_t)mValues.size();
+            mValues.clear();
+        }
+        mNotFull.notify_all();
+        mNotEmpty.notify_all();
+        mFinished.notify_all();
+    }
+
+    // Returns false if the queue has been closed
+    bool push(const T& value) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mNotFull.wait(lock, [this] { return mClosed || mValues.size() < mCapacity; });
+        if (mClosed) {
+            return false;
+        }
+        mValues.push_back(value);
+        mPendingCount++;
+        lock.unlock();
+        mNotEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false if the queue has been closed
+    bool pop(T* outValue) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mNotEmpty.wait(lock, [this] { return mClosed || !mValues.empty(); });
+        if (mClosed) {
+            return false;
+        }
+        *outValue = mValues.front();
+        mValues.pop_front();
+        lock.unlock();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    // Call once per popped value, after the last access to anything it refers to
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mPendingCount--;
+        }
+        mFinished.notify_all();
+    }
+
+    // Blocks until at most maxCount of the values pushed so far are queued or being processed
+    void waitPending(uint32_t maxCount) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mFinished.wait(lock, [this, maxCount] { return mPendingCount <= maxCount; });
+    }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mNotFull;
+    std::condition_variable mNotEmpty;
+    std::condition_variable mFinished;
+    std::deque<T> mValues;
+    uint32_t mCapacity = 1;
+    // Pushed values not finished yet, whether still queued or popped
+    uint32_t mPendingCount = 0;
+    bool mClosed = false;
+};
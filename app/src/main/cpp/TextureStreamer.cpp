@@ -0,0 +1,1031 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TextureStreamer.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "FrameMetrics.h"
+#include "Utils.h"
+
+// Enough for the PNG signature and IHDR chunk, and for the KTX2 header
+static constexpr const size_t kImageHeaderSize = 64;
+static_assert(kImageHeaderSize >= kKtx2HeaderSize);
+
+static std::string getKtx2Path(const std::string& filePath) {
+    const size_t extension = filePath.rfind('.');
+    return filePath.substr(0, extension) + ".ktx2";
+}
+
+void TextureStreamer::initialize(VkHelper* vk, VkPhysicalDevice gpu, VkDevice device,
+                                 MemoryAllocator* allocator, AAssetManager* assetManager,
+                                 VkQueue transferQueue,
+                                 uint32_t transferQueueFamilyIndex,
+                                 VkQueue graphicsQueue,
+                                 uint32_t graphicsQueueFamilyIndex,
+                                 std::mutex* graphicsQueueLock,
+                                 bool timelineSemaphoreEnabled) {
+    ASSERT(vk);
+    ASSERT(allocator);
+    ASSERT(assetManager);
+    ASSERT(graphicsQueueLock);
+    mVk = vk;
+    mGpu = gpu;
+    mDevice = device;
+    mAllocator = allocator;
+    mAssetManager = assetManager;
+    mQueue = transferQueue;
+    mQueueFamilyIndex = transferQueueFamilyIndex;
+    mGraphicsQueue = graphicsQueue;
+    mGraphicsQueueFamilyIndex = graphicsQueueFamilyIndex;
+    mGraphicsQueueLock = graphicsQueueLock;
+    mIsCrossQueue = transferQueueFamilyIndex != graphicsQueueFamilyIndex;
+    // The acquire has to wait for the release on the GPU, a CPU round trip would delay it a frame
+    mOwnershipTransfer = mIsCrossQueue && timelineSemaphoreEnabled;
+
+    if (timelineSemaphoreEnabled) {
+        const VkSemaphoreTypeCreateInfoKHR semaphoreTypeCreateInfo = {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR,
+                .pNext = nullptr,
+                .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+                .initialValue = 0,
+        };
+        const VkSemaphoreCreateInfo semaphoreCreateInfo = {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                .pNext = &semaphoreTypeCreateInfo,
+                .flags = 0,
+        };
+        ASSERT(mVk->CreateSemaphore(mDevice, &semaphoreCreateInfo, nullptr,
+                                    &mTimelineSemaphore) == VK_SUCCESS);
+        mTimelineValue = 0;
+    }
+
+    // Blits need a graphics queue. Linear blits of RGBA8 are required by the spec, but checked
+    // all the same.
+    VkFormatProperties formatProperties;
+    mVk->GetPhysicalDeviceFormatProperties(mGpu, VK_FORMAT_R8G8B8A8_UNORM, &formatProperties);
+    const VkFormatFeatureFlags blitFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+                                              VK_FORMAT_FEATURE_BLIT_DST_BIT |
+                                              VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    mBlitMips = !mIsCrossQueue &&
+                (formatProperties.optimalTilingFeatures & blitFeatures) == blitFeatures;
+
+    createStagingRing();
+    createBatches();
+
+    // Leave a core for the render thread
+    const uint32_t hardwareThreads = std::thread::hardware_concurrency();
+    const uint32_t decodeThreadCount =
+            std::clamp(hardwareThreads > 1 ? hardwareThreads - 1 : 1, 1U, kMaxDecodeThreads);
+    mStopDecoding = false;
+    for (uint32_t i = 0; i < decodeThreadCount; i++) {
+        mDecodeThreads.emplace_back(&TextureStreamer::decodeThreadMain, this);
+    }
+
+    ALOGD("Successfully created texture streamer: %u decode threads, cross queue = %d, "
+          "timeline = %d, ownership transfer = %d, blit mips = %d",
+          decodeThreadCount, mIsCrossQueue, mTimelineSemaphore != VK_NULL_HANDLE,
+          mOwnershipTransfer, mBlitMips);
+}
+
+void TextureStreamer::destroy() {
+    {
+        std::lock_guard<std::mutex> lock(mJobLock);
+        mStopDecoding = true;
+        mJobs.clear();
+    }
+    mJobCondition.notify_all();
+    for (auto& thread : mDecodeThreads) {
+        thread.join();
+    }
+    mDecodeThreads.clear();
+
+    for (auto& decoded : mDecoded) {
+        freeDecodedImage(&decoded);
+    }
+    mDecoded.clear();
+    for (auto& decoded : mStalled) {
+        freeDecodedImage(&decoded);
+    }
+    mStalled.clear();
+
+    for (auto& upload : mReady) {
+        destroyTexture(&upload.texture);
+    }
+    mReady.clear();
+    for (auto& batch : mBatches) {
+        for (auto& upload : batch.uploads) {
+            destroyTexture(&upload.texture);
+        }
+        mVk->DestroyFence(mDevice, batch.fence, nullptr);
+    }
+    mBatches.clear();
+    mFreeBatches.clear();
+    mSubmittedBatches.clear();
+    mVk->DestroyCommandPool(mDevice, mCommandPool, nullptr);
+    mCommandPool = VK_NULL_HANDLE;
+    mVk->DestroyCommandPool(mDevice, mAcquireCommandPool, nullptr);
+    mAcquireCommandPool = VK_NULL_HANDLE;
+
+    mStagingData = nullptr;
+    mVk->DestroyBuffer(mDevice, mStagingBuffer, nullptr);
+    mStagingBuffer = VK_NULL_HANDLE;
+    mAllocator->free(&mStagingMemory);
+    mRingHead = mRingTail = 0;
+
+    mVk->DestroySemaphore(mDevice, mTimelineSemaphore, nullptr);
+    mTimelineSemaphore = VK_NULL_HANDLE;
+
+    ALOGD("Successfully destroyed texture streamer");
+}
+
+void TextureStreamer::requestFromAsset(uint32_t id, const char* filePath, uint32_t maxSize,
+                                       uint32_t* outWidth, uint32_t* outHeight) {
+    ASSERT(filePath);
+    ASSERT(outWidth);
+    ASSERT(outHeight);
+
+    // Prefer the compressed version when the device can sample it
+    const std::string ktx2Path = getKtx2Path(filePath);
+    AssetView header;
+    header.open(mAssetManager, ktx2Path.c_str(), kImageHeaderSize);
+    Ktx2Header ktx2Header;
+    if (readKtx2Header(header.data(), header.size(), &ktx2Header) &&
+        isFormatSupported(ktx2Header.format)) {
+        *outWidth = ktx2Header.width;
+        *outHeight = ktx2Header.height;
+        queueDecodeJob(id, ktx2Path, maxSize);
+        return;
+    }
+
+    ASSERT(header.open(mAssetManager, filePath, kImageHeaderSize));
+    ASSERT(!header.empty());
+    int width = 0;
+    int height = 0;
+    int channel = 0;
+    if (!stbi_info_from_memory(header.data(), header.size(), &width, &height, &channel)) {
+        // Some formats keep the size further in, fall back to the whole file
+        ASSERT(header.open(mAssetManager, filePath));
+        ASSERT(stbi_info_from_memory(header.data(), header.size(), &width, &height, &channel));
+    }
+    *outWidth = (uint32_t)width;
+    *outHeight = (uint32_t)height;
+    queueDecodeJob(id, filePath, maxSize);
+}
+
+void TextureStreamer::queueDecodeJob(uint32_t id, const std::string& filePath,
+                                     uint32_t maxSize) {
+    {
+        std::lock_guard<std::mutex> lock(mJobLock);
+        mJobs.push_back({
+                .id = id,
+                .filePath = filePath,
+                .maxSize = maxSize,
+        });
+    }
+    mJobCondition.notify_one();
+}
+
+TextureStreamer::StreamedTexture TextureStreamer::uploadPixels(const uint8_t* pixels,
+                                                               uint32_t width, uint32_t height) {
+    DecodedImage image = {
+            .id = 0,
+            .format = VK_FORMAT_R8G8B8A8_UNORM,
+            .width = width,
+            .height = height,
+            .pixels = const_cast<uint8_t*>(pixels),
+            .file = {},
+            .data = {},
+            .levels = {{.offset = 0, .size = (size_t)width * height * 4}},
+            .mipLevels = 1,
+            .baseLevel = 0,
+    };
+    generateMipLevels(&image, false, true);
+    const VkDeviceSize size = getStagingSize(image);
+    ASSERT(size <= kStagingSize);
+    // Only waits when called in the middle of heavy streaming
+    while (mFreeBatches.empty()) {
+        waitOldestBatch();
+    }
+    VkDeviceSize stagingOffset = 0;
+    while (!allocateStaging(size, &stagingOffset)) {
+        waitOldestBatch();
+    }
+    uint32_t batchIndex = 0;
+    ASSERT(beginBatch(&batchIndex));
+
+    StreamedTexture texture = createTexture(image);
+    recordUpload(mBatches[batchIndex], stagingOffset, image, texture);
+    mBatches[batchIndex].ringEnd = mRingHead;
+    submitBatch(batchIndex);
+
+    if (mIsCrossQueue && mTimelineSemaphore == VK_NULL_HANDLE) {
+        ASSERT(mVk->WaitForFences(mDevice, 1, &mBatches[batchIndex].fence, VK_TRUE,
+                                  kTimeout30Sec) == VK_SUCCESS);
+        reclaimBatches();
+    }
+    return texture;
+}
+
+void TextureStreamer::update() {
+    reclaimBatches();
+
+    {
+        std::lock_guard<std::mutex> lock(mDecodedLock);
+        mStalled.insert(mStalled.end(), std::make_move_iterator(mDecoded.begin()),
+                        std::make_move_iterator(mDecoded.end()));
+        mDecoded.clear();
+    }
+    if (mStalled.empty()) {
+        return;
+    }
+
+    // Batch every decoded image that fits in the ring, the rest waits for a later frame
+    uint32_t batchIndex = UINT32_MAX;
+    uint32_t uploadCount = 0;
+    for (; uploadCount < mStalled.size(); uploadCount++) {
+        DecodedImage& decoded = mStalled[uploadCount];
+        const VkDeviceSize size = getStagingSize(decoded);
+        ASSERT(size <= kStagingSize);
+        VkDeviceSize stagingOffset = 0;
+        if ((batchIndex == UINT32_MAX && mFreeBatches.empty()) ||
+            !allocateStaging(size, &stagingOffset)) {
+            break;
+        }
+        if (batchIndex == UINT32_MAX) {
+            ASSERT(beginBatch(&batchIndex));
+        }
+
+        const StreamedTexture texture = createTexture(decoded);
+        recordUpload(mBatches[batchIndex], stagingOffset, decoded, texture);
+        freeDecodedImage(&decoded);
+        mBatches[batchIndex].uploads.push_back({
+                .id = decoded.id,
+                .texture = texture,
+        });
+    }
+    if (batchIndex == UINT32_MAX) {
+        return;
+    }
+    mStalled.erase(mStalled.begin(), mStalled.begin() + uploadCount);
+
+    mBatches[batchIndex].ringEnd = mRingHead;
+    submitBatch(batchIndex);
+    ALOGD("%s: submitted %u uploads, %zu waiting for staging space", __FUNCTION__, uploadCount,
+          mStalled.size());
+}
+
+bool TextureStreamer::popReadyTexture(uint32_t* outId, StreamedTexture* outTexture) {
+    if (mReady.empty()) {
+        return false;
+    }
+    *outId = mReady.back().id;
+    *outTexture = mReady.back().texture;
+    mReady.pop_back();
+    return true;
+}
+
+TextureStreamer::UploadBenchmark TextureStreamer::benchmarkUpload(uint32_t width,
+                                                                 uint32_t height,
+                                                                 uint32_t iterations) {
+    const VkDeviceSize size = (VkDeviceSize)width * height * 4;
+    ASSERT(size <= kStagingSize);
+    ASSERT(iterations);
+    std::vector<uint8_t> pixels(size);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        pixels[i] = (uint8_t)i;
+    }
+    const DecodedImage image = {
+            .id = 0,
+            .format = VK_FORMAT_R8G8B8A8_UNORM,
+            .width = width,
+            .height = height,
+            .pixels = pixels.data(),
+            .file = {},
+            .data = {},
+            .levels = {{.offset = 0, .size = (size_t)size}},
+            // Only the copy is measured
+            .mipLevels = 1,
+            .baseLevel = 0,
+    };
+
+    // Start from an idle queue so that each copy is measured on its own
+    while (!mSubmittedBatches.empty()) {
+        waitOldestBatch();
+    }
+
+    int64_t stagingNanos = 0;
+    int64_t copyNanos = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        VkDeviceSize stagingOffset = 0;
+        ASSERT(allocateStaging(size, &stagingOffset));
+        uint32_t batchIndex = 0;
+        ASSERT(beginBatch(&batchIndex));
+        StreamedTexture texture = createTexture(image);
+
+        const int64_t stagingStartNanos = nowNanos();
+        recordUpload(mBatches[batchIndex], stagingOffset, image, texture);
+        const int64_t copyStartNanos = nowNanos();
+        mBatches[batchIndex].ringEnd = mRingHead;
+        submitBatch(batchIndex);
+        waitOldestBatch();
+        const int64_t copyEndNanos = nowNanos();
+
+        stagingNanos += copyStartNanos - stagingStartNanos;
+        copyNanos += copyEndNanos - copyStartNanos;
+        destroyTexture(&texture);
+    }
+
+    const double totalMB = (double)size * iterations / (1024.0 * 1024.0);
+    const UploadBenchmark benchmark = {
+            .width = width,
+            .height = height,
+            .stagingMBps = totalMB * 1e9 / (double)std::max(stagingNanos, (int64_t)1),
+            .copyMBps = totalMB * 1e9 / (double)std::max(copyNanos, (int64_t)1),
+    };
+    ALOGD("Upload benchmark %ux%u x%u: staging %.1f MB/s, copy %.1f MB/s", width, height,
+          iterations, benchmark.stagingMBps, benchmark.copyMBps);
+    return benchmark;
+}
+
+void TextureStreamer::decodeThreadMain() {
+    while (true) {
+        DecodeJob job;
+        {
+            std::unique_lock<std::mutex> lock(mJobLock);
+            mJobCondition.wait(lock, [this] { return mStopDecoding || !mJobs.empty(); });
+            if (mStopDecoding) {
+                return;
+            }
+            job = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+
+        // Decoded straight out of the asset, which is mapped rather than read when possible
+        AssetView file;
+        ASSERT(file.open(mAssetManager, job.filePath.c_str()));
+        ASSERT(!file.empty());
+
+        DecodedImage decoded = {
+                .id = job.id,
+                .format = VK_FORMAT_R8G8B8A8_UNORM,
+                .width = 0,
+                .height = 0,
+                .pixels = nullptr,
+                .file = {},
+                .data = {},
+                .levels = {},
+                .mipLevels = 0,
+                .baseLevel = 0,
+        };
+        Ktx2Header ktx2Header;
+        if (readKtx2Header(file.data(), file.size(), &ktx2Header)) {
+            // Compressed blocks need no decoding, the file itself is staged
+            ASSERT(readKtx2Levels(file.data(), file.size(), ktx2Header, &decoded.levels));
+            decoded.format = ktx2Header.format;
+            decoded.width = ktx2Header.width;
+            decoded.height = ktx2Header.height;
+            decoded.file = std::move(file);
+        } else {
+            int width = 0;
+            int height = 0;
+            int channel = 0;
+            decoded.pixels = stbi_load_from_memory(file.data(), file.size(), &width, &height,
+                                                   &channel, 4 /*desired_channels*/);
+            ASSERT(decoded.pixels);
+            ASSERT(width);
+            ASSERT(height);
+            decoded.width = (uint32_t)width;
+            decoded.height = (uint32_t)height;
+            decoded.levels.push_back({
+                    .offset = 0,
+                    .size = (size_t)width * height * 4,
+            });
+        }
+        // Blitting would only create the levels a mip tail drops again
+        generateMipLevels(&decoded, true, job.maxSize == 0);
+        if (job.maxSize && !dropLevelsAbove(&decoded, job.maxSize)) {
+            ALOGD("%s has no level of at most %u texels, no mip tail", job.filePath.c_str(),
+                  job.maxSize);
+            freeDecodedImage(&decoded);
+            continue;
+        }
+        ALOGD("Decoded %s: %ux%u, format = %d, levels = %zu of %u", job.filePath.c_str(),
+              decoded.width, decoded.height, decoded.format, decoded.levels.size(),
+              decoded.mipLevels);
+
+        std::lock_guard<std::mutex> lock(mDecodedLock);
+        mDecoded.push_back(std::move(decoded));
+    }
+}
+
+bool TextureStreamer::isFormatSupported(VkFormat format) {
+    VkFormatProperties formatProperties;
+    mVk->GetPhysicalDeviceFormatProperties(mGpu, format, &formatProperties);
+    const VkFormatFeatureFlags requiredFeatures =
+            VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+    return (formatProperties.optimalTilingFeatures & requiredFeatures) == requiredFeatures;
+}
+
+VkDeviceSize TextureStreamer::getStagingSize(const DecodedImage& image) {
+    VkDeviceSize size = 0;
+    for (const auto& level : image.levels) {
+        size = (size + kLevelAlignment - 1) & ~(kLevelAlignment - 1);
+        size += level.size;
+    }
+    return size;
+}
+
+void TextureStreamer::freeDecodedImage(DecodedImage* image) {
+    stbi_image_free(image->pixels);
+    image->pixels = nullptr;
+    image->file.close();
+    image->data.clear();
+    image->data.shrink_to_fit();
+}
+
+const uint8_t* TextureStreamer::getLevelData(const DecodedImage& image) {
+    if (image.pixels) {
+        return image.pixels;
+    }
+    return image.data.empty() ? image.file.data() : image.data.data();
+}
+
+void TextureStreamer::generateMipLevels(DecodedImage* image, bool ownsPixels,
+                                        bool allowBlit) const {
+    image->mipLevels = (uint32_t)image->levels.size();
+    if (image->format != VK_FORMAT_R8G8B8A8_UNORM || image->levels.size() != 1) {
+        return;
+    }
+    const uint32_t levelCount = 32 - __builtin_clz(std::max(image->width, image->height));
+    if (mBlitMips && allowBlit) {
+        image->mipLevels = levelCount;
+        return;
+    }
+
+    // Each texel of a level averages the 2x2 texels above it, clamped at odd edges
+    std::vector<Ktx2Level> levels(levelCount);
+    size_t size = 0;
+    for (uint32_t i = 0; i < levelCount; i++) {
+        levels[i].offset = size;
+        levels[i].size = (size_t)std::max(image->width >> i, 1U) *
+                         std::max(image->height >> i, 1U) * 4;
+        size += levels[i].size;
+    }
+    std::vector<uint8_t> data(size);
+    const uint8_t* pixels = getLevelData(*image) + image->levels[0].offset;
+    memcpy(data.data(), pixels, levels[0].size);
+    for (uint32_t i = 1; i < levelCount; i++) {
+        const uint32_t srcWidth = std::max(image->width >> (i - 1), 1U);
+        const uint32_t srcHeight = std::max(image->height >> (i - 1), 1U);
+        const uint32_t dstWidth = std::max(srcWidth >> 1, 1U);
+        const uint32_t dstHeight = std::max(srcHeight >> 1, 1U);
+        const uint8_t* src = data.data() + levels[i - 1].offset;
+        uint8_t* dst = data.data() + levels[i].offset;
+        for (uint32_t y = 0; y < dstHeight; y++) {
+            const uint32_t y0 = std::min(y * 2, srcHeight - 1);
+            const uint32_t y1 = std::min(y * 2 + 1, srcHeight - 1);
+            for (uint32_t x = 0; x < dstWidth; x++) {
+                const uint32_t x0 = std::min(x * 2, srcWidth - 1);
+                const uint32_t x1 = std::min(x * 2 + 1, srcWidth - 1);
+                for (uint32_t c = 0; c < 4; c++) {
+                    const uint32_t sum = src[((size_t)y0 * srcWidth + x0) * 4 + c] +
+                                         src[((size_t)y0 * srcWidth + x1) * 4 + c] +
+                                         src[((size_t)y1 * srcWidth + x0) * 4 + c] +
+                                         src[((size_t)y1 * srcWidth + x1) * 4 + c];
+                    dst[((size_t)y * dstWidth + x) * 4 + c] = (uint8_t)((sum + 2) / 4);
+                }
+            }
+        }
+    }
+
+    if (ownsPixels) {
+        stbi_image_free(image->pixels);
+    }
+    image->pixels = nullptr;
+    image->file.close();
+    image->data.swap(data);
+    image->levels.swap(levels);
+    image->mipLevels = levelCount;
+}
+
+bool TextureStreamer::dropLevelsAbove(DecodedImage* image, uint32_t maxSize) {
+    // The level offsets stay relative to the same data, so dropping is only a matter of bookkeeping
+    ASSERT(image->mipLevels == image->levels.size());
+    uint32_t dropCount = 0;
+    while (std::max(image->width >> dropCount, image->height >> dropCount) > maxSize) {
+        dropCount++;
+        if (dropCount == image->levels.size()) {
+            return false;
+        }
+    }
+    image->levels.erase(image->levels.begin(), image->levels.begin() + dropCount);
+    image->width = std::max(image->width >> dropCount, 1U);
+    image->height = std::max(image->height >> dropCount, 1U);
+    image->mipLevels -= dropCount;
+    image->baseLevel = dropCount;
+    return true;
+}
+
+void TextureStreamer::createStagingRing() {
+    const VkBufferCreateInfo bufferCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .size = kStagingSize,
+            .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = 1,
+            .pQueueFamilyIndices = &mQueueFamilyIndex,
+    };
+    ASSERT(mVk->CreateBuffer(mDevice, &bufferCreateInfo, nullptr, &mStagingBuffer) == VK_SUCCESS);
+
+    // Coherent memory so that the ring never needs a flush, mapped for the lifetime of the
+    // streamer by the allocator
+    mStagingMemory = mAllocator->allocateBuffer(
+            mStagingBuffer,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            MemoryAllocator::Pool::LINEAR);
+    mStagingData = mStagingMemory.mapped;
+    ASSERT(mStagingData);
+    mRingHead = mRingTail = 0;
+}
+
+void TextureStreamer::createBatches() {
+    VkCommandPoolCreateInfo commandPoolCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+                     VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = mQueueFamilyIndex,
+    };
+    ASSERT(mVk->CreateCommandPool(mDevice, &commandPoolCreateInfo, nullptr, &mCommandPool) ==
+           VK_SUCCESS);
+
+    VkCommandBuffer commandBuffers[kBatchCount];
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .commandPool = mCommandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = kBatchCount,
+    };
+    ASSERT(mVk->AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo, commandBuffers) ==
+           VK_SUCCESS);
+
+    VkCommandBuffer acquireCommandBuffers[kBatchCount] = {};
+    if (mOwnershipTransfer) {
+        commandPoolCreateInfo.queueFamilyIndex = mGraphicsQueueFamilyIndex;
+        ASSERT(mVk->CreateCommandPool(mDevice, &commandPoolCreateInfo, nullptr,
+                                      &mAcquireCommandPool) == VK_SUCCESS);
+        commandBufferAllocateInfo.commandPool = mAcquireCommandPool;
+        ASSERT(mVk->AllocateCommandBuffers(mDevice, &commandBufferAllocateInfo,
+                                           acquireCommandBuffers) == VK_SUCCESS);
+    }
+
+    const VkFenceCreateInfo fenceCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+    };
+    mBatches.resize(kBatchCount);
+    for (uint32_t i = 0; i < kBatchCount; i++) {
+        mBatches[i].commandBuffer = commandBuffers[i];
+        mBatches[i].acquireCommandBuffer = acquireCommandBuffers[i];
+        if (mTimelineSemaphore == VK_NULL_HANDLE) {
+            ASSERT(mVk->CreateFence(mDevice, &fenceCreateInfo, nullptr, &mBatches[i].fence) ==
+                   VK_SUCCESS);
+        }
+        mFreeBatches.push_back(i);
+    }
+}
+
+bool TextureStreamer::allocateStaging(VkDeviceSize size, VkDeviceSize* outOffset) {
+    // mRingHead and mRingTail grow monotonically, the physical offset is taken modulo the size
+    if (mRingHead == mRingTail && mRingHead % kStagingSize != 0) {
+        // Nothing is in flight, restart at a lap boundary so any size up to kStagingSize fits
+        mRingHead = mRingTail = (mRingHead / kStagingSize + 1) * kStagingSize;
+    }
+    uint64_t offset = (mRingHead + kStagingAlignment - 1) & ~(kStagingAlignment - 1);
+    if (offset % kStagingSize + size > kStagingSize) {
+        // Don't split an image across the end of the ring, skip to the start instead
+        offset = (offset / kStagingSize + 1) * kStagingSize;
+    }
+    if (offset + size - mRingTail > kStagingSize) {
+        return false;
+    }
+    mRingHead = offset + size;
+    *outOffset = offset % kStagingSize;
+    return true;
+}
+
+void TextureStreamer::waitOldestBatch() {
+    ASSERT(!mSubmittedBatches.empty());
+    const Batch& batch = mBatches[mSubmittedBatches.front()];
+    if (mTimelineSemaphore != VK_NULL_HANDLE) {
+        const VkSemaphoreWaitInfoKHR semaphoreWaitInfo = {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR,
+                .pNext = nullptr,
+                .flags = 0,
+                .semaphoreCount = 1,
+                .pSemaphores = &mTimelineSemaphore,
+                .pValues = &batch.timelineValue,
+        };
+        ASSERT(mVk->WaitSemaphoresKHR(mDevice, &semaphoreWaitInfo, kTimeout30Sec) == VK_SUCCESS);
+    } else {
+        ASSERT(mVk->WaitForFences(mDevice, 1, &batch.fence, VK_TRUE, kTimeout30Sec) ==
+               VK_SUCCESS);
+    }
+    reclaimBatches();
+}
+
+void TextureStreamer::reclaimBatches() {
+    // One query covers every batch tracked by the timeline semaphore
+    uint64_t completedValue = 0;
+    if (mTimelineSemaphore != VK_NULL_HANDLE && !mSubmittedBatches.empty()) {
+        ASSERT(mVk->GetSemaphoreCounterValueKHR(mDevice, mTimelineSemaphore, &completedValue) ==
+               VK_SUCCESS);
+    }
+    while (!mSubmittedBatches.empty()) {
+        const uint32_t batchIndex = mSubmittedBatches.front();
+        Batch& batch = mBatches[batchIndex];
+        if (mTimelineSemaphore != VK_NULL_HANDLE) {
+            if (batch.timelineValue > completedValue) {
+                break;
+            }
+        } else {
+            if (mVk->GetFenceStatus(mDevice, batch.fence) != VK_SUCCESS) {
+                break;
+            }
+            ASSERT(mVk->ResetFences(mDevice, 1, &batch.fence) == VK_SUCCESS);
+        }
+        mSubmittedBatches.pop_front();
+
+        mRingTail = batch.ringEnd;
+        // Without a timeline semaphore, cross queue uploads only become usable once complete
+        mReady.insert(mReady.end(), batch.uploads.begin(), batch.uploads.end());
+        batch.uploads.clear();
+        mFreeBatches.push_back(batchIndex);
+    }
+}
+
+TextureStreamer::StreamedTexture TextureStreamer::createTexture(const DecodedImage& image) {
+    StreamedTexture texture = {
+            .image = VK_NULL_HANDLE,
+            .memory = {},
+            .view = VK_NULL_HANDLE,
+            .width = image.width,
+            .height = image.height,
+            .levelCount = image.mipLevels,
+            .baseLevel = image.baseLevel,
+    };
+    const uint32_t levelCount = image.mipLevels;
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    if (levelCount > image.levels.size()) {
+        // Generated levels are blitted from the one above
+        usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
+
+    // Exclusive to a single family after an ownership transfer, which keeps the image eligible
+    // for framebuffer compression on some GPUs. Without one, concurrent sharing hands it over.
+    const bool isConcurrent = mIsCrossQueue && !mOwnershipTransfer;
+    const uint32_t queueFamilyIndices[2] = {mQueueFamilyIndex, mGraphicsQueueFamilyIndex};
+    const VkImageCreateInfo imageCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = image.format,
+            .extent =
+                    {
+                            .width = image.width,
+                            .height = image.height,
+                            .depth = 1,
+                    },
+            .mipLevels = levelCount,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = usage,
+            .sharingMode = isConcurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = isConcurrent ? 2U : 1U,
+            .pQueueFamilyIndices = queueFamilyIndices,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    ASSERT(mVk->CreateImage(mDevice, &imageCreateInfo, nullptr, &texture.image) == VK_SUCCESS);
+
+    texture.memory = mAllocator->allocateImage(texture.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                               MemoryAllocator::Pool::GENERAL);
+
+    const VkImageViewCreateInfo viewCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .image = texture.image,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = image.format,
+            .components =
+                    {
+                            VK_COMPONENT_SWIZZLE_R,
+                            VK_COMPONENT_SWIZZLE_G,
+                            VK_COMPONENT_SWIZZLE_B,
+                            VK_COMPONENT_SWIZZLE_A,
+                    },
+            .subresourceRange =
+                    {
+                            VK_IMAGE_ASPECT_COLOR_BIT,
+                            0,
+                            levelCount,
+                            0,
+                            1,
+                    },
+    };
+    ASSERT(mVk->CreateImageView(mDevice, &viewCreateInfo, nullptr, &texture.view) == VK_SUCCESS);
+
+    return texture;
+}
+
+void TextureStreamer::recordUpload(const Batch& batch, VkDeviceSize stagingOffset,
+                                   const DecodedImage& image, const StreamedTexture& texture) {
+    const VkCommandBuffer commandBuffer = batch.commandBuffer;
+    const uint32_t levelCount = (uint32_t)image.levels.size();
+    const VkImageSubresourceRange subresourceRange = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel = 0,
+            .levelCount = image.mipLevels,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+    };
+    VkImageMemoryBarrier imageMemoryBarrier = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = texture.image,
+            .subresourceRange = subresourceRange,
+    };
+    mVk->CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                            &imageMemoryBarrier);
+
+    // Levels are staged back to back, each one copied to its own mip level. Tightly packed rows
+    // are also what compressed formats expect, in units of blocks.
+    const uint8_t* imageData = getLevelData(image);
+    std::vector<VkBufferImageCopy> copyRegions(levelCount);
+    VkDeviceSize levelOffset = 0;
+    for (uint32_t i = 0; i < levelCount; i++) {
+        const Ktx2Level& level = image.levels[i];
+        levelOffset = (levelOffset + kLevelAlignment - 1) & ~(kLevelAlignment - 1);
+        memcpy(mStagingData + stagingOffset + levelOffset, imageData + level.offset, level.size);
+
+        copyRegions[i] = {
+                .bufferOffset = stagingOffset + levelOffset,
+                .bufferRowLength = 0,
+                .bufferImageHeight = 0,
+                .imageSubresource =
+                        {
+                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                .mipLevel = i,
+                                .baseArrayLayer = 0,
+                                .layerCount = 1,
+                        },
+                .imageOffset =
+                        {
+                                .x = 0,
+                                .y = 0,
+                                .z = 0,
+                        },
+                .imageExtent =
+                        {
+                                .width = std::max(texture.width >> i, 1U),
+                                .height = std::max(texture.height >> i, 1U),
+                                .depth = 1,
+                        },
+        };
+        levelOffset += level.size;
+    }
+    mVk->CmdCopyBufferToImage(commandBuffer, mStagingBuffer, texture.image,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, levelCount,
+                              copyRegions.data());
+
+    // Each generated level is blitted from the one above, which then moves to the transfer source
+    // layout. Only the graphics queue gets here, see mBlitMips.
+    VkImageMemoryBarrier levelBarrier = imageMemoryBarrier;
+    levelBarrier.subresourceRange.levelCount = 1;
+    for (uint32_t i = levelCount; i < image.mipLevels; i++) {
+        levelBarrier.subresourceRange.baseMipLevel = i - 1;
+        levelBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        levelBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        levelBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        levelBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        mVk->CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                                &levelBarrier);
+
+        const VkImageBlit blit = {
+                .srcSubresource =
+                        {
+                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                .mipLevel = i - 1,
+                                .baseArrayLayer = 0,
+                                .layerCount = 1,
+                        },
+                .srcOffsets =
+                        {
+                                {0, 0, 0},
+                                {(int32_t)std::max(texture.width >> (i - 1), 1U),
+                                 (int32_t)std::max(texture.height >> (i - 1), 1U), 1},
+                        },
+                .dstSubresource =
+                        {
+                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                .mipLevel = i,
+                                .baseArrayLayer = 0,
+                                .layerCount = 1,
+                        },
+                .dstOffsets =
+                        {
+                                {0, 0, 0},
+                                {(int32_t)std::max(texture.width >> i, 1U),
+                                 (int32_t)std::max(texture.height >> i, 1U), 1},
+                        },
+        };
+        mVk->CmdBlitImage(commandBuffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                          texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                          VK_FILTER_LINEAR);
+    }
+
+    // A transfer queue can't name the fragment shader stage. The acquire on the graphics queue,
+    // or the fence wait without an ownership transfer, provides the visibility there instead.
+    // After blits, the last level is still the transfer destination and all the others are blit
+    // sources.
+    const uint32_t lastLevel = image.mipLevels - 1;
+    imageMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageMemoryBarrier.dstAccessMask = mIsCrossQueue ? 0 : VK_ACCESS_SHADER_READ_BIT;
+    imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    if (mOwnershipTransfer) {
+        imageMemoryBarrier.srcQueueFamilyIndex = mQueueFamilyIndex;
+        imageMemoryBarrier.dstQueueFamilyIndex = mGraphicsQueueFamilyIndex;
+    }
+    uint32_t barrierCount = 1;
+    VkImageMemoryBarrier finalBarriers[2] = {imageMemoryBarrier, imageMemoryBarrier};
+    if (levelCount < image.mipLevels) {
+        finalBarriers[0].subresourceRange.baseMipLevel = lastLevel;
+        finalBarriers[0].subresourceRange.levelCount = 1;
+        finalBarriers[1].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        finalBarriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        finalBarriers[1].subresourceRange.levelCount = lastLevel;
+        barrierCount = 2;
+    }
+    mVk->CmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            mIsCrossQueue ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+                                          : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                            0, 0, nullptr, 0, nullptr, barrierCount, finalBarriers);
+    if (!mOwnershipTransfer) {
+        return;
+    }
+
+    // The matching acquire repeats the release with the same layouts and queue families. The
+    // submit waits for the upload at the fragment shader stage, which the barrier chains from.
+    for (uint32_t i = 0; i < barrierCount; i++) {
+        finalBarriers[i].srcAccessMask = 0;
+        finalBarriers[i].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    }
+    mVk->CmdPipelineBarrier(batch.acquireCommandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr,
+                            barrierCount, finalBarriers);
+}
+
+bool TextureStreamer::beginBatch(uint32_t* outBatchIndex) {
+    if (mFreeBatches.empty()) {
+        return false;
+    }
+    const uint32_t batchIndex = mFreeBatches.back();
+    mFreeBatches.pop_back();
+
+    const VkCommandBufferBeginInfo commandBufferBeginInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            .pInheritanceInfo = nullptr,
+    };
+    ASSERT(mVk->BeginCommandBuffer(mBatches[batchIndex].commandBuffer, &commandBufferBeginInfo) ==
+           VK_SUCCESS);
+    if (mOwnershipTransfer) {
+        ASSERT(mVk->BeginCommandBuffer(mBatches[batchIndex].acquireCommandBuffer,
+                                       &commandBufferBeginInfo) == VK_SUCCESS);
+    }
+
+    *outBatchIndex = batchIndex;
+    return true;
+}
+
+void TextureStreamer::submitAcquire(Batch* batch) {
+    ASSERT(mVk->EndCommandBuffer(batch->acquireCommandBuffer) == VK_SUCCESS);
+
+    // Waits for the upload and signals the next value, so that reclaiming the batch also covers
+    // the acquire commands on the graphics queue
+    const uint64_t waitValue = mTimelineValue;
+    const uint64_t signalValue = mTimelineValue + 1;
+    const VkTimelineSemaphoreSubmitInfoKHR timelineSubmitInfo = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+            .pNext = nullptr,
+            .waitSemaphoreValueCount = 1,
+            .pWaitSemaphoreValues = &waitValue,
+            .signalSemaphoreValueCount = 1,
+            .pSignalSemaphoreValues = &signalValue,
+    };
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    const VkSubmitInfo submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = &timelineSubmitInfo,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &mTimelineSemaphore,
+            .pWaitDstStageMask = &waitStage,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &batch->acquireCommandBuffer,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &mTimelineSemaphore,
+    };
+    {
+        std::lock_guard<std::mutex> lock(*mGraphicsQueueLock);
+        ASSERT(mVk->QueueSubmit(mGraphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) == VK_SUCCESS);
+    }
+    mTimelineValue = signalValue;
+    batch->timelineValue = signalValue;
+}
+
+void TextureStreamer::submitBatch(uint32_t batchIndex) {
+    Batch& batch = mBatches[batchIndex];
+    ASSERT(mVk->EndCommandBuffer(batch.commandBuffer) == VK_SUCCESS);
+
+    const uint64_t signalValue = mTimelineValue + 1;
+    const VkTimelineSemaphoreSubmitInfoKHR timelineSubmitInfo = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+            .pNext = nullptr,
+            .waitSemaphoreValueCount = 0,
+            .pWaitSemaphoreValues = nullptr,
+            .signalSemaphoreValueCount = 1,
+            .pSignalSemaphoreValues = &signalValue,
+    };
+    const bool signalTimeline = mTimelineSemaphore != VK_NULL_HANDLE;
+    const VkSubmitInfo submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = signalTimeline ? &timelineSubmitInfo : nullptr,
+            .waitSemaphoreCount = 0,
+            .pWaitSemaphores = nullptr,
+            .pWaitDstStageMask = nullptr,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &batch.commandBuffer,
+            .signalSemaphoreCount = signalTimeline ? 1U : 0U,
+            .pSignalSemaphores = &mTimelineSemaphore,
+    };
+    {
+        std::lock_guard<std::mutex> lock(*mGraphicsQueueLock);
+        ASSERT(mVk->QueueSubmit(mQueue, 1, &submitInfo, batch.fence) == VK_SUCCESS);
+    }
+    if (signalTimeline) {
+        mTimelineValue = signalValue;
+        batch.timelineValue = signalValue;
+    }
+    if (mOwnershipTransfer) {
+        submitAcquire(&batch);
+    }
+    mSubmittedBatches.push_back(batchIndex);
+
+    // Same queue submission order or the acquire submitted ahead of the next frame makes these
+    // usable by it
+    if (!mIsCrossQueue || signalTimeline) {
+        mReady.insert(mReady.end(), batch.uploads.begin(), batch.uploads.end());
+        batch.uploads.clear();
+    }
+}
+
+void TextureStreamer::destroyTexture(StreamedTexture* texture) {
+    mVk->DestroyImageView(mDevice, texture->view, nullptr);
+    mVk->DestroyImage(mDevice, texture->image, nullptr);
+    mAllocator->free(&texture->memory);
+    *texture = {};
+}
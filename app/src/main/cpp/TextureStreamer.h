@@ -0,0 +1,231 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/asset_manager.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AssetView.h"
+#include "Ktx2.h"
+#include "MemoryAllocator.h"
+#include "VkHelper.h"
+
+// Decodes textures on a pool of worker threads and uploads them through a persistent staging ring
+// buffer, batching all the copies ready in a frame into one submit. A KTX2 file next to a
+// requested image, e.g. foo.ktx2 for foo.png, is uploaded as is with all its mip levels when the
+// device can sample its compressed format, otherwise the image is decoded to RGBA8.
+//
+// RGBA8 images without mip levels get a full chain, blitted after the copy when uploading on the
+// graphics queue, or box filtered by the decode workers for a transfer queue, which can't blit.
+// A request may also be limited to the levels up to a given size, the low resolution mip tail of
+// the image, which is always generated on the CPU.
+//
+// Uploads go to the transfer queue when the device has a dedicated one. With timeline semaphores,
+// the textures are then exclusive to the graphics queue family after an ownership transfer,
+// released on the transfer queue and acquired by a small graphics submit waiting for the upload
+// on the GPU. Without them the textures are shared concurrently instead, and only become ready
+// once their upload has completed. Batches are tracked by the value they signal on the timeline
+// semaphore, or by a fence each when timeline semaphores are not supported.
+//
+// Apart from the decode workers, everything runs on the render thread. The graphics queue is
+// shared with the renderer's submit thread, so every submit holds the lock that comes with it.
+class TextureStreamer {
+public:
+    struct StreamedTexture {
+        VkImage image;
+        MemoryAllocator::Allocation memory;
+        VkImageView view;
+        uint32_t width;
+        uint32_t height;
+        uint32_t levelCount;
+        // Level of the requested image the first level is, not 0 for a mip tail
+        uint32_t baseLevel;
+    };
+
+    struct UploadBenchmark {
+        uint32_t width;
+        uint32_t height;
+        // Writing the pixels into the staging ring on the CPU
+        double stagingMBps;
+        // Submit to completion for vkCmdCopyBufferToImage out of the ring
+        double copyMBps;
+    };
+
+    explicit TextureStreamer() {}
+    // transferQueue may be the graphics queue itself, in which case no handoff is needed.
+    // graphicsQueueLock is held around every submit, to either queue.
+    void initialize(VkHelper* vk, VkPhysicalDevice gpu, VkDevice device,
+                    MemoryAllocator* allocator, AAssetManager* assetManager, VkQueue transferQueue,
+                    uint32_t transferQueueFamilyIndex, VkQueue graphicsQueue,
+                    uint32_t graphicsQueueFamilyIndex, std::mutex* graphicsQueueLock,
+                    bool timelineSemaphoreEnabled);
+    // The device must be idle
+    void destroy();
+    // Only reads the image header on the calling thread, so the final size is known right away.
+    // The KTX2 and the fallback image must have the same size. A maxSize other than 0 only
+    // uploads the levels no larger than maxSize on either side, and nothing for a KTX2 without
+    // such a level. The size returned is the one of the whole image either way.
+    void requestFromAsset(uint32_t id, const char* filePath, uint32_t maxSize, uint32_t* outWidth,
+                          uint32_t* outHeight);
+    // Uploads pixels already in memory, e.g. a placeholder. The texture can be sampled by the next
+    // graphics submit. Blocks for the upload only when neither submission order nor a timeline
+    // semaphore can order it against the graphics queue.
+    StreamedTexture uploadPixels(const uint8_t* pixels, uint32_t width, uint32_t height);
+    // Reclaims finished uploads and submits the newly decoded ones, call once per frame
+    void update();
+    // Ownership of the texture moves to the caller
+    bool popReadyTexture(uint32_t* outId, StreamedTexture* outTexture);
+    // Uploads synthetic RGBA8 textures of the given size back to back and measures throughput.
+    // Blocks until all the uploads have completed, so only meant for benchmark builds.
+    UploadBenchmark benchmarkUpload(uint32_t width, uint32_t height, uint32_t iterations);
+
+private:
+    struct DecodeJob {
+        uint32_t id;
+        // Either a KTX2 file already checked to be supported or an image stb can decode
+        std::string filePath;
+        // 0 for the whole image
+        uint32_t maxSize;
+    };
+
+    struct DecodedImage {
+        uint32_t id;
+        VkFormat format;
+        uint32_t width;
+        uint32_t height;
+        // Pixels decoded by stb, or nullptr if the levels point into data or file instead
+        uint8_t* pixels;
+        // The KTX2 file, staged straight out of the asset view
+        AssetView file;
+        // Mip chain generated on the CPU, takes precedence over file when not empty
+        std::vector<uint8_t> data;
+        std::vector<Ktx2Level> levels;
+        // Levels of the image to create, the ones past levels are blitted from the last staged one
+        uint32_t mipLevels;
+        // Levels of the source image dropped from the front, with width and height those of the
+        // first one left
+        uint32_t baseLevel;
+    };
+
+    struct Upload {
+        uint32_t id;
+        StreamedTexture texture;
+    };
+
+    struct Batch {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        // Acquires the ownership of the uploaded textures on the graphics queue, only allocated
+        // with mOwnershipTransfer
+        VkCommandBuffer acquireCommandBuffer = VK_NULL_HANDLE;
+        // Only created without mTimelineSemaphore
+        VkFence fence = VK_NULL_HANDLE;
+        // Value signaled on mTimelineSemaphore by the last submit of the batch, the acquire one
+        // with mOwnershipTransfer
+        uint64_t timelineValue = 0;
+        // Ring position to release once the batch has completed
+        uint64_t ringEnd = 0;
+        std::vector<Upload> uploads;
+    };
+
+    void queueDecodeJob(uint32_t id, const std::string& filePath, uint32_t maxSize);
+    void decodeThreadMain();
+    bool isFormatSupported(VkFormat format);
+    static VkDeviceSize getStagingSize(const DecodedImage& image);
+    // The pointer the level offsets of the image are relative to
+    static const uint8_t* getLevelData(const DecodedImage& image);
+    static void freeDecodedImage(DecodedImage* image);
+    // Sets mipLevels, and replaces the pixels by the full chain unless it can and may be blitted.
+    // Frees the pixels if the image owns them.
+    void generateMipLevels(DecodedImage* image, bool ownsPixels, bool allowBlit) const;
+    // Drops the staged levels larger than maxSize, returns false if none is small enough
+    static bool dropLevelsAbove(DecodedImage* image, uint32_t maxSize);
+    void createStagingRing();
+    void createBatches();
+    bool allocateStaging(VkDeviceSize size, VkDeviceSize* outOffset);
+    void waitOldestBatch();
+    void reclaimBatches();
+    StreamedTexture createTexture(const DecodedImage& image);
+    // Copies the image into the ring at stagingOffset and records the copies out of it
+    void recordUpload(const Batch& batch, VkDeviceSize stagingOffset,
+                      const DecodedImage& image, const StreamedTexture& texture);
+    bool beginBatch(uint32_t* outBatchIndex);
+    void submitBatch(uint32_t batchIndex);
+    // Submits the acquire half of the ownership transfer on the graphics queue after the upload
+    void submitAcquire(Batch* batch);
+    void destroyTexture(StreamedTexture* texture);
+
+    VkHelper* mVk = nullptr;
+    VkPhysicalDevice mGpu = VK_NULL_HANDLE;
+    VkDevice mDevice = VK_NULL_HANDLE;
+    MemoryAllocator* mAllocator = nullptr;
+    AAssetManager* mAssetManager = nullptr;
+    VkQueue mQueue = VK_NULL_HANDLE;
+    uint32_t mQueueFamilyIndex = 0;
+    VkQueue mGraphicsQueue = VK_NULL_HANDLE;
+    uint32_t mGraphicsQueueFamilyIndex = 0;
+    // Also guards mQueue, which may be the same queue
+    std::mutex* mGraphicsQueueLock = nullptr;
+    // Uploads on another queue are handed over with an ownership transfer synchronized by
+    // mTimelineSemaphore, or shared concurrently and wait for their fence when timeline semaphores
+    // are not available
+    bool mIsCrossQueue = false;
+    bool mOwnershipTransfer = false;
+    // RGBA8 mip levels are generated with vkCmdBlitImage, only set before the decode workers start
+    bool mBlitMips = false;
+    // Signaled by every batch when timeline semaphores are supported, on either queue
+    VkSemaphore mTimelineSemaphore = VK_NULL_HANDLE;
+    uint64_t mTimelineValue = 0;
+
+    // Decode worker members, mJobLock protects the job queue and mDecodedLock the results
+    std::vector<std::thread> mDecodeThreads;
+    std::mutex mJobLock;
+    std::condition_variable mJobCondition;
+    std::deque<DecodeJob> mJobs;
+    bool mStopDecoding = false;
+    std::mutex mDecodedLock;
+    std::vector<DecodedImage> mDecoded;
+
+    // Render thread only members
+    std::vector<DecodedImage> mStalled;
+    VkBuffer mStagingBuffer = VK_NULL_HANDLE;
+    MemoryAllocator::Allocation mStagingMemory;
+    uint8_t* mStagingData = nullptr;
+    uint64_t mRingHead = 0;
+    uint64_t mRingTail = 0;
+    VkCommandPool mCommandPool = VK_NULL_HANDLE;
+    // On the graphics queue family, only created with mOwnershipTransfer
+    VkCommandPool mAcquireCommandPool = VK_NULL_HANDLE;
+    std::vector<Batch> mBatches;
+    std::vector<uint32_t> mFreeBatches;
+    // Batch indices in submission order, completing in the same order on the one queue
+    std::deque<uint32_t> mSubmittedBatches;
+    std::vector<Upload> mReady;
+
+    static constexpr const uint32_t kMaxDecodeThreads = 4;
+    static constexpr const VkDeviceSize kStagingSize = 32 * 1024 * 1024;
+    static constexpr const VkDeviceSize kStagingAlignment = 256;
+    // Copies of compressed levels must start on a block boundary, 16 bytes covers ASTC and ETC2
+    static constexpr const VkDeviceSize kLevelAlignment = 16;
+    static constexpr const uint32_t kBatchCount = 4;
+    static constexpr const uint64_t kTimeout30Sec = 30000000000;
+};
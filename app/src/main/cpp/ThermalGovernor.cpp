@@ -0,0 +1,152 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ThermalGovernor.h"
+
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "Utils.h"
+
+// AThermal is only available from API 30, and the headroom from API 31, while this app targets
+// API 29, so they are resolved at runtime.
+typedef AThermalManager* (*PFN_AThermal_acquireManager)();
+typedef void (*PFN_AThermal_releaseManager)(AThermalManager*);
+typedef AThermalStatus (*PFN_AThermal_getCurrentThermalStatus)(AThermalManager*);
+typedef float (*PFN_AThermal_getThermalHeadroom)(AThermalManager*, int);
+
+struct ThermalApi {
+    PFN_AThermal_acquireManager acquireManager = nullptr;
+    PFN_AThermal_releaseManager releaseManager = nullptr;
+    PFN_AThermal_getCurrentThermalStatus getCurrentThermalStatus = nullptr;
+    PFN_AThermal_getThermalHeadroom getThermalHeadroom = nullptr;
+
+    ThermalApi() {
+        void* lib = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+        if (!lib) {
+            return;
+        }
+        acquireManager = reinterpret_cast<PFN_AThermal_acquireManager>(
+                dlsym(lib, "AThermal_acquireManager"));
+        releaseManager = reinterpret_cast<PFN_AThermal_releaseManager>(
+                dlsym(lib, "AThermal_releaseManager"));
+        getCurrentThermalStatus = reinterpret_cast<PFN_AThermal_getCurrentThermalStatus>(
+                dlsym(lib, "AThermal_getCurrentThermalStatus"));
+        getThermalHeadroom = reinterpret_cast<PFN_AThermal_getThermalHeadroom>(
+                dlsym(lib, "AThermal_getThermalHeadroom"));
+    }
+};
+
+static const ThermalApi& getThermalApi() {
+    static const ThermalApi api;
+    return api;
+}
+
+void ThermalGovernor::start() {
+    const ThermalApi& api = getThermalApi();
+    if (api.acquireManager && api.releaseManager && api.getCurrentThermalStatus) {
+        mThermalManager = api.acquireManager();
+    }
+    mLastEvaluationNanos = 0;
+    mStableEvaluations = 0;
+    mRecoveryEvaluations = 0;
+    ALOGD("%s: thermal manager = %d, headroom = %d, level = %u", __FUNCTION__,
+          mThermalManager != nullptr, api.getThermalHeadroom != nullptr, mLevel);
+}
+
+void ThermalGovernor::stop() {
+    if (mThermalManager) {
+        getThermalApi().releaseManager(mThermalManager);
+        mThermalManager = nullptr;
+    }
+}
+
+AThermalStatus ThermalGovernor::getThermalStatus() const {
+    if (!mThermalManager) {
+        return ATHERMAL_STATUS_ERROR;
+    }
+    return getThermalApi().getCurrentThermalStatus(mThermalManager);
+}
+
+float ThermalGovernor::getThermalHeadroom() const {
+    if (!mThermalManager || !getThermalApi().getThermalHeadroom) {
+        return NAN;
+    }
+    return getThermalApi().getThermalHeadroom(mThermalManager, kHeadroomForecastSeconds);
+}
+
+bool ThermalGovernor::update(int64_t frameTimeNanos, const FrameMetrics& metrics,
+                             int64_t refreshPeriodNanos) {
+    if (frameTimeNanos - mLastEvaluationNanos < kEvaluationIntervalNanos) {
+        return false;
+    }
+    mLastEvaluationNanos = frameTimeNanos;
+    mStableEvaluations++;
+
+    // Same cost model as the pacer, the slower of the CPU and the GPU bounds the frame rate. The
+    // load is relative to the longest frame time the level allows without the pacer stepping in.
+    const Level& level = kLevels[mLevel];
+    const int64_t cpuNanos = metrics.getSummary(FrameMetrics::RECORD).p95 +
+                             metrics.getSummary(FrameMetrics::SUBMIT).p95;
+    const int64_t gpuNanos = metrics.getSummary(FrameMetrics::GPU_RENDER_PASS).p95;
+    const float load = (float)std::max(cpuNanos, gpuNanos) /
+                       (float)(refreshPeriodNanos * level.minSwapInterval);
+
+    // The status floors the level, the headroom forecast drops it before the status escalates
+    const AThermalStatus status = getThermalStatus();
+    const float headroom = getThermalHeadroom();
+    uint32_t minLevel = 0;
+    if (status >= ATHERMAL_STATUS_SEVERE) {
+        minLevel = kSevereLevel;
+    } else if (status == ATHERMAL_STATUS_MODERATE) {
+        minLevel = kModerateLevel;
+    }
+    const bool isHot = status >= ATHERMAL_STATUS_MODERATE ||
+                       (!std::isnan(headroom) && headroom >= kHighHeadroom);
+    const bool isCool = status <= ATHERMAL_STATUS_LIGHT &&
+                        (std::isnan(headroom) || headroom < kLowHeadroom);
+
+    uint32_t newLevel = std::max(mLevel, minLevel);
+    if (newLevel == mLevel && mLevel + 1 < kLevelCount && (isHot || load > kHighLoad) &&
+        mStableEvaluations > kSettleEvaluations) {
+        newLevel = mLevel + 1;
+    }
+
+    // Only the GPU cost scales with the pixel count, so this overestimates at worst
+    if (newLevel == mLevel && mLevel > minLevel) {
+        const Level& above = kLevels[mLevel - 1];
+        const float pixelRatio = (above.renderScale * above.renderScale) /
+                                 (level.renderScale * level.renderScale);
+        const float predictedLoad = load * pixelRatio * (float)level.minSwapInterval /
+                                    (float)above.minSwapInterval;
+        mRecoveryEvaluations = (isCool && predictedLoad < kLowLoad) ? mRecoveryEvaluations + 1 : 0;
+        if (mRecoveryEvaluations >= kRecoveryEvaluations) {
+            newLevel = mLevel - 1;
+        }
+    }
+
+    if (newLevel == mLevel) {
+        return false;
+    }
+    ALOGD("%s: level %u -> %u, status %d, headroom %.2f, load %.2f", __FUNCTION__, mLevel,
+          newLevel, status, headroom, load);
+    mLevel = newLevel;
+    mStableEvaluations = 0;
+    mRecoveryEvaluations = 0;
+    return true;
+}
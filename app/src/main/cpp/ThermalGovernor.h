@@ -0,0 +1,85 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android/thermal.h>
+
+#include <cstdint>
+
+#include "FrameMetrics.h"
+
+// Trades render resolution, then frame rate, for a frame rate the device can sustain once it
+// heats up. Once a second it combines the AThermal status and headroom forecast, where available,
+// with the p95 frame cost from FrameMetrics into a quality level. Each level has a render scale
+// for the swapchain, upscaled by the compositor, and a floor for the pacer's swap interval.
+// Quality drops one level as soon as the budget or the thermal headroom runs out, and only comes
+// back after a long stretch where the higher level is predicted to fit, so it settles instead of
+// oscillating between bursts of full and collapsed frame rates.
+class ThermalGovernor {
+public:
+    explicit ThermalGovernor() {}
+    void start();
+    void stop();
+    // Call once per frame before pacing it, returns true if the level has changed
+    bool update(int64_t frameTimeNanos, const FrameMetrics& metrics, int64_t refreshPeriodNanos);
+    float getRenderScale() const { return kLevels[mLevel].renderScale; }
+    uint32_t getMinSwapInterval() const { return kLevels[mLevel].minSwapInterval; }
+
+private:
+    struct Level {
+        float renderScale;
+        uint32_t minSwapInterval;
+    };
+
+    // Returns ATHERMAL_STATUS_ERROR and NaN respectively when unavailable
+    AThermalStatus getThermalStatus() const;
+    float getThermalHeadroom() const;
+
+    AThermalManager* mThermalManager = nullptr;
+    int64_t mLastEvaluationNanos = 0;
+    uint32_t mLevel = 0;
+    // Consecutive evaluations since the last change, and ones where the level above was predicted
+    // to fit
+    uint32_t mStableEvaluations = 0;
+    uint32_t mRecoveryEvaluations = 0;
+
+    static constexpr const Level kLevels[] = {
+            {1.0F, 1},
+            {0.85F, 1},
+            {0.7F, 1},
+            // From here on at most half the refresh rate
+            {0.7F, 2},
+            {0.5F, 2},
+    };
+    static constexpr const uint32_t kLevelCount = sizeof(kLevels) / sizeof(kLevels[0]);
+    // Lowest levels allowed at the moderate and severe thermal status
+    static constexpr const uint32_t kModerateLevel = 1;
+    static constexpr const uint32_t kSevereLevel = 3;
+    // The headroom may only be queried once a second
+    static constexpr const int64_t kEvaluationIntervalNanos = 1000000000;
+    static constexpr const int kHeadroomForecastSeconds = 10;
+    // Headroom of 1 is where the device starts throttling
+    static constexpr const float kHighHeadroom = 0.9F;
+    static constexpr const float kLowHeadroom = 0.7F;
+    // Share of the frame budget the p95 frame cost may take before dropping a level, and that the
+    // level above must be predicted to stay under before recovering
+    static constexpr const float kHighLoad = 0.9F;
+    static constexpr const float kLowLoad = 0.7F;
+    // Evaluations after a change before the next drop, letting the metrics catch up
+    static constexpr const uint32_t kSettleEvaluations = 2;
+    static constexpr const uint32_t kRecoveryEvaluations = 10;
+};
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UploadRing.h"
+
+#include "Utils.h"
+
+void UploadRing::initialize(VkHelper* vk, VkDevice device, MemoryAllocator* allocator,
+                            uint32_t queueFamilyIndex, uint32_t frameCount,
+                            VkDeviceSize frameSize, VkBufferUsageFlags usage,
+                            VkDeviceSize alignment) {
+    ASSERT(vk);
+    ASSERT(allocator);
+    ASSERT(frameCount);
+    ASSERT(alignment);
+    mVk = vk;
+    mDevice = device;
+    mAllocator = allocator;
+    mAlignment = alignment;
+    // Each slice starts aligned as well
+    mFrameSize = MemoryAllocator::alignUp(frameSize, alignment);
+
+    const VkBufferCreateInfo bufferCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .size = mFrameSize * frameCount,
+            .usage = usage,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = 1,
+            .pQueueFamilyIndices = &queueFamilyIndex,
+    };
+    ASSERT(mVk->CreateBuffer(mDevice, &bufferCreateInfo, nullptr, &mBuffer) == VK_SUCCESS);
+
+    // Any host visible memory will do, end flushes it when it is not coherent
+    mMemory = mAllocator->allocateBuffer(mBuffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                                         MemoryAllocator::Pool::LINEAR);
+    ASSERT(mMemory.mapped);
+    mFrameStart = mHead = mLastOffset = 0;
+    mIsWriting = false;
+
+    ALOGD("Successfully created upload ring: %llu KB x %u frames, coherent = %d",
+          (unsigned long long)mFrameSize / 1024, frameCount,
+          mAllocator->isHostCoherent(mMemory));
+}
+
+void UploadRing::destroy() {
+    mVk->DestroyBuffer(mDevice, mBuffer, nullptr);
+    mBuffer = VK_NULL_HANDLE;
+    mAllocator->free(&mMemory);
+    mIsWriting = false;
+}
+
+void UploadRing::begin(uint32_t frameIndex) {
+    ASSERT(!mIsWriting);
+    mFrameStart = mFrameSize * frameIndex;
+    ASSERT(mFrameStart + mFrameSize <= mMemory.size);
+    mHead = mLastOffset = mFrameStart;
+    mIsWriting = true;
+}
+
+UploadRing::Allocation UploadRing::allocate(VkDeviceSize size) {
+    ASSERT(mIsWriting);
+    const VkDeviceSize offset = MemoryAllocator::alignUp(mHead, mAlignment);
+    ASSERT(offset + size <= mFrameStart + mFrameSize);
+    mHead = offset + size;
+    mLastOffset = offset;
+    return {
+            .buffer = mBuffer,
+            .offset = offset,
+            .mapped = mMemory.mapped + offset,
+    };
+}
+
+void UploadRing::trimLast(VkDeviceSize size) {
+    ASSERT(mIsWriting);
+    ASSERT(mLastOffset + size <= mHead);
+    mHead = mLastOffset + size;
+}
+
+void UploadRing::end() {
+    ASSERT(mIsWriting);
+    mAllocator->flush(mMemory, mFrameStart, mHead - mFrameStart);
+    mIsWriting = false;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2019 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "MemoryAllocator.h"
+#include "VkHelper.h"
+
+// Linear allocator for the data a frame hands to the GPU, e.g. vertices, indices and uniforms,
+// out of one persistently mapped buffer with a slice per frame in flight. A slice is only reset
+// once its frame's previous submission has completed, so an allocation is a bump of the head
+// with nothing allocated from the driver. The written range is flushed at the end of the frame
+// if the memory is not host coherent. Uniforms are bound with a dynamic offset into the buffer.
+//
+// Not thread safe, a frame is written on the render thread only.
+class UploadRing {
+public:
+    struct Allocation {
+        VkBuffer buffer;
+        // From the start of buffer, a multiple of the alignment passed to initialize
+        VkDeviceSize offset;
+        uint8_t* mapped;
+    };
+
+    explicit UploadRing() {}
+    // alignment applies to every allocation, at least the strictest offset alignment of the
+    // usages, e.g. minUniformBufferOffsetAlignment for uniforms
+    void initialize(VkHelper* vk, VkDevice device, MemoryAllocator* allocator,
+                    uint32_t queueFamilyIndex, uint32_t frameCount, VkDeviceSize frameSize,
+                    VkBufferUsageFlags usage, VkDeviceSize alignment);
+    void destroy();
+    // Previous submissions using frameIndex must have completed
+    void begin(uint32_t frameIndex);
+    // The frame's slice must have room for size more bytes
+    Allocation allocate(VkDeviceSize size);
+    // Shrinks the last allocation to size bytes, for data only known once it has been written
+    void trimLast(VkDeviceSize size);
+    // Makes what was written since begin visible to the device, call before the frame's submit
+    void end();
+    VkBuffer getBuffer() const { return mBuffer; }
+
+private:
+    VkHelper* mVk = nullptr;
+    VkDevice mDevice = VK_NULL_HANDLE;
+    MemoryAllocator* mAllocator = nullptr;
+    VkDeviceSize mFrameSize = 0;
+    VkDeviceSize mAlignment = 1;
+    VkBuffer mBuffer = VK_NULL_HANDLE;
+    MemoryAllocator::Allocation mMemory;
+
+    // State of the frame being written between begin and end, offsets from the start of mBuffer
+    VkDeviceSize mFrameStart = 0;
+    VkDeviceSize mHead = 0;
+    VkDeviceSize mLastOffset = 0;
+    bool mIsWriting = false;
+};
@@ -18,97 +18,163 @@
 
 #include <vulkan/vulkan.h>
 
+// The entry points as X macro lists, which generate both the members of VkHelper and the code
+// resolving them, so adding one is a single line. Each list is kept alphabetical.
+#define VK_HELPER_GLOBAL_FUNCTIONS(X)       \
+    X(CreateInstance)                       \
+    X(EnumerateInstanceExtensionProperties) \
+    X(EnumerateInstanceVersion)
+
+#define VK_HELPER_INSTANCE_FUNCTIONS(X)        \
+    X(CreateAndroidSurfaceKHR)                 \
+    X(CreateDevice)                            \
+    X(DestroyInstance)                         \
+    X(DestroySurfaceKHR)                       \
+    X(EnumerateDeviceExtensionProperties)      \
+    X(EnumeratePhysicalDevices)                \
+    X(GetDeviceProcAddr)                       \
+    X(GetPhysicalDeviceFeatures2)              \
+    X(GetPhysicalDeviceFormatProperties)       \
+    X(GetPhysicalDeviceMemoryProperties)       \
+    X(GetPhysicalDeviceMemoryProperties2)      \
+    X(GetPhysicalDeviceProperties)             \
+    X(GetPhysicalDeviceQueueFamilyProperties)  \
+    X(GetPhysicalDeviceSurfaceCapabilitiesKHR) \
+    X(GetPhysicalDeviceSurfaceFormatsKHR)      \
+    X(GetPhysicalDeviceSurfacePresentModesKHR) \
+    X(GetPhysicalDeviceSurfaceSupportKHR)
+
+// Called every frame, or for every draw in the case of the commands
+#define VK_HELPER_HOT_DEVICE_FUNCTIONS(X) \
+    X(AcquireNextImageKHR)                \
+    X(BeginCommandBuffer)                 \
+    X(CmdBeginRenderPass)                 \
+    X(CmdBindDescriptorSets)              \
+    X(CmdBindPipeline)                    \
+    X(CmdBindVertexBuffers)               \
+    X(CmdDispatch)                        \
+    X(CmdDraw)                            \
+    X(CmdEndRenderPass)                   \
+    X(CmdExecuteCommands)                 \
+    X(CmdPipelineBarrier)                 \
+    X(CmdPushConstants)                   \
+    X(CmdResetQueryPool)                  \
+    X(CmdSetScissor)                      \
+    X(CmdSetViewport)                     \
+    X(CmdWriteTimestamp)                  \
+    X(EndCommandBuffer)                   \
+    X(FlushMappedMemoryRanges)            \
+    X(GetFenceStatus)                     \
+    X(QueuePresentKHR)                    \
+    X(QueueSubmit)                        \
+    X(ResetFences)                        \
+    X(UpdateDescriptorSets)               \
+    X(WaitForFences)
+
+#define VK_HELPER_COLD_DEVICE_FUNCTIONS(X) \
+    X(AllocateCommandBuffers)              \
+    X(AllocateDescriptorSets)              \
+    X(AllocateMemory)                      \
+    X(BindBufferMemory)                    \
+    X(BindImageMemory)                     \
+    X(CmdBlitImage)                        \
+    X(CmdCopyBuffer)                       \
+    X(CmdCopyBufferToImage)                \
+    X(CreateBuffer)                        \
+    X(CreateCommandPool)                   \
+    X(CreateComputePipelines)              \
+    X(CreateDescriptorPool)                \
+    X(CreateDescriptorSetLayout)           \
+    X(CreateFence)                         \
+    X(CreateFramebuffer)                   \
+    X(CreateGraphicsPipelines)             \
+    X(CreateImage)                         \
+    X(CreateImageView)                     \
+    X(CreatePipelineCache)                 \
+    X(CreatePipelineLayout)                \
+    X(CreateQueryPool)                     \
+    X(CreateRenderPass)                    \
+    X(CreateSampler)                       \
+    X(CreateSemaphore)                     \
+    X(CreateShaderModule)                  \
+    X(CreateSwapchainKHR)                  \
+    X(DestroyBuffer)                       \
+    X(DestroyCommandPool)                  \
+    X(DestroyDescriptorPool)               \
+    X(DestroyDescriptorSetLayout)          \
+    X(DestroyDevice)                       \
+    X(DestroyFence)                        \
+    X(DestroyFramebuffer)                  \
+    X(DestroyImage)                        \
+    X(DestroyImageView)                    \
+    X(DestroyPipeline)                     \
+    X(DestroyPipelineCache)                \
+    X(DestroyPipelineLayout)               \
+    X(DestroyQueryPool)                    \
+    X(DestroyRenderPass)                   \
+    X(DestroySampler)                      \
+    X(DestroySemaphore)                    \
+    X(DestroyShaderModule)                 \
+    X(DestroySwapchainKHR)                 \
+    X(DeviceWaitIdle)                      \
+    X(FreeCommandBuffers)                  \
+    X(FreeMemory)                          \
+    X(GetBufferMemoryRequirements)         \
+    X(GetDeviceQueue)                      \
+    X(GetImageMemoryRequirements)          \
+    X(GetImageMemoryRequirements2)         \
+    X(GetImageSubresourceLayout)           \
+    X(GetPipelineCacheData)                \
+    X(GetQueryPoolResults)                 \
+    X(GetSwapchainImagesKHR)               \
+    X(MapMemory)                           \
+    X(ResetCommandPool)                    \
+    X(UnmapMemory)
+
+// VK_GOOGLE_display_timing
+#define VK_HELPER_DISPLAY_TIMING_FUNCTIONS(X) \
+    X(GetPastPresentationTimingGOOGLE)        \
+    X(GetRefreshCycleDurationGOOGLE)
+
+// VK_KHR_timeline_semaphore, along with the core names it got promoted to in Vulkan 1.2
+#define VK_HELPER_TIMELINE_SEMAPHORE_FUNCTIONS(X)            \
+    X(GetSemaphoreCounterValueKHR, GetSemaphoreCounterValue) \
+    X(WaitSemaphoresKHR, WaitSemaphores)
+
+#define VK_HELPER_DECLARE_FUNCTION(F) PFN_vk##F F = nullptr;
+#define VK_HELPER_DECLARE_PROMOTED_FUNCTION(F, CORE) PFN_vk##F F = nullptr;
+
+// Dispatch table of the Vulkan entry points the app uses. The device level table starts with the
+// hot entries on a cache line boundary, followed by the per frame extension entries, so that a
+// frame touches as few cache lines of it as possible. Extension entries are only resolved for the
+// extensions the device was created with.
 class VkHelper {
 public:
+    // Device extensions with entry points of their own. VK_EXT_descriptor_indexing only adds
+    // features and limits, so it needs nothing here.
+    struct DeviceExtensions {
+        bool displayTiming;
+        bool timelineSemaphore;
+    };
+
     explicit VkHelper() {}
     void initializeGlobalApi();
     void initializeInstanceApi(VkInstance instance);
-    void initializeDeviceApi(VkDevice device);
+    // apiVersion is the version the device is used at. Extensions promoted to core by then
+    // resolve through their core names, which the driver has to expose.
+    void initializeDeviceApi(VkDevice device, uint32_t apiVersion,
+                             const DeviceExtensions& extensions);
 
-    // GET_PROC functions
-    PFN_vkCreateInstance CreateInstance = nullptr;
-    PFN_vkEnumerateInstanceExtensionProperties EnumerateInstanceExtensionProperties = nullptr;
-    PFN_vkEnumerateInstanceVersion EnumerateInstanceVersion = nullptr;
+    // Device level functions, the extension ones are only valid if the extension is enabled.
+    // alignas only applies to the first of the hot entries, which puts them all on one boundary.
+    alignas(64) VK_HELPER_HOT_DEVICE_FUNCTIONS(VK_HELPER_DECLARE_FUNCTION)
+    VK_HELPER_TIMELINE_SEMAPHORE_FUNCTIONS(VK_HELPER_DECLARE_PROMOTED_FUNCTION)
+    VK_HELPER_DISPLAY_TIMING_FUNCTIONS(VK_HELPER_DECLARE_FUNCTION)
+    VK_HELPER_COLD_DEVICE_FUNCTIONS(VK_HELPER_DECLARE_FUNCTION)
 
-    // GET_INSTANCE_PROC functions
-    PFN_vkCreateAndroidSurfaceKHR CreateAndroidSurfaceKHR = nullptr;
-    PFN_vkCreateDevice CreateDevice = nullptr;
-    PFN_vkDestroyInstance DestroyInstance = nullptr;
-    PFN_vkDestroySurfaceKHR DestroySurfaceKHR = nullptr;
-    PFN_vkEnumerateDeviceExtensionProperties EnumerateDeviceExtensionProperties = nullptr;
-    PFN_vkEnumeratePhysicalDevices EnumeratePhysicalDevices = nullptr;
-    PFN_vkGetDeviceProcAddr GetDeviceProcAddr = nullptr;
-    PFN_vkGetPhysicalDeviceFormatProperties GetPhysicalDeviceFormatProperties = nullptr;
-    PFN_vkGetPhysicalDeviceMemoryProperties GetPhysicalDeviceMemoryProperties = nullptr;
-    PFN_vkGetPhysicalDeviceSurfaceCapabilitiesKHR GetPhysicalDeviceSurfaceCapabilitiesKHR = nullptr;
-    PFN_vkGetPhysicalDeviceSurfaceFormatsKHR GetPhysicalDeviceSurfaceFormatsKHR = nullptr;
-    PFN_vkGetPhysicalDeviceSurfaceSupportKHR GetPhysicalDeviceSurfaceSupportKHR = nullptr;
-    PFN_vkGetPhysicalDeviceQueueFamilyProperties GetPhysicalDeviceQueueFamilyProperties = nullptr;
+    // Instance level functions
+    VK_HELPER_INSTANCE_FUNCTIONS(VK_HELPER_DECLARE_FUNCTION)
 
-    // GET_DEVICE_PROC functions
-    PFN_vkAcquireNextImageKHR AcquireNextImageKHR = nullptr;
-    PFN_vkAllocateCommandBuffers AllocateCommandBuffers = nullptr;
-    PFN_vkAllocateDescriptorSets AllocateDescriptorSets = nullptr;
-    PFN_vkAllocateMemory AllocateMemory = nullptr;
-    PFN_vkBeginCommandBuffer BeginCommandBuffer = nullptr;
-    PFN_vkBindBufferMemory BindBufferMemory = nullptr;
-    PFN_vkBindImageMemory BindImageMemory = nullptr;
-    PFN_vkCmdBeginRenderPass CmdBeginRenderPass = nullptr;
-    PFN_vkCmdBindDescriptorSets CmdBindDescriptorSets = nullptr;
-    PFN_vkCmdBindPipeline CmdBindPipeline = nullptr;
-    PFN_vkCmdBindVertexBuffers CmdBindVertexBuffers = nullptr;
-    PFN_vkCmdCopyImage CmdCopyImage = nullptr;
-    PFN_vkCmdDraw CmdDraw = nullptr;
-    PFN_vkCmdEndRenderPass CmdEndRenderPass = nullptr;
-    PFN_vkCmdPipelineBarrier CmdPipelineBarrier = nullptr;
-    PFN_vkCmdPushConstants CmdPushConstants = nullptr;
-    PFN_vkCmdSetScissor CmdSetScissor = nullptr;
-    PFN_vkCmdSetViewport CmdSetViewport = nullptr;
-    PFN_vkCreateBuffer CreateBuffer = nullptr;
-    PFN_vkCreateCommandPool CreateCommandPool = nullptr;
-    PFN_vkCreateDescriptorPool CreateDescriptorPool = nullptr;
-    PFN_vkCreateDescriptorSetLayout CreateDescriptorSetLayout = nullptr;
-    PFN_vkCreateFence CreateFence = nullptr;
-    PFN_vkCreateFramebuffer CreateFramebuffer = nullptr;
-    PFN_vkCreateGraphicsPipelines CreateGraphicsPipelines = nullptr;
-    PFN_vkCreateImage CreateImage = nullptr;
-    PFN_vkCreateImageView CreateImageView = nullptr;
-    PFN_vkCreatePipelineLayout CreatePipelineLayout = nullptr;
-    PFN_vkCreateRenderPass CreateRenderPass = nullptr;
-    PFN_vkCreateSampler CreateSampler = nullptr;
-    PFN_vkCreateSemaphore CreateSemaphore = nullptr;
-    PFN_vkCreateShaderModule CreateShaderModule = nullptr;
-    PFN_vkCreateSwapchainKHR CreateSwapchainKHR = nullptr;
-    PFN_vkDestroyBuffer DestroyBuffer = nullptr;
-    PFN_vkDestroyCommandPool DestroyCommandPool = nullptr;
-    PFN_vkDestroyDescriptorPool DestroyDescriptorPool = nullptr;
-    PFN_vkDestroyDescriptorSetLayout DestroyDescriptorSetLayout = nullptr;
-    PFN_vkDestroyDevice DestroyDevice = nullptr;
-    PFN_vkDestroyFence DestroyFence = nullptr;
-    PFN_vkDestroyFramebuffer DestroyFramebuffer = nullptr;
-    PFN_vkDestroyImage DestroyImage = nullptr;
-    PFN_vkDestroyImageView DestroyImageView = nullptr;
-    PFN_vkDestroyPipeline DestroyPipeline = nullptr;
-    PFN_vkDestroyPipelineLayout DestroyPipelineLayout = nullptr;
-    PFN_vkDestroyRenderPass DestroyRenderPass = nullptr;
-    PFN_vkDestroySampler DestroySampler = nullptr;
-    PFN_vkDestroySemaphore DestroySemaphore = nullptr;
-    PFN_vkDestroyShaderModule DestroyShaderModule = nullptr;
-    PFN_vkDestroySwapchainKHR DestroySwapchainKHR = nullptr;
-    PFN_vkDeviceWaitIdle DeviceWaitIdle = nullptr;
-    PFN_vkEndCommandBuffer EndCommandBuffer = nullptr;
-    PFN_vkFreeCommandBuffers FreeCommandBuffers = nullptr;
-    PFN_vkFreeMemory FreeMemory = nullptr;
-    PFN_vkGetBufferMemoryRequirements GetBufferMemoryRequirements = nullptr;
-    PFN_vkGetDeviceQueue GetDeviceQueue = nullptr;
-    PFN_vkGetImageMemoryRequirements GetImageMemoryRequirements = nullptr;
-    PFN_vkGetImageSubresourceLayout GetImageSubresourceLayout = nullptr;
-    PFN_vkGetSwapchainImagesKHR GetSwapchainImagesKHR = nullptr;
-    PFN_vkMapMemory MapMemory = nullptr;
-    PFN_vkQueuePresentKHR QueuePresentKHR = nullptr;
-    PFN_vkQueueSubmit QueueSubmit = nullptr;
-    PFN_vkResetFences ResetFences = nullptr;
-    PFN_vkUnmapMemory UnmapMemory = nullptr;
-    PFN_vkUpdateDescriptorSets UpdateDescriptorSets = nullptr;
-    PFN_vkWaitForFences WaitForFences = nullptr;
+    // Global functions
+    VK_HELPER_GLOBAL_FUNCTIONS(VK_HELPER_DECLARE_FUNCTION)
 };
@@ -14,39 +14,23 @@
  * limitations under the License.
  */
 
-#include <android/choreographer.h>
 #include <android_native_app_glue.h>
 
 #include "Engine.h"
 #include "Utils.h"
 
-static void onChoreographer(int64_t frameTimeNanos, void* data) {
-    if (!data) {
-        return;
-    }
-
-    auto engine = static_cast<Engine*>(data);
-    if (!engine->isReady()) {
-        return;
-    }
-
-    AChoreographer_postFrameCallbackDelayed64(AChoreographer_getInstance(), onChoreographer, engine,
-                                              engine->getDelayMillis(frameTimeNanos));
-
-    engine->drawFrame();
-}
-
 static void handleAppCmd(android_app* app, int32_t cmd) {
     auto engine = static_cast<Engine*>(app->userData);
     switch (cmd) {
         case APP_CMD_INIT_WINDOW:
             engine->onInitWindow(app->window, app->activity->assetManager);
-            AChoreographer_postFrameCallback64(AChoreographer_getInstance(), onChoreographer,
-                                               engine);
             break;
         case APP_CMD_TERM_WINDOW:
             engine->onTermWindow();
             break;
+        case APP_CMD_LOW_MEMORY:
+            engine->onLowMemory();
+            break;
         default:
             break;
     }
@@ -65,16 +49,14 @@ static void handleNativeWindowResized(ANativeActivity* activity, ANativeWindow*
 }
 
 void android_main(android_app* app) {
-    Engine engine;
+    Benchmark::Config benchmarkConfig;
+    const bool isBenchmark = Benchmark::readConfig(app->activity, &benchmarkConfig);
+    Engine engine(app->activity, isBenchmark ? &benchmarkConfig : nullptr);
 
     app->userData = &engine;
     app->onAppCmd = handleAppCmd;
     app->activity->callbacks->onNativeWindowResized = handleNativeWindowResized;
 
-    if (AChoreographer_getInstance() == nullptr) {
-        return;
-    }
-
     while (true) {
         int events;
         android_poll_source* source;